@@ -5,7 +5,11 @@ set common_compiler_flags=-Od -fp:fast -nologo -MT -Oi -Gm- -GR- -EHa- -W4 -WX -
 IF NOT EXIST ..\bin mkdir ..\bin
 pushd ..\bin
 
-cl %common_compiler_flags% ..\src\haversine.cpp -Fmhaversine.map /link -incremental:no -opt:ref
+REM Library for embedding: haversine_lib.h is its public API
+cl %common_compiler_flags% -c ..\src\haversine_lib.cpp
+lib -nologo haversine_lib.obj -out:haversine_lib.lib
+
+cl %common_compiler_flags% ..\src\haversine.cpp haversine_lib.lib -Fmhaversine.map /link -incremental:no -opt:ref
 
 popd
 
@@ -1,16 +1,21 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <time.h>
+#if _MSC_VER
 #include <intrin.h>
+#else
+#include <x86intrin.h>
+#endif
 #include <float.h>
 #include <stdint.h>
 #include <string.h>
 
+#include "haversine_lib.h"
 #include "haversine.h"
+#include "haversine_platform.h"
 
-//
-// See: https://www.json.org/json-en.html
-//
+#include "haversine_batch.cpp"
+#include "haversine_validate.cpp"
 
 f32 random_value(f32 min, f32 max)
 {
@@ -51,379 +56,114 @@ void generate_json(u32 n)
     }
 }
 
-char * read_entire_file(char *filename)
+void print_usage(char *program_name)
 {
-    char *result = 0;
-    
-    FILE *file = fopen(filename, "r");
-    if (file)
-    {
-        fseek(file, 0, SEEK_END);
-        size_t file_size = ftell(file);
-        fseek(file, 0, SEEK_SET);
-        
-        result = (char *)malloc(file_size + 1);
-        fread(result, file_size, 1, file);
-        result[file_size] = '\0';
-        
-        fclose(file);
-    }
-    
-    return result;
+    fprintf(stderr, "USAGE: %s [pairs json file]\n", program_name);
+    fprintf(stderr, "       %s --batch [directory or manifest] [--threads n] [--output file]\n", program_name);
+    fprintf(stderr, "       %s --validate [pairs json file] [--pipeline fragments|document] [--ulp n] [--threads n] [--report n]\n", program_name);
+    fprintf(stderr, "    A manifest is a text file with one json file path per line.\n");
+    fprintf(stderr, "    --validate compares the optimized pipeline against the reference parser and haversine.\n");
 }
 
-inline bool is_end_of_line(char c)
+int main(int argc, char** argv)
 {
-    bool result = (c == '\n' ||
-                   c == '\r');
+#if 0
+    if (argc < 2) {
+        fprintf(stderr, "USAGE: %s [number of entries to generate]\n", argv[0]);
+        return 1;
+    }
     
-    return result;
-}
-
-inline bool is_whitespace(char c)
-{
-    bool result = (c == ' ' ||
-                   c == '\t' ||
-                   is_end_of_line(c));
+    u32 n = atoi(argv[1]);
+    generate_json(n);
+#endif
     
-    return result;
-}
-
-inline void eat_all_whitespaces(Tokenizer *tokenizer)
-{
-    while (is_whitespace(tokenizer->at[0])) {
-        if (is_end_of_line(tokenizer->at[0])) {
-            ++tokenizer->line;
+    if (argc > 1 && strcmp(argv[1], "--batch") == 0) {
+        if (argc < 3) {
+            print_usage(argv[0]);
+            return 1;
+        }
+        
+        char *input = argv[2];
+        char *output_path = 0;
+        u32 thread_count = 0;
+        for (int i = 3; i + 1 < argc; i += 2) {
+            if (strcmp(argv[i], "--threads") == 0) {
+                thread_count = atoi(argv[i + 1]);
+            } else if (strcmp(argv[i], "--output") == 0) {
+                output_path = argv[i + 1];
+            } else {
+                print_usage(argv[0]);
+                return 1;
+            }
         }
         
-        ++tokenizer->at;
+        return run_batch(input, output_path, thread_count);
     }
-}
-
-inline bool is_alpha(char c)
-{
-    bool result = ((c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z'));
-    
-    return result;
-}
-
-inline bool is_number(char c)
-{
-    bool result = (c >= '0' && c <= '9');
-    
-    return result;
-}
-
-Token get_token(Tokenizer *tokenizer, bool advance_tokenizer = true)
-{
-    eat_all_whitespaces(tokenizer);
-    
-    char *original_at = tokenizer->at;
-    
-    Token token = {};
-    token.buffer.size = 1;
-    token.buffer.data = tokenizer->at;
-    
-    char c = tokenizer->at[0];
-    ++tokenizer->at;
     
-    switch(c)
-    {
-        case '{': { token.type = TOKEN_TYPE_OPEN_BRACE; } break;
-        case '}': { token.type = TOKEN_TYPE_CLOSE_BRACE; } break;
-        case '[': { token.type = TOKEN_TYPE_OPEN_BRACKET; } break;
-        case ']': { token.type = TOKEN_TYPE_CLOSE_BRACKET; } break;
-        case ':': { token.type = TOKEN_TYPE_COLON; } break;
-        case ',': { token.type = TOKEN_TYPE_COMMA; } break;
-        case '\0': { token.type = TOKEN_TYPE_END_OF_STREAM; } break;
-        
-        case '"': {
-            token.type = TOKEN_TYPE_STRING;
-            
-            token.buffer.data = tokenizer->at;
-            while (tokenizer->at[0] && tokenizer->at[0] != '"') {
-                ++tokenizer->at;
-            }
-            
-            token.buffer.size = (u32)(tokenizer->at - token.buffer.data);
-            
-            ++tokenizer->at; // Skip last double quotes
-        } break;        
-
-        case '-':
-        case '0':
-        case '1':
-        case '2':
-        case '3':
-        case '4':
-        case '5':
-        case '6':
-        case '7':
-        case '8':
-        case '9':
-        {
-            token.type = TOKEN_TYPE_NUMBER;
-            token.buffer.data = --tokenizer->at;
-                
-            // TODO: Fix this. Now it works with correct decimal values, but it does not work with values like 1.e1
-            bool could_be_number = true;
-            bool could_be_dot = true;
-            bool could_be_e = true;
-                
-            while (tokenizer->at[0])
-            {
-                if (tokenizer->at[0] != '}' && 
-                    tokenizer->at[0] != ']' && 
-                    tokenizer->at[0] != ',' && 
-                    !is_whitespace(tokenizer->at[0]))
-                {
-                    if (could_be_number && is_number(tokenizer->at[0])) {
-                        ++tokenizer->at;
-                        if (!could_be_dot) {
-                            could_be_e = true;
-                        }
-                        if (!could_be_e) {
-                            could_be_dot = true;
-                        }
-                    } else if (could_be_dot && tokenizer->at[0] == '.') {
-                        ++tokenizer->at;
-                        could_be_dot = false;
-                    } else if (could_be_e && ((tokenizer->at[0] == 'e') ||
-                                              (tokenizer->at[0] == 'E'))) {
-                        ++tokenizer->at;
-                        could_be_dot = false;
-                        could_be_e = false;
-                    }
-                }
-                else
-                {
-                    break;
-                }
-            }
-                
-            token.buffer.size = (u32)(tokenizer->at - token.buffer.data);
-        } break;
+    if (argc > 1 && strcmp(argv[1], "--validate") == 0) {
+        if (argc < 3) {
+            print_usage(argv[0]);
+            return 1;
+        }
         
-        default: {
-            if (is_alpha(c)) {
-                token.buffer.data = --tokenizer->at;
-                while (tokenizer->at[0] && (is_alpha(c) &&
-                                            tokenizer->at[0] != '}' && 
-                                            tokenizer->at[0] != ']' && 
-                                            tokenizer->at[0] != ',' && 
-                                            !is_whitespace(tokenizer->at[0]))) {
-                    
-                    ++tokenizer->at;
-                }
-                
-                token.buffer.size = (u32)(tokenizer->at - token.buffer.data);
-                
-                if (strncmp(token.buffer.data, "true", 4) == 0 ||
-                    strncmp(token.buffer.data, "false", 5) == 0) {
-                    token.type = TOKEN_TYPE_BOOLEAN;
-                } else if (strncmp(token.buffer.data, "null", 4) == 0) {
-                    token.type = TOKEN_TYPE_NULL;
+        char *input = argv[2];
+        Validation_pipeline pipeline = VALIDATION_PIPELINE_FRAGMENTS;
+        u64 ulp_tolerance = 0;
+        u32 thread_count = 0;
+        u32 report_count = 10;
+        for (int i = 3; i + 1 < argc; i += 2) {
+            if (strcmp(argv[i], "--pipeline") == 0) {
+                if (strcmp(argv[i + 1], "document") == 0) {
+                    pipeline = VALIDATION_PIPELINE_DOCUMENT;
+                } else if (strcmp(argv[i + 1], "fragments") == 0) {
+                    pipeline = VALIDATION_PIPELINE_FRAGMENTS;
                 } else {
-                    fprintf(stderr, "Unrecognized literal value %.*s\n", token.buffer.size, token.buffer.data);
-                }                                
+                    print_usage(argv[0]);
+                    return 1;
+                }
+            } else if (strcmp(argv[i], "--ulp") == 0) {
+                ulp_tolerance = strtoull(argv[i + 1], 0, 10);
+            } else if (strcmp(argv[i], "--threads") == 0) {
+                thread_count = atoi(argv[i + 1]);
+            } else if (strcmp(argv[i], "--report") == 0) {
+                report_count = atoi(argv[i + 1]);
             } else {
-                fprintf(stderr, "Unrecognized literal value %.*s\n", token.buffer.size, token.buffer.data);
+                print_usage(argv[0]);
+                return 1;
             }
-            
-        } break;
-    }
-    
-    
-    if (advance_tokenizer) {
-        add_token(tokenizer, &token);
-    } else {
-        tokenizer->at = original_at;        
-    }
-    
-    return token;
-}
-
-inline bool require_token(Tokenizer *tokenizer, Token_type expected_type)
-{
-    Token token = get_token(tokenizer);
-    bool result = token.type == expected_type;
-    
-    return result;
-}
-
-void add_sibling(Json_element *element, Json_element *new_element)
-{
-    if (element) {
-        if (element->next_sibling) {
-            new_element->next_sibling = element->next_sibling;
         }
-
-        element->next_sibling = new_element;
+        
+        return run_validation(input, pipeline, ulp_tolerance, thread_count, report_count);
     }
-}
-
-Json_element * parse_object(Tokenizer *tokenizer)
-{
-    Json_element *result = 0;
-
-    while (tokenizer->parsing) {
-        Token name_token = get_token(tokenizer);
-        if (name_token.type != TOKEN_TYPE_STRING) {
-            fprintf(stderr, "Missing '\"' at line %d\n", tokenizer->line);
-            break;
-        }
     
-        if (!require_token(tokenizer, TOKEN_TYPE_COLON)) {
-            fprintf(stderr, "Missing ':' at line %d\n", tokenizer->line);
-            break;
-        }
-
-        Token value_token = get_token(tokenizer);
-        Json_element *element = parse_element(tokenizer, name_token.buffer, value_token);
-
-        if (result) {
-            add_sibling(result, element);
-        } else {
-            result = element;
-        }
-
-        Token token = get_token(tokenizer, false);
-        if (token.type == TOKEN_TYPE_COMMA) {
-            get_token(tokenizer);
-        } else {
-            break;
-        }
-    }
-
-    if (!require_token(tokenizer, TOKEN_TYPE_CLOSE_BRACE)) {
-        fprintf(stderr, "Expected } at line %d\n", tokenizer->line);
+    char *filename = "haversine.json";
+    if (argc > 1) {
+        filename = argv[1];
     }
-
-    return result;
-}
-
-Json_element * parse_array(Tokenizer *tokenizer)
-{
-    Json_element *result = 0;
     
-    while (tokenizer->parsing) {
-        Token value_token = get_token(tokenizer);
-        Json_element *element = parse_element(tokenizer, {}, value_token);
-
-        if (result) {
-            add_sibling(result, element);
-        } else {
-            result = element;
-        }
-
-        Token token = get_token(tokenizer, false);
-        if (token.type == TOKEN_TYPE_COMMA) {
-            get_token(tokenizer);
-        } else {
-            break;
-        }
-    }
+    Haversine_context *context = haversine_create_context();
     
-    if (!require_token(tokenizer, TOKEN_TYPE_CLOSE_BRACKET)) {
-        fprintf(stderr, "Expected ] at line %d\n", tokenizer->line);
-    }
-
-    return result;
-}
-
-Json_element * parse_element(Tokenizer *tokenizer, Buffer name, Token token_value)
-{
-    Json_element *sub_element = 0;
-
-    switch(token_value.type)
-    {
-        case TOKEN_TYPE_OPEN_BRACE: {
-            sub_element = parse_object(tokenizer);
-        } break;
+    int result = 0;
+    Haversine_pairs pairs = {};
+    if (haversine_parse_file(context, filename, &pairs)) {
+        f64 average = mean_distance(&pairs, pairs.count);
         
-        case TOKEN_TYPE_OPEN_BRACKET: {
-            sub_element = parse_array(tokenizer);
-        } break;
+        printf("Pair count: %zu\n", pairs.count);
+        printf("Haversine average: %.16f\n", average);
         
-        // Literal values string, number, boolean and null are skiped here
-        
-        case TOKEN_TYPE_END_OF_STREAM: {
-            tokenizer->parsing = false;
-        } break;
-    }
-
-    Json_element *result = (Json_element *)malloc(sizeof(Json_element));
-    result->name = name;
-    result->value = token_value.buffer;
-    result->first = sub_element;
-    result->next_sibling = 0;
-
-    return result;
-}
-
-void print_tokens(Tokenizer *tokenizer)
-{
-    Token *token = tokenizer->first;
-    while (token) {
-        printf("%.*s = %s\n", token->buffer.size, token->buffer.data, token_types[token->type]);
-        token = token->next;
-    }
-}
-
-Json_element * parse_json(char *json_content)
-{
-    Tokenizer tokenizer = {};
-    tokenizer.at = json_content;
-    tokenizer.line = 1;
-    tokenizer.parsing = true;
-    
-    Json_element *json_element = parse_element(&tokenizer, {}, get_token(&tokenizer));
-
-    return json_element;
-}
-
-void parse_haversine(char *json_content)
-{
-    Json_element *json = parse_json(json_content);
-    Json_element *pairs_array = get(json, "pairs");
-
-    if (pairs_array) {
-        for (Json_element *element = pairs_array->first; element; element = element->next_sibling) {
-            Buffer x0 = get(element, "x0")->value;
-            Buffer y0 = get(element, "y0")->value;
-            Buffer x1 = get(element, "x1")->value;
-            Buffer y1 = get(element, "y1")->value;
-
-            printf("{ \"x0\": %.*s, \"y0\": %.*s, \"x1\": %.*s, \"y1\": %.*s },\n",
-                   x0.size, x0.data,
-                   y0.size, y0.data,
-                   x1.size, x1.data,
-                   y1.size, y1.data);
+        Haversine_stats stats;
+        haversine_get_stats(context, &stats);
+        if (stats.input_bytes) {
+            printf("Bytes scanned per input byte: %.3f\n", (f64)stats.scanned_bytes / (f64)stats.input_bytes);
         }
-    }
-}
-
-int main(int argc, char** argv)
-{
-#if 0
-    if (argc < 2) {
-        fprintf(stderr, "USAGE: %s [number of entries to generate]\n", argv[0]);
-        return 1;
-    }
-    
-    u32 n = atoi(argv[1]);
-    generate_json(n);
-#endif
-    
-    char *filename = "haversine.json";
-//    char *filename = "test.json";
-    char *json_content = read_entire_file(filename);
-    if (json_content) {
-        parse_haversine(json_content);
-        printf("Done\n");
+        
+        haversine_release_pairs(&pairs);
     } else {
-        fprintf(stderr, "ERROR: Could not open file %s\n", filename);
+        fprintf(stderr, "ERROR: %s\n", haversine_get_error(context));
+        result = 1;
     }
     
-    return 0;
+    haversine_release_context(context);
+    
+    return result;
 }
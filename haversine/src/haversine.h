@@ -24,21 +24,110 @@ typedef double f64;
 #define MAX_RAND 24568.0f
 
 //
-// Lexer
+// Memory
 //
 
-struct Token;
+struct Memory_block {
+    Memory_block *prev;
+    size_t size;
+    size_t used;
+};
 
-struct Tokenizer {
-    char *at;
-    u32 line;
+// Growable arena made of chained blocks. Every context owns one, so independent
+// contexts never share allocation state.
+struct Memory_arena {
+    Memory_block *current;
+    size_t minimum_block_size;
+};
 
-    bool parsing;
+#define DEFAULT_ARENA_BLOCK_SIZE (4*1024*1024)
 
-    Token *first;
-    Token *last;
+// Zeroed bytes appended after any JSON content handed to the tokenizer, so the
+// lexer can always read a '\0' terminator (and a bit past it) safely.
+#define JSON_CONTENT_PADDING 64
+
+#define push_struct(arena, type) (type *)push_size(arena, sizeof(type))
+#define push_array(arena, count, type) (type *)push_size(arena, (count)*sizeof(type))
+
+inline void * push_size(Memory_arena *arena, size_t size, size_t alignment = 8)
+{
+    Memory_block *block = arena->current;
+    size_t offset = 0;
+    if (block) {
+        offset = (block->used + (alignment - 1)) & ~(alignment - 1);
+    }
+    
+    if (!block || (offset + size) > block->size) {
+        size_t block_size = arena->minimum_block_size ? arena->minimum_block_size : DEFAULT_ARENA_BLOCK_SIZE;
+        if (block_size < size) {
+            block_size = size;
+        }
+        
+        Memory_block *new_block = (Memory_block *)malloc(sizeof(Memory_block) + block_size);
+        if (!new_block) {
+            return 0;
+        }
+        
+        new_block->prev = block;
+        new_block->size = block_size;
+        new_block->used = 0;
+        
+        arena->current = new_block;
+        block = new_block;
+        offset = 0;
+    }
+    
+    void *result = (char *)(block + 1) + offset;
+    block->used = offset + size;
+    
+    return result;
+}
+
+// Keeps the most recent (largest) block around so a reused arena stops hitting malloc.
+inline void clear_arena(Memory_arena *arena)
+{
+    Memory_block *block = arena->current;
+    if (block) {
+        Memory_block *prev = block->prev;
+        while (prev) {
+            Memory_block *to_free = prev;
+            prev = prev->prev;
+            free(to_free);
+        }
+        
+        block->prev = 0;
+        block->used = 0;
+    }
+}
+
+inline void free_arena(Memory_arena *arena)
+{
+    Memory_block *block = arena->current;
+    while (block) {
+        Memory_block *to_free = block;
+        block = block->prev;
+        free(to_free);
+    }
+    
+    arena->current = 0;
+}
+
+//
+// Context
+//
+
+struct Haversine_context {
+    Memory_arena arena;
+    Haversine_stats stats;
+    
+    bool has_error;
+    char error[256];
 };
 
+//
+// Lexer
+//
+
 #define FOREACH_TOKEN_TYPE(GENERATION_TYPE)     \
     GENERATION_TYPE(TOKEN_TYPE_UNKNOWN)         \
     GENERATION_TYPE(TOKEN_TYPE_OPEN_BRACKET)    \
@@ -90,10 +179,30 @@ struct Token {
     Token_type type;
 
     Buffer buffer;
+    bool has_escapes; // Strings only
     
     Token *next;
 };
 
+struct Tokenizer {
+    char *at;
+    u32 line;
+
+    bool parsing;
+    
+    // One token lookahead filled by peek_token()
+    bool has_lookahead;
+    Token lookahead;
+    
+    u64 bytes_scanned;
+    
+    Haversine_context *context;
+
+    // Only filled when record_tokens is set, to debug with print_tokens().
+    bool record_tokens;
+    Token *first;
+    Token *last;
+};
 
 //
 // Parser
@@ -112,43 +221,31 @@ enum Json_value_type {
 struct Json_element {
     Buffer name;
     Buffer value;
+    Token_type value_type;
+    bool name_has_escapes;
+    bool value_has_escapes;
 
     Json_element *first;
     Json_element *next_sibling;
 };
 
-Json_element * parse_element(Tokenizer *tokenizer, Buffer name, Token token_value);
+Json_element * parse_element(Tokenizer *tokenizer, Token name, Token token_value);
 Json_element * parse_object(Tokenizer *tokenizer);
 Json_element * parse_array(Tokenizer *tokenizer);
 
 inline void add_token(Tokenizer *tokenizer, Token *token)
 {
-    Token *new_token = (Token *)malloc(sizeof(Token));
+    Token *new_token = push_struct(&tokenizer->context->arena, Token);
     *new_token = *token;
+    new_token->next = 0;
     
     if (!tokenizer->first) {
         tokenizer->first = new_token;
         tokenizer->last = new_token;
-        
-        tokenizer->first->next = tokenizer->last;
     } else {
         tokenizer->last->next = new_token;
         tokenizer->last = new_token;
     }
 }
 
-inline Json_element * get(Json_element *json, char *name)
-{
-    Json_element *element = json->first;
-    while (element) {
-        if (strncmp(element->name.data, name, element->name.size) == 0) {
-            break;
-        }
-
-        element = element->next_sibling;
-    }
-
-    return element;
-}
-
 #endif //HAVERSINE_H
@@ -0,0 +1,552 @@
+//
+// Batch mode: process many pair files in one run on a work-stealing thread pool.
+//
+// Files are scheduled by size: small files are grouped into one task, medium files
+// get a task each and big files are split at pair boundaries into chunks that any
+// worker can steal. Every worker keeps its own Haversine_context, so the parser
+// arena is reused from task to task.
+//
+
+#define BATCH_GROUP_BYTES (1*1024*1024)  // Small files are grouped until they add up to this
+#define BATCH_SPLIT_BYTES (8*1024*1024)  // Files bigger than this are split in chunks
+#define BATCH_CHUNK_BYTES (2*1024*1024)
+
+// Room left in every queue for the chunks of split files, past that they run inline.
+#define WORK_QUEUE_CHUNK_SLOTS 4096
+
+enum Batch_task_type {
+    BATCH_TASK_FILES,
+    BATCH_TASK_SPLIT_FILE,
+    BATCH_TASK_CHUNK,
+};
+
+struct Batch_chunk {
+    size_t begin;
+    size_t end;
+
+    bool ok;
+    u64 pair_count;
+    f64 distance_sum;
+    char error[128];
+};
+
+struct Batch_file {
+    char *path;
+    s64 size;
+
+    bool ok;
+    u64 pair_count;
+    f64 distance_sum;
+    char error[128];
+
+    // Only used while a split file is in flight
+    char *content;
+    Batch_chunk *chunks;
+    u32 chunk_count;
+    s64 volatile chunks_remaining;
+};
+
+struct Batch_task {
+    Batch_task_type type;
+
+    // BATCH_TASK_FILES: range in Batch::order. Otherwise, the file index and its chunk.
+    u32 first;
+    u32 count;
+};
+
+// Owner pushes and pops at the bottom, thieves take from the top, so the owner works
+// depth-first on its own chunks while idle workers steal the oldest (biggest) work.
+struct Work_queue {
+    Platform_mutex mutex;
+    u32 top;
+    u32 bottom;
+    u32 capacity;
+    Batch_task *tasks;
+};
+
+struct Batch;
+
+struct Batch_worker {
+    Batch *batch;
+    u32 index;
+    Haversine_context *context;
+    Thread_handle thread;
+
+    u64 tasks_done;
+    u64 tasks_stolen;
+    u64 bytes_processed;
+};
+
+struct Batch {
+    Batch_file *files;
+    u32 file_count;
+    u32 file_capacity;
+
+    // File indices sorted by decreasing size
+    u32 *order;
+
+    u32 worker_count;
+    Batch_worker *workers;
+    Work_queue *queues;
+
+    s64 volatile pending_tasks;
+};
+
+static bool push_task(Work_queue *queue, Batch_task task)
+{
+    bool result = false;
+
+    lock_mutex(&queue->mutex);
+    if ((queue->bottom - queue->top) < queue->capacity) {
+        queue->tasks[queue->bottom % queue->capacity] = task;
+        ++queue->bottom;
+        result = true;
+    }
+    unlock_mutex(&queue->mutex);
+
+    return result;
+}
+
+static bool pop_task(Work_queue *queue, Batch_task *task)
+{
+    bool result = false;
+
+    lock_mutex(&queue->mutex);
+    if (queue->bottom != queue->top) {
+        --queue->bottom;
+        *task = queue->tasks[queue->bottom % queue->capacity];
+        result = true;
+    }
+    unlock_mutex(&queue->mutex);
+
+    return result;
+}
+
+static bool steal_task(Work_queue *queue, Batch_task *task)
+{
+    bool result = false;
+
+    lock_mutex(&queue->mutex);
+    if (queue->bottom != queue->top) {
+        *task = queue->tasks[queue->top % queue->capacity];
+        ++queue->top;
+        result = true;
+    }
+    unlock_mutex(&queue->mutex);
+
+    return result;
+}
+
+static void add_batch_file(Batch *batch, const char *path, s64 size)
+{
+    if (batch->file_count == batch->file_capacity) {
+        batch->file_capacity = batch->file_capacity ? 2*batch->file_capacity : 256;
+        batch->files = (Batch_file *)realloc(batch->files, batch->file_capacity*sizeof(Batch_file));
+    }
+
+    Batch_file *file = batch->files + batch->file_count++;
+    *file = {};
+
+    size_t path_size = strlen(path) + 1;
+    file->path = (char *)malloc(path_size);
+    memcpy(file->path, path, path_size);
+    file->size = size;
+}
+
+static FILE_VISITOR(add_batch_file_visitor)
+{
+    add_batch_file((Batch *)user_data, path, size);
+}
+
+// One path per line. Empty lines are skipped.
+static bool read_manifest(Batch *batch, const char *manifest_path)
+{
+    FILE *manifest = fopen(manifest_path, "rb");
+    if (!manifest) {
+        return false;
+    }
+
+    char line[MAX_PATH];
+    while (fgets(line, sizeof(line), manifest)) {
+        size_t length = strlen(line);
+        while (length && (line[length - 1] == '\n' || line[length - 1] == '\r')) {
+            line[--length] = '\0';
+        }
+
+        if (length) {
+            add_batch_file(batch, line, get_file_size(line));
+        }
+    }
+
+    fclose(manifest);
+
+    return true;
+}
+
+static void set_file_error(Batch_file *file, const char *error)
+{
+    file->ok = false;
+    snprintf(file->error, sizeof(file->error), "%s", error);
+}
+
+static void process_single_file(Batch_worker *worker, Batch_file *file)
+{
+    Haversine_pairs pairs = {};
+    if (haversine_parse_file(worker->context, file->path, &pairs)) {
+        file->ok = true;
+        file->pair_count = pairs.count;
+        file->distance_sum = sum_distances(&pairs, pairs.count);
+
+        haversine_release_pairs(&pairs);
+    } else {
+        set_file_error(file, haversine_get_error(worker->context));
+    }
+
+    worker->bytes_processed += (file->size > 0) ? (u64)file->size : 0;
+}
+
+// Once every chunk is done, sum them in file order so results do not depend on scheduling.
+static void finish_split_file(Batch_file *file)
+{
+    file->ok = true;
+    for (u32 chunk_index = 0; chunk_index < file->chunk_count; ++chunk_index) {
+        Batch_chunk *chunk = file->chunks + chunk_index;
+        if (!chunk->ok) {
+            set_file_error(file, chunk->error);
+            break;
+        }
+
+        file->pair_count += chunk->pair_count;
+        file->distance_sum += chunk->distance_sum;
+    }
+
+    free(file->content);
+    free(file->chunks);
+    file->content = 0;
+    file->chunks = 0;
+}
+
+static void process_chunk(Batch_worker *worker, Batch_file *file, u32 chunk_index)
+{
+    Batch_chunk *chunk = file->chunks + chunk_index;
+
+    Haversine_pairs pairs = {};
+    if (haversine_parse_pairs_fragment(worker->context, file->content + chunk->begin, chunk->end - chunk->begin, &pairs)) {
+        chunk->ok = true;
+        chunk->pair_count = pairs.count;
+        chunk->distance_sum = sum_distances(&pairs, pairs.count);
+
+        haversine_release_pairs(&pairs);
+    } else {
+        snprintf(chunk->error, sizeof(chunk->error), "%s", haversine_get_error(worker->context));
+    }
+
+    worker->bytes_processed += chunk->end - chunk->begin;
+
+    if (atomic_add_s64(&file->chunks_remaining, -1) == 0) {
+        finish_split_file(file);
+    }
+}
+
+static void split_file(Batch_worker *worker, u32 file_index)
+{
+    Batch *batch = worker->batch;
+    Batch_file *file = batch->files + file_index;
+
+    FILE *handle = fopen(file->path, "rb");
+    if (!handle) {
+        set_file_error(file, "Could not open file");
+        return;
+    }
+
+    size_t size = (size_t)file->size;
+    file->content = (char *)malloc(size + JSON_CONTENT_PADDING);
+    if (!file->content) {
+        set_file_error(file, "Could not allocate the file content");
+        fclose(handle);
+        return;
+    }
+
+    size = fread(file->content, 1, size, handle);
+    memset(file->content + size, 0, JSON_CONTENT_PADDING);
+    fclose(handle);
+
+    size_t begin = haversine_find_pairs_begin(file->content, size);
+    if (!begin) {
+        set_file_error(file, "Missing \"pairs\" array");
+        free(file->content);
+        file->content = 0;
+        return;
+    }
+
+    u32 chunk_count = (u32)((size - begin + BATCH_CHUNK_BYTES - 1) / BATCH_CHUNK_BYTES);
+    file->chunks = (Batch_chunk *)calloc(chunk_count, sizeof(Batch_chunk));
+    if (!file->chunks) {
+        set_file_error(file, "Could not allocate the file chunks");
+        free(file->content);
+        file->content = 0;
+        return;
+    }
+
+    // Chunks end on pair boundaries, so there can be fewer of them than estimated.
+    u32 actual_count = 0;
+    size_t at = begin;
+    while (at < size && actual_count < chunk_count) {
+        Batch_chunk *chunk = file->chunks + actual_count++;
+        chunk->begin = at;
+        chunk->end = haversine_next_pair_boundary(file->content, size, at, at + BATCH_CHUNK_BYTES);
+        at = chunk->end;
+    }
+
+    if (actual_count) {
+        file->chunks[actual_count - 1].end = size;
+    }
+
+    file->chunk_count = actual_count;
+    file->chunks_remaining = actual_count;
+
+    if (!actual_count) {
+        finish_split_file(file);
+        return;
+    }
+
+    atomic_add_s64(&batch->pending_tasks, actual_count);
+
+    Work_queue *queue = batch->queues + worker->index;
+    for (u32 chunk_index = 0; chunk_index < actual_count; ++chunk_index) {
+        Batch_task task = {BATCH_TASK_CHUNK, file_index, chunk_index};
+        if (!push_task(queue, task)) {
+            // Queue full: do it now instead
+            process_chunk(worker, file, chunk_index);
+            atomic_add_s64(&batch->pending_tasks, -1);
+        }
+    }
+}
+
+static void run_task(Batch_worker *worker, Batch_task task)
+{
+    Batch *batch = worker->batch;
+
+    switch (task.type)
+    {
+        case BATCH_TASK_FILES: {
+            for (u32 i = 0; i < task.count; ++i) {
+                process_single_file(worker, batch->files + batch->order[task.first + i]);
+            }
+        } break;
+
+        case BATCH_TASK_SPLIT_FILE: {
+            split_file(worker, task.first);
+        } break;
+
+        case BATCH_TASK_CHUNK: {
+            process_chunk(worker, batch->files + task.first, task.count);
+        } break;
+    }
+
+    ++worker->tasks_done;
+    atomic_add_s64(&batch->pending_tasks, -1);
+}
+
+static THREAD_PROC(batch_worker_proc)
+{
+    Batch_worker *worker = (Batch_worker *)parameter;
+    Batch *batch = worker->batch;
+
+    while (batch->pending_tasks > 0) {
+        Batch_task task;
+        if (pop_task(batch->queues + worker->index, &task)) {
+            run_task(worker, task);
+            continue;
+        }
+
+        bool stole = false;
+        for (u32 i = 1; i < batch->worker_count; ++i) {
+            u32 victim = (worker->index + i) % batch->worker_count;
+            if (steal_task(batch->queues + victim, &task)) {
+                ++worker->tasks_stolen;
+                run_task(worker, task);
+                stole = true;
+                break;
+            }
+        }
+
+        if (!stole) {
+            yield_thread();
+        }
+    }
+
+    return 0;
+}
+
+// Build the initial tasks and deal them round-robin to the worker queues.
+static void schedule_batch(Batch *batch)
+{
+    batch->order = (u32 *)malloc(batch->file_count*sizeof(u32));
+    for (u32 i = 0; i < batch->file_count; ++i) {
+        batch->order[i] = i;
+    }
+    
+    // Biggest first, so the long tasks start early and the small groups fill the gaps.
+    for (u32 i = 1; i < batch->file_count; ++i) {
+        u32 value = batch->order[i];
+        s64 size = batch->files[value].size;
+        u32 j = i;
+        for (; j > 0 && batch->files[batch->order[j - 1]].size < size; --j) {
+            batch->order[j] = batch->order[j - 1];
+        }
+        batch->order[j] = value;
+    }
+    
+    u32 task_count = 0;
+    Batch_task *tasks = (Batch_task *)malloc(batch->file_count*sizeof(Batch_task));
+    
+    u32 index = 0;
+    while (index < batch->file_count) {
+        u32 file_index = batch->order[index];
+        s64 size = batch->files[file_index].size;
+        
+        Batch_task *task = tasks + task_count++;
+        *task = {};
+        if (size > BATCH_SPLIT_BYTES) {
+            task->type = BATCH_TASK_SPLIT_FILE;
+            task->first = file_index;
+            ++index;
+        } else {
+            task->type = BATCH_TASK_FILES;
+            task->first = index;
+            
+            s64 group_size = 0;
+            do {
+                group_size += batch->files[batch->order[index]].size;
+                ++task->count;
+                ++index;
+            } while (index < batch->file_count && (group_size + batch->files[batch->order[index]].size) <= BATCH_GROUP_BYTES);
+        }
+    }
+    
+    u32 tasks_per_queue = (task_count + batch->worker_count - 1) / batch->worker_count;
+    for (u32 i = 0; i < batch->worker_count; ++i) {
+        Work_queue *queue = batch->queues + i;
+        queue->capacity = tasks_per_queue + WORK_QUEUE_CHUNK_SLOTS;
+        queue->tasks = (Batch_task *)malloc(queue->capacity*sizeof(Batch_task));
+    }
+    
+    for (u32 i = 0; i < task_count; ++i) {
+        push_task(batch->queues + (i % batch->worker_count), tasks[i]);
+    }
+    batch->pending_tasks = task_count;
+    
+    free(tasks);
+}
+
+int run_batch(const char *input, const char *output_path, u32 worker_count)
+{
+    Batch batch = {};
+
+    if (is_directory(input)) {
+        list_json_files(input, add_batch_file_visitor, &batch);
+    } else if (!read_manifest(&batch, input)) {
+        fprintf(stderr, "ERROR: Could not open manifest %s\n", input);
+        return 1;
+    }
+
+    if (!batch.file_count) {
+        fprintf(stderr, "ERROR: No files to process in %s\n", input);
+        return 1;
+    }
+
+    FILE *output = stdout;
+    if (output_path) {
+        output = fopen(output_path, "w");
+        if (!output) {
+            fprintf(stderr, "ERROR: Could not open output file %s\n", output_path);
+            return 1;
+        }
+    }
+
+    if (!worker_count) {
+        worker_count = get_processor_count();
+    }
+
+    batch.worker_count = worker_count;
+    batch.workers = (Batch_worker *)calloc(worker_count, sizeof(Batch_worker));
+    batch.queues = (Work_queue *)calloc(worker_count, sizeof(Work_queue));
+    for (u32 i = 0; i < worker_count; ++i) {
+        init_mutex(&batch.queues[i].mutex);
+
+        Batch_worker *worker = batch.workers + i;
+        worker->batch = &batch;
+        worker->index = i;
+        worker->context = haversine_create_context();
+    }
+
+    f64 start_seconds = get_seconds();
+
+    schedule_batch(&batch);
+
+    // Worker 0 is this thread
+    for (u32 i = 1; i < worker_count; ++i) {
+        batch.workers[i].thread = create_thread(batch_worker_proc, batch.workers + i);
+    }
+    batch_worker_proc(batch.workers);
+    for (u32 i = 1; i < worker_count; ++i) {
+        join_thread(batch.workers[i].thread);
+    }
+
+    f64 elapsed_seconds = get_seconds() - start_seconds;
+
+    u32 failed_count = 0;
+    u64 total_pairs = 0;
+    u64 total_bytes = 0;
+    f64 total_sum = 0;
+    for (u32 i = 0; i < batch.file_count; ++i) {
+        Batch_file *file = batch.files + i;
+        if (file->ok) {
+            f64 average = file->pair_count ? (file->distance_sum / (f64)file->pair_count) : 0;
+            fprintf(output, "%s\t%llu\t%.16f\n", file->path, (unsigned long long)file->pair_count, average);
+
+            total_pairs += file->pair_count;
+            total_sum += file->distance_sum;
+        } else {
+            fprintf(output, "%s\tERROR\t%s\n", file->path, file->error);
+            ++failed_count;
+        }
+
+        total_bytes += (file->size > 0) ? (u64)file->size : 0;
+    }
+
+    f64 total_average = total_pairs ? (total_sum / (f64)total_pairs) : 0;
+    f64 megabytes = (f64)total_bytes / (1024.0*1024.0);
+
+    fprintf(output, "# Files: %u (%u failed)\n", batch.file_count, failed_count);
+    fprintf(output, "# Pair count: %llu\n", (unsigned long long)total_pairs);
+    fprintf(output, "# Haversine average: %.16f\n", total_average);
+    fprintf(output, "# Time: %.3fs with %u threads, %.2f MB/s\n", elapsed_seconds, worker_count,
+            elapsed_seconds > 0 ? (megabytes / elapsed_seconds) : 0);
+    for (u32 i = 0; i < worker_count; ++i) {
+        Batch_worker *worker = batch.workers + i;
+        fprintf(output, "#   worker %u: %llu tasks (%llu stolen), %.2f MB\n", i,
+                (unsigned long long)worker->tasks_done, (unsigned long long)worker->tasks_stolen,
+                (f64)worker->bytes_processed / (1024.0*1024.0));
+    }
+
+    if (output != stdout) {
+        fclose(output);
+    }
+
+    for (u32 i = 0; i < worker_count; ++i) {
+        haversine_release_context(batch.workers[i].context);
+        destroy_mutex(&batch.queues[i].mutex);
+        free(batch.queues[i].tasks);
+    }
+    for (u32 i = 0; i < batch.file_count; ++i) {
+        free(batch.files[i].path);
+    }
+    free(batch.files);
+    free(batch.order);
+    free(batch.workers);
+    free(batch.queues);
+
+    return failed_count ? 1 : 0;
+}
@@ -0,0 +1,1142 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <math.h>
+#include <float.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "haversine_lib.h"
+#include "haversine.h"
+
+#if _MSC_VER
+#include <intrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+//
+// See: https://www.json.org/json-en.html
+//
+
+void tokenizer_error(Tokenizer *tokenizer, const char *format, ...)
+{
+    Haversine_context *context = tokenizer->context;
+    
+    // Keep the first error, the following ones are usually a consequence of it.
+    if (!context->has_error) {
+        va_list args;
+        va_start(args, format);
+        vsnprintf(context->error, sizeof(context->error), format, args);
+        va_end(args);
+        
+        context->has_error = true;
+    }
+    
+    tokenizer->parsing = false;
+}
+
+inline bool is_end_of_line(char c)
+{
+    bool result = (c == '\n' ||
+                   c == '\r');
+    
+    return result;
+}
+
+inline bool is_whitespace(char c)
+{
+    bool result = (c == ' ' ||
+                   c == '\t' ||
+                   is_end_of_line(c));
+    
+    return result;
+}
+
+inline void eat_all_whitespaces(Tokenizer *tokenizer)
+{
+    while (is_whitespace(tokenizer->at[0])) {
+        if (is_end_of_line(tokenizer->at[0])) {
+            ++tokenizer->line;
+        }
+        
+        ++tokenizer->at;
+    }
+}
+
+inline bool is_alpha(char c)
+{
+    bool result = ((c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z'));
+    
+    return result;
+}
+
+inline bool is_number(char c)
+{
+    bool result = (c >= '0' && c <= '9');
+    
+    return result;
+}
+
+//
+// Strings
+//
+
+#if defined(__SSE2__) || defined(_M_X64)
+#define HAVERSINE_SSE2 1
+#endif
+
+#if HAVERSINE_SSE2
+
+inline u32 find_least_significant_set_bit(u64 value)
+{
+#if _MSC_VER
+    unsigned long index;
+    _BitScanForward64(&index, value);
+    u32 result = index;
+#else
+    u32 result = (u32)__builtin_ctzll(value);
+#endif
+    
+    return result;
+}
+
+inline u64 byte_mask(__m128i chunk0, __m128i chunk1, __m128i chunk2, __m128i chunk3, char c)
+{
+    __m128i value = _mm_set1_epi8(c);
+    u64 mask0 = (u32)_mm_movemask_epi8(_mm_cmpeq_epi8(chunk0, value));
+    u64 mask1 = (u32)_mm_movemask_epi8(_mm_cmpeq_epi8(chunk1, value));
+    u64 mask2 = (u32)_mm_movemask_epi8(_mm_cmpeq_epi8(chunk2, value));
+    u64 mask3 = (u32)_mm_movemask_epi8(_mm_cmpeq_epi8(chunk3, value));
+    
+    u64 result = mask0 | (mask1 << 16) | (mask2 << 32) | (mask3 << 48);
+    
+    return result;
+}
+
+// Bits of the characters escaped by a backslash in a 64-byte block, resolving whole
+// runs of backslashes at once: in a run, every other backslash escapes the next
+// character, starting from the first one. prev_escaped carries the first character
+// of the next block being escaped by a run that ends this block.
+inline u64 find_escaped(u64 backslash, u64 *prev_escaped)
+{
+    backslash &= ~*prev_escaped;
+    u64 follows_escape = (backslash << 1) | *prev_escaped;
+    
+    // Runs starting on odd bits overflow into the next even bit when added, which
+    // flips the parity of that run.
+    u64 even_bits = 0x5555555555555555ULL;
+    u64 odd_sequence_starts = backslash & ~even_bits & ~follows_escape;
+    u64 sequences_starting_on_even_bits = odd_sequence_starts + backslash;
+    *prev_escaped = (sequences_starting_on_even_bits < odd_sequence_starts) ? 1 : 0;
+    u64 invert_mask = sequences_starting_on_even_bits << 1;
+    
+    u64 result = (even_bits ^ invert_mask) & follows_escape;
+    
+    return result;
+}
+
+// Returns the closing quote of the string that starts at at, or the '\0' terminator if
+// there is none. The json content is padded, so reading a whole block past the
+// terminator is safe.
+static char * find_string_end(char *at, bool *has_escapes)
+{
+    u64 prev_escaped = 0;
+    u64 backslashes_seen = 0;
+    for (;;) {
+        __m128i chunk0 = _mm_loadu_si128((__m128i *)(at + 0));
+        __m128i chunk1 = _mm_loadu_si128((__m128i *)(at + 16));
+        __m128i chunk2 = _mm_loadu_si128((__m128i *)(at + 32));
+        __m128i chunk3 = _mm_loadu_si128((__m128i *)(at + 48));
+        
+        u64 quote = byte_mask(chunk0, chunk1, chunk2, chunk3, '"');
+        u64 backslash = byte_mask(chunk0, chunk1, chunk2, chunk3, '\\');
+        u64 terminator = byte_mask(chunk0, chunk1, chunk2, chunk3, '\0');
+        
+        u64 escaped = find_escaped(backslash, &prev_escaped);
+        u64 stop = (quote & ~escaped) | terminator;
+        if (stop) {
+            u32 index = find_least_significant_set_bit(stop);
+            u64 before_stop = ((u64)1 << index) - 1;
+            
+            *has_escapes = ((backslashes_seen | (backslash & before_stop)) != 0);
+            
+            return at + index;
+        }
+        
+        backslashes_seen |= backslash;
+        at += 64;
+    }
+}
+
+#else
+
+static char * find_string_end(char *at, bool *has_escapes)
+{
+    *has_escapes = false;
+    while (at[0] && at[0] != '"') {
+        if (at[0] == '\\') {
+            *has_escapes = true;
+            if (at[1]) {
+                ++at;
+            }
+        }
+        
+        ++at;
+    }
+    
+    return at;
+}
+
+#endif
+
+inline u32 parse_hex_digit(char c)
+{
+    u32 result = 0xFFFFFFFF;
+    if (c >= '0' && c <= '9') {
+        result = c - '0';
+    } else if (c >= 'a' && c <= 'f') {
+        result = 10 + (c - 'a');
+    } else if (c >= 'A' && c <= 'F') {
+        result = 10 + (c - 'A');
+    }
+    
+    return result;
+}
+
+// Code unit of a \uXXXX sequence at at, or 0xFFFFFFFF if it is not one.
+inline u32 parse_unicode_escape(char *at, char *end)
+{
+    u32 result = 0xFFFFFFFF;
+    if ((end - at) >= 6 && at[0] == '\\' && at[1] == 'u') {
+        u32 code = 0;
+        for (int i = 2; i < 6; ++i) {
+            u32 digit = parse_hex_digit(at[i]);
+            if (digit > 0xF) {
+                return result;
+            }
+            
+            code = (code << 4) | digit;
+        }
+        
+        result = code;
+    }
+    
+    return result;
+}
+
+inline u32 encode_utf8(u32 code_point, char *out)
+{
+    u32 size;
+    if (code_point < 0x80) {
+        out[0] = (char)code_point;
+        size = 1;
+    } else if (code_point < 0x800) {
+        out[0] = (char)(0xC0 | (code_point >> 6));
+        out[1] = (char)(0x80 | (code_point & 0x3F));
+        size = 2;
+    } else if (code_point < 0x10000) {
+        out[0] = (char)(0xE0 | (code_point >> 12));
+        out[1] = (char)(0x80 | ((code_point >> 6) & 0x3F));
+        out[2] = (char)(0x80 | (code_point & 0x3F));
+        size = 3;
+    } else {
+        out[0] = (char)(0xF0 | (code_point >> 18));
+        out[1] = (char)(0x80 | ((code_point >> 12) & 0x3F));
+        out[2] = (char)(0x80 | ((code_point >> 6) & 0x3F));
+        out[3] = (char)(0x80 | (code_point & 0x3F));
+        size = 4;
+    }
+    
+    return size;
+}
+
+// Decode the escape sequence that starts at *at (on its backslash) as UTF-8 into out,
+// which needs room for 4 bytes. Advances *at past the sequence and returns the size
+// written. Surrogate pairs are combined; lone surrogates become U+FFFD.
+static u32 decode_escape(char **at, char *end, char *out)
+{
+    char *escape = *at;
+    u32 size = 1;
+    
+    if ((end - escape) < 2) {
+        out[0] = '\\';
+        *at = end;
+        return size;
+    }
+    
+    *at = escape + 2;
+    switch (escape[1])
+    {
+        case '"':  { out[0] = '"'; } break;
+        case '\\': { out[0] = '\\'; } break;
+        case '/':  { out[0] = '/'; } break;
+        case 'b':  { out[0] = '\b'; } break;
+        case 'f':  { out[0] = '\f'; } break;
+        case 'n':  { out[0] = '\n'; } break;
+        case 'r':  { out[0] = '\r'; } break;
+        case 't':  { out[0] = '\t'; } break;
+        
+        case 'u': {
+            u32 code_point = parse_unicode_escape(escape, end);
+            if (code_point == 0xFFFFFFFF) {
+                // Not valid hex, keep the text as is
+                out[0] = '\\';
+                *at = escape + 1;
+                break;
+            }
+            
+            *at = escape + 6;
+            if (code_point >= 0xD800 && code_point <= 0xDBFF) {
+                u32 low = parse_unicode_escape(*at, end);
+                if (low >= 0xDC00 && low <= 0xDFFF) {
+                    code_point = 0x10000 + ((code_point - 0xD800) << 10) + (low - 0xDC00);
+                    *at += 6;
+                } else {
+                    code_point = 0xFFFD;
+                }
+            } else if (code_point >= 0xDC00 && code_point <= 0xDFFF) {
+                code_point = 0xFFFD;
+            }
+            
+            size = encode_utf8(code_point, out);
+        } break;
+        
+        default: {
+            // Unknown escape, keep the character
+            out[0] = escape[1];
+        } break;
+    }
+    
+    return size;
+}
+
+// Decoded text of a string token. Strings without escapes (like every key of the
+// pairs files) come back as the same zero-copy slice; the others are decoded into
+// the arena, which never needs more room than the raw text.
+Buffer decode_json_string(Memory_arena *arena, Buffer raw, bool has_escapes)
+{
+    if (!has_escapes) {
+        return raw;
+    }
+    
+    Buffer result = {};
+    result.data = (char *)push_size(arena, raw.size + 4, 1);
+    
+    char *at = raw.data;
+    char *end = raw.data + raw.size;
+    while (at < end) {
+        if (at[0] == '\\') {
+            result.size += decode_escape(&at, end, result.data + result.size);
+        } else {
+            result.data[result.size++] = *at++;
+        }
+    }
+    
+    return result;
+}
+
+// Compare the decoded text of a string token with text, without allocating.
+bool json_string_equals(Buffer raw, bool has_escapes, const char *text)
+{
+    size_t text_size = strlen(text);
+    if (!has_escapes) {
+        bool result = ((size_t)raw.size == text_size) && (memcmp(raw.data, text, text_size) == 0);
+        
+        return result;
+    }
+    
+    char *at = raw.data;
+    char *end = raw.data + raw.size;
+    size_t matched = 0;
+    while (at < end) {
+        char decoded[4];
+        u32 size = 1;
+        if (at[0] == '\\') {
+            size = decode_escape(&at, end, decoded);
+        } else {
+            decoded[0] = *at++;
+        }
+        
+        if (matched + size > text_size || memcmp(text + matched, decoded, size) != 0) {
+            return false;
+        }
+        
+        matched += size;
+    }
+    
+    bool result = (matched == text_size);
+    
+    return result;
+}
+
+inline Json_element * get(Json_element *json, const char *name)
+{
+    Json_element *element = json->first;
+    while (element) {
+        if (json_string_equals(element->name, element->name_has_escapes, name)) {
+            break;
+        }
+
+        element = element->next_sibling;
+    }
+
+    return element;
+}
+
+//
+// Tokens
+//
+
+Token lex_token(Tokenizer *tokenizer)
+{
+    char *scan_start = tokenizer->at;
+    
+    eat_all_whitespaces(tokenizer);
+    
+    Token token = {};
+    token.buffer.size = 1;
+    token.buffer.data = tokenizer->at;
+    
+    char c = tokenizer->at[0];
+    ++tokenizer->at;
+    
+    switch(c)
+    {
+        case '{': { token.type = TOKEN_TYPE_OPEN_BRACE; } break;
+        case '}': { token.type = TOKEN_TYPE_CLOSE_BRACE; } break;
+        case '[': { token.type = TOKEN_TYPE_OPEN_BRACKET; } break;
+        case ']': { token.type = TOKEN_TYPE_CLOSE_BRACKET; } break;
+        case ':': { token.type = TOKEN_TYPE_COLON; } break;
+        case ',': { token.type = TOKEN_TYPE_COMMA; } break;
+        case '\0': { token.type = TOKEN_TYPE_END_OF_STREAM; } break;
+        
+        case '"': {
+            token.type = TOKEN_TYPE_STRING;
+            
+            // The token is the raw slice between the quotes; escapes are only decoded
+            // when someone asks for the string (see decode_json_string()).
+            token.buffer.data = tokenizer->at;
+            tokenizer->at = find_string_end(tokenizer->at, &token.has_escapes);
+            token.buffer.size = (u32)(tokenizer->at - token.buffer.data);
+            
+            if (tokenizer->at[0] == '"') {
+                ++tokenizer->at; // Skip last double quotes
+            } else {
+                tokenizer_error(tokenizer, "Unterminated string at line %d", tokenizer->line);
+            }
+        } break;        
+
+        case '-':
+        case '0':
+        case '1':
+        case '2':
+        case '3':
+        case '4':
+        case '5':
+        case '6':
+        case '7':
+        case '8':
+        case '9':
+        {
+            token.type = TOKEN_TYPE_NUMBER;
+            token.buffer.data = --tokenizer->at;
+                
+            // TODO: Fix this. Now it works with correct decimal values, but it does not work with values like 1.e1
+            bool could_be_number = true;
+            bool could_be_dot = true;
+            bool could_be_e = true;
+            
+            if (tokenizer->at[0] == '-') {
+                ++tokenizer->at;
+            }
+                
+            while (tokenizer->at[0])
+            {
+                if (tokenizer->at[0] != '}' && 
+                    tokenizer->at[0] != ']' && 
+                    tokenizer->at[0] != ',' && 
+                    !is_whitespace(tokenizer->at[0]))
+                {
+                    if (could_be_number && is_number(tokenizer->at[0])) {
+                        ++tokenizer->at;
+                        if (!could_be_dot) {
+                            could_be_e = true;
+                        }
+                        if (!could_be_e) {
+                            could_be_dot = true;
+                        }
+                    } else if (could_be_dot && tokenizer->at[0] == '.') {
+                        ++tokenizer->at;
+                        could_be_dot = false;
+                    } else if (could_be_e && ((tokenizer->at[0] == 'e') ||
+                                              (tokenizer->at[0] == 'E'))) {
+                        ++tokenizer->at;
+                        could_be_dot = false;
+                        could_be_e = false;
+                        
+                        if (tokenizer->at[0] == '-' || tokenizer->at[0] == '+') {
+                            ++tokenizer->at;
+                        }
+                    } else {
+                        // Not part of a number, the next token will report it.
+                        break;
+                    }
+                }
+                else
+                {
+                    break;
+                }
+            }
+                
+            token.buffer.size = (u32)(tokenizer->at - token.buffer.data);
+        } break;
+        
+        default: {
+            if (is_alpha(c)) {
+                token.buffer.data = --tokenizer->at;
+                while (tokenizer->at[0] && (is_alpha(c) &&
+                                            tokenizer->at[0] != '}' && 
+                                            tokenizer->at[0] != ']' && 
+                                            tokenizer->at[0] != ',' && 
+                                            !is_whitespace(tokenizer->at[0]))) {
+                    
+                    ++tokenizer->at;
+                }
+                
+                token.buffer.size = (u32)(tokenizer->at - token.buffer.data);
+                
+                if (strncmp(token.buffer.data, "true", 4) == 0 ||
+                    strncmp(token.buffer.data, "false", 5) == 0) {
+                    token.type = TOKEN_TYPE_BOOLEAN;
+                } else if (strncmp(token.buffer.data, "null", 4) == 0) {
+                    token.type = TOKEN_TYPE_NULL;
+                } else {
+                    tokenizer_error(tokenizer, "Unrecognized literal value %.*s", token.buffer.size, token.buffer.data);
+                }                                
+            } else {
+                tokenizer_error(tokenizer, "Unrecognized literal value %.*s", token.buffer.size, token.buffer.data);
+            }
+            
+        } break;
+    }
+    
+    tokenizer->bytes_scanned += (u64)(tokenizer->at - scan_start);
+    
+    return token;
+}
+
+// The lexed token stays in the lookahead slot until get_token() consumes it, so a
+// peek never lexes the same bytes twice.
+inline Token peek_token(Tokenizer *tokenizer)
+{
+    if (!tokenizer->has_lookahead) {
+        tokenizer->lookahead = lex_token(tokenizer);
+        tokenizer->has_lookahead = true;
+    }
+    
+    return tokenizer->lookahead;
+}
+
+Token get_token(Tokenizer *tokenizer)
+{
+    Token token;
+    if (tokenizer->has_lookahead) {
+        token = tokenizer->lookahead;
+        tokenizer->has_lookahead = false;
+    } else {
+        token = lex_token(tokenizer);
+    }
+    
+    if (tokenizer->record_tokens) {
+        add_token(tokenizer, &token);
+    }
+    
+    return token;
+}
+
+inline bool require_token(Tokenizer *tokenizer, Token_type expected_type)
+{
+    Token token = get_token(tokenizer);
+    bool result = token.type == expected_type;
+    
+    return result;
+}
+
+// Appends after last, so siblings keep the order they have in the file.
+inline void add_sibling(Json_element **first, Json_element **last, Json_element *new_element)
+{
+    if (*last) {
+        (*last)->next_sibling = new_element;
+    } else {
+        *first = new_element;
+    }
+    
+    *last = new_element;
+}
+
+Json_element * parse_object(Tokenizer *tokenizer)
+{
+    Json_element *result = 0;
+    Json_element *last = 0;
+
+    // An empty object goes straight to its }
+    bool has_members = (peek_token(tokenizer).type != TOKEN_TYPE_CLOSE_BRACE);
+    while (has_members && tokenizer->parsing) {
+        Token name_token = get_token(tokenizer);
+        if (name_token.type != TOKEN_TYPE_STRING) {
+            tokenizer_error(tokenizer, "Missing '\"' at line %d", tokenizer->line);
+            break;
+        }
+    
+        if (!require_token(tokenizer, TOKEN_TYPE_COLON)) {
+            tokenizer_error(tokenizer, "Missing ':' at line %d", tokenizer->line);
+            break;
+        }
+
+        Token value_token = get_token(tokenizer);
+        Json_element *element = parse_element(tokenizer, name_token, value_token);
+
+        add_sibling(&result, &last, element);
+
+        Token token = peek_token(tokenizer);
+        if (token.type == TOKEN_TYPE_COMMA) {
+            get_token(tokenizer);
+        } else {
+            break;
+        }
+    }
+
+    if (!require_token(tokenizer, TOKEN_TYPE_CLOSE_BRACE)) {
+        tokenizer_error(tokenizer, "Expected } at line %d", tokenizer->line);
+    }
+
+    return result;
+}
+
+Json_element * parse_array(Tokenizer *tokenizer)
+{
+    Json_element *result = 0;
+    Json_element *last = 0;
+    
+    // An empty array goes straight to its ]
+    bool has_elements = (peek_token(tokenizer).type != TOKEN_TYPE_CLOSE_BRACKET);
+    while (has_elements && tokenizer->parsing) {
+        Token value_token = get_token(tokenizer);
+        Json_element *element = parse_element(tokenizer, {}, value_token);
+
+        add_sibling(&result, &last, element);
+
+        Token token = peek_token(tokenizer);
+        if (token.type == TOKEN_TYPE_COMMA) {
+            get_token(tokenizer);
+        } else {
+            break;
+        }
+    }
+    
+    if (!require_token(tokenizer, TOKEN_TYPE_CLOSE_BRACKET)) {
+        tokenizer_error(tokenizer, "Expected ] at line %d", tokenizer->line);
+    }
+
+    return result;
+}
+
+Json_element * parse_element(Tokenizer *tokenizer, Token name, Token token_value)
+{
+    Json_element *sub_element = 0;
+
+    switch(token_value.type)
+    {
+        case TOKEN_TYPE_OPEN_BRACE: {
+            sub_element = parse_object(tokenizer);
+        } break;
+        
+        case TOKEN_TYPE_OPEN_BRACKET: {
+            sub_element = parse_array(tokenizer);
+        } break;
+        
+        // Literal values string, number, boolean and null are skiped here
+        
+        case TOKEN_TYPE_END_OF_STREAM: {
+            tokenizer->parsing = false;
+        } break;
+    }
+
+    Json_element *result = push_struct(&tokenizer->context->arena, Json_element);
+    result->name = name.buffer;
+    result->name_has_escapes = name.has_escapes;
+    result->value = token_value.buffer;
+    result->value_type = token_value.type;
+    result->value_has_escapes = token_value.has_escapes;
+    result->first = sub_element;
+    result->next_sibling = 0;
+
+    return result;
+}
+
+void print_tokens(Tokenizer *tokenizer)
+{
+    Token *token = tokenizer->first;
+    while (token) {
+        printf("%.*s = %s\n", token->buffer.size, token->buffer.data, token_types[token->type]);
+        token = token->next;
+    }
+}
+
+Json_element * parse_json(Haversine_context *context, char *json_content)
+{
+    Tokenizer tokenizer = {};
+    tokenizer.context = context;
+    tokenizer.at = json_content;
+    tokenizer.line = 1;
+    tokenizer.parsing = true;
+    
+    Json_element *json_element = parse_element(&tokenizer, {}, get_token(&tokenizer));
+    
+    context->stats.scanned_bytes += tokenizer.bytes_scanned;
+
+    return json_element;
+}
+
+//
+// Library API
+//
+
+static void set_error(Haversine_context *context, const char *format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    vsnprintf(context->error, sizeof(context->error), format, args);
+    va_end(args);
+    
+    context->has_error = true;
+}
+
+// False when the element is not a number, or strtod does not take the whole token.
+static bool parse_number(Json_element *element, f64 *value)
+{
+    if (element->value_type != TOKEN_TYPE_NUMBER) {
+        return false;
+    }
+    
+    char *end = 0;
+    *value = strtod(element->value.data, &end);
+    bool result = (end == element->value.data + element->value.size);
+    
+    return result;
+}
+
+static bool allocate_pairs(Haversine_pairs *pairs, size_t count)
+{
+    *pairs = {};
+    
+    // One block for the four arrays, so they are released together.
+    size_t array_size = count*sizeof(f64);
+    f64 *memory = (f64 *)malloc(4*array_size + 1);
+    if (!memory) {
+        return false;
+    }
+    
+    pairs->count = count;
+    pairs->x0 = memory;
+    pairs->y0 = memory + count;
+    pairs->x1 = memory + 2*count;
+    pairs->y1 = memory + 3*count;
+    
+    return true;
+}
+
+// Convert a list of pair objects into pairs, which are allocated here.
+static int fill_pairs(Haversine_context *context, Json_element *first, Haversine_pairs *pairs)
+{
+    size_t count = 0;
+    for (Json_element *element = first; element; element = element->next_sibling) {
+        ++count;
+    }
+    
+    if (!allocate_pairs(pairs, count)) {
+        set_error(context, "Could not allocate %zu pairs", count);
+        return 0;
+    }
+    
+    size_t index = 0;
+    for (Json_element *element = first; element; element = element->next_sibling) {
+        Json_element *x0 = get(element, "x0");
+        Json_element *y0 = get(element, "y0");
+        Json_element *x1 = get(element, "x1");
+        Json_element *y1 = get(element, "y1");
+        
+        if (!x0 || !y0 || !x1 || !y1) {
+            set_error(context, "Pair %zu is missing a coordinate", index);
+            haversine_release_pairs(pairs);
+            return 0;
+        }
+        
+        if (!parse_number(x0, pairs->x0 + index) ||
+            !parse_number(y0, pairs->y0 + index) ||
+            !parse_number(x1, pairs->x1 + index) ||
+            !parse_number(y1, pairs->y1 + index)) {
+            set_error(context, "Pair %zu has a coordinate that is not a number", index);
+            haversine_release_pairs(pairs);
+            return 0;
+        }
+        ++index;
+    }
+    
+    return 1;
+}
+
+// Parse a null-terminated json content that lives in the context arena.
+static int parse_pairs(Haversine_context *context, char *json_content, Haversine_pairs *pairs)
+{
+    Json_element *json = parse_json(context, json_content);
+    if (context->has_error) {
+        return 0;
+    }
+    
+    Json_element *pairs_array = get(json, "pairs");
+    if (!pairs_array) {
+        set_error(context, "Missing \"pairs\" array");
+        return 0;
+    }
+    
+    int result = fill_pairs(context, pairs_array->first, pairs);
+    
+    return result;
+}
+
+// Same as parse_pairs, but the content is a run of pair objects cut from the "pairs"
+// array: "{...}, {...}, ..." optionally ended by the closing ']' of the array.
+static int parse_pairs_fragment(Haversine_context *context, char *json_content, Haversine_pairs *pairs)
+{
+    Tokenizer tokenizer = {};
+    tokenizer.context = context;
+    tokenizer.at = json_content;
+    tokenizer.line = 1;
+    tokenizer.parsing = true;
+    
+    Json_element *first = 0;
+    Json_element *last = 0;
+    while (tokenizer.parsing) {
+        Token token = get_token(&tokenizer);
+        if (token.type == TOKEN_TYPE_END_OF_STREAM ||
+            token.type == TOKEN_TYPE_CLOSE_BRACKET) {
+            break;
+        }
+        
+        if (token.type != TOKEN_TYPE_OPEN_BRACE) {
+            tokenizer_error(&tokenizer, "Expected { at line %d", tokenizer.line);
+            break;
+        }
+        
+        Json_element *element = parse_element(&tokenizer, {}, token);
+        add_sibling(&first, &last, element);
+        
+        Token separator = peek_token(&tokenizer);
+        if (separator.type == TOKEN_TYPE_COMMA) {
+            get_token(&tokenizer);
+        }
+    }
+    
+    context->stats.scanned_bytes += tokenizer.bytes_scanned;
+    
+    if (context->has_error) {
+        return 0;
+    }
+    
+    int result = fill_pairs(context, first, pairs);
+    
+    return result;
+}
+
+static void begin_parse(Haversine_context *context)
+{
+    clear_arena(&context->arena);
+    context->has_error = false;
+    context->error[0] = '\0';
+    context->stats = {};
+}
+
+extern "C" Haversine_context * haversine_create_context(void)
+{
+    Haversine_context *context = (Haversine_context *)calloc(1, sizeof(Haversine_context));
+    
+    return context;
+}
+
+extern "C" void haversine_release_context(Haversine_context *context)
+{
+    if (context) {
+        free_arena(&context->arena);
+        free(context);
+    }
+}
+
+extern "C" const char * haversine_get_error(Haversine_context *context)
+{
+    return context->error;
+}
+
+extern "C" void haversine_get_stats(Haversine_context *context, Haversine_stats *stats)
+{
+    *stats = context->stats;
+}
+
+static char * copy_json_content(Haversine_context *context, const char *json, size_t size)
+{
+    context->stats.input_bytes += size;
+    
+    char *json_content = (char *)push_size(&context->arena, size + JSON_CONTENT_PADDING);
+    if (json_content) {
+        memcpy(json_content, json, size);
+        memset(json_content + size, 0, JSON_CONTENT_PADDING);
+    } else {
+        set_error(context, "Could not allocate %zu bytes", size);
+    }
+    
+    return json_content;
+}
+
+extern "C" int haversine_parse_buffer(Haversine_context *context, const char *json, size_t size, Haversine_pairs *pairs)
+{
+    begin_parse(context);
+    *pairs = {};
+    
+    char *json_content = copy_json_content(context, json, size);
+    if (!json_content) {
+        return 0;
+    }
+    
+    int result = parse_pairs(context, json_content, pairs);
+    
+    return result;
+}
+
+extern "C" int haversine_parse_pairs_fragment(Haversine_context *context, const char *json, size_t size, Haversine_pairs *pairs)
+{
+    begin_parse(context);
+    *pairs = {};
+    
+    char *json_content = copy_json_content(context, json, size);
+    if (!json_content) {
+        return 0;
+    }
+    
+    int result = parse_pairs_fragment(context, json_content, pairs);
+    
+    return result;
+}
+
+// Offset just past the closing quote of the string that opens at offset, or size if
+// it is not closed. A backslash escapes the next character, so runs of them pair up.
+static size_t skip_quoted(const char *json, size_t size, size_t offset)
+{
+    ++offset;
+    while (offset < size && json[offset] != '"') {
+        offset += (json[offset] == '\\') ? 2 : 1;
+    }
+    
+    size_t result = (offset < size) ? offset + 1 : size;
+    
+    return result;
+}
+
+extern "C" size_t haversine_find_pairs_begin(const char *json, size_t size)
+{
+    const char key[] = "\"pairs\"";
+    size_t key_size = sizeof(key) - 1;
+    
+    // Only a key of the top level object counts, not the same text in a string value
+    u32 depth = 0;
+    size_t offset = 0;
+    while (offset < size) {
+        char c = json[offset];
+        if (c == '"') {
+            size_t string_end = skip_quoted(json, size, offset);
+            bool is_key = (depth == 1 && string_end - offset == key_size && memcmp(json + offset, key, key_size) == 0);
+            offset = string_end;
+            
+            if (is_key) {
+                size_t at = offset;
+                while (at < size && is_whitespace(json[at])) {
+                    ++at;
+                }
+                
+                if (at < size && json[at] == ':') {
+                    ++at;
+                    while (at < size && is_whitespace(json[at])) {
+                        ++at;
+                    }
+                    
+                    if (at < size && json[at] == '[') {
+                        return at + 1;
+                    }
+                }
+            }
+            continue;
+        }
+        
+        if (c == '{' || c == '[') {
+            ++depth;
+        } else if ((c == '}' || c == ']') && depth) {
+            --depth;
+        }
+        ++offset;
+    }
+    
+    return 0;
+}
+
+extern "C" size_t haversine_next_pair_boundary(const char *json, size_t size, size_t from, size_t offset)
+{
+    // Pair values can be strings holding braces, or objects and arrays of their own,
+    // so the scan starts from a known boundary and keeps track of both.
+    u32 depth = 0;
+    size_t at = from;
+    while (at < size) {
+        char c = json[at];
+        if (c == '"') {
+            at = skip_quoted(json, size, at);
+            continue;
+        }
+        
+        ++at;
+        if (c == '{' || c == '[') {
+            ++depth;
+        } else if (c == '}' || c == ']') {
+            if (!depth) {
+                // End of the pairs array, no pair follows
+                return size;
+            }
+            
+            --depth;
+            if (!depth && at > offset) {
+                break;
+            }
+        }
+    }
+    
+    while (at < size && is_whitespace(json[at])) {
+        ++at;
+    }
+    
+    if (at < size && json[at] == ',') {
+        ++at;
+    }
+    
+    return at;
+}
+
+extern "C" int haversine_parse_file(Haversine_context *context, const char *filename, Haversine_pairs *pairs)
+{
+    begin_parse(context);
+    *pairs = {};
+    
+    FILE *file = fopen(filename, "rb");
+    if (!file) {
+        set_error(context, "Could not open file %s", filename);
+        return 0;
+    }
+    
+    // The whole file is read at once, so it has to be seekable to know its size
+    long end = -1;
+    if (fseek(file, 0, SEEK_END) == 0) {
+        end = ftell(file);
+    }
+    if (end < 0 || fseek(file, 0, SEEK_SET) != 0) {
+        set_error(context, "Could not get the size of %s, it has to be a regular file", filename);
+        fclose(file);
+        return 0;
+    }
+    size_t file_size = (size_t)end;
+    
+    char *json_content = (char *)push_size(&context->arena, file_size + JSON_CONTENT_PADDING);
+    if (!json_content) {
+        set_error(context, "Could not allocate %zu bytes", file_size);
+        fclose(file);
+        return 0;
+    }
+    
+    size_t bytes_read = fread(json_content, 1, file_size, file);
+    memset(json_content + bytes_read, 0, JSON_CONTENT_PADDING);
+    context->stats.input_bytes += bytes_read;
+    
+    fclose(file);
+    
+    if (bytes_read < file_size) {
+        set_error(context, "Could only read %zu of the %zu bytes of %s", bytes_read, file_size, filename);
+        return 0;
+    }
+    
+    int result = parse_pairs(context, json_content, pairs);
+    
+    return result;
+}
+
+extern "C" void haversine_release_pairs(Haversine_pairs *pairs)
+{
+    if (pairs) {
+        free(pairs->x0);
+        *pairs = {};
+    }
+}
+
+static inline f64 square(f64 a)
+{
+    f64 result = (a*a);
+    
+    return result;
+}
+
+static inline f64 radians_from_degrees(f64 degrees)
+{
+    f64 result = 0.01745329251994329577*degrees;
+    
+    return result;
+}
+
+extern "C" f64 reference_haversine(f64 x0, f64 y0, f64 x1, f64 y1, f64 earth_radius)
+{
+    f64 lat1 = y0;
+    f64 lat2 = y1;
+    f64 lon1 = x0;
+    f64 lon2 = x1;
+    
+    f64 d_lat = radians_from_degrees(lat2 - lat1);
+    f64 d_lon = radians_from_degrees(lon2 - lon1);
+    lat1 = radians_from_degrees(lat1);
+    lat2 = radians_from_degrees(lat2);
+    
+    f64 a = square(sin(d_lat/2.0)) + cos(lat1)*cos(lat2)*square(sin(d_lon/2.0));
+    f64 c = 2.0*asin(sqrt(a));
+    
+    f64 result = earth_radius*c;
+    
+    return result;
+}
+
+extern "C" void compute_distances(const Haversine_pairs *pairs, f64 *out, size_t n)
+{
+    for (size_t i = 0; i < n; ++i) {
+        out[i] = reference_haversine(pairs->x0[i], pairs->y0[i], pairs->x1[i], pairs->y1[i], HAVERSINE_EARTH_RADIUS);
+    }
+}
+
+extern "C" f64 sum_distances(const Haversine_pairs *pairs, size_t n)
+{
+    f64 result = 0;
+    for (size_t i = 0; i < n; ++i) {
+        result += reference_haversine(pairs->x0[i], pairs->y0[i], pairs->x1[i], pairs->y1[i], HAVERSINE_EARTH_RADIUS);
+    }
+    
+    return result;
+}
+
+extern "C" f64 mean_distance(const Haversine_pairs *pairs, size_t n)
+{
+    f64 sum = sum_distances(pairs, n);
+    f64 result = n ? (sum / (f64)n) : 0;
+    
+    return result;
+}
@@ -0,0 +1,77 @@
+#ifndef HAVERSINE_LIB_H
+#define HAVERSINE_LIB_H
+
+//
+// Public C API of the haversine library.
+//
+// All the state lives in a Haversine_context: there are no globals, so every
+// thread can work with its own context at the same time. Pairs are stored as
+// structure of arrays and are owned by the caller until released.
+//
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define HAVERSINE_EARTH_RADIUS 6372.8
+
+typedef struct Haversine_context Haversine_context;
+
+typedef struct Haversine_pairs {
+    size_t count;
+    double *x0;
+    double *y0;
+    double *x1;
+    double *y1;
+} Haversine_pairs;
+
+Haversine_context * haversine_create_context(void);
+void haversine_release_context(Haversine_context *context);
+
+typedef struct Haversine_stats {
+    size_t input_bytes;
+    size_t scanned_bytes; // Bytes gone through by the tokenizer, counting any re-lexing
+} Haversine_stats;
+
+// Last error reported by a parse call on this context, or an empty string.
+const char * haversine_get_error(Haversine_context *context);
+
+// Counters of the last parse call on this context.
+void haversine_get_stats(Haversine_context *context, Haversine_stats *stats);
+
+// Both return 1 on success and 0 on failure. The json buffer does not need to be
+// null-terminated; it is copied into the context's scratch memory.
+int haversine_parse_buffer(Haversine_context *context, const char *json, size_t size, Haversine_pairs *pairs);
+int haversine_parse_file(Haversine_context *context, const char *filename, Haversine_pairs *pairs);
+void haversine_release_pairs(Haversine_pairs *pairs);
+
+//
+// Splitting a big file so its pairs can be parsed in parallel.
+//
+
+// Offset just past the '[' of the "pairs" array, or 0 if there is no such array.
+size_t haversine_find_pairs_begin(const char *json, size_t size);
+
+// Offset just past the pair that contains offset (and its separating comma), so
+// fragments cut at these offsets only hold whole pairs. from is a boundary at or
+// before offset, like the start of the array or a previous result: the scan starts
+// there so braces inside strings are not taken for the end of a pair.
+size_t haversine_next_pair_boundary(const char *json, size_t size, size_t from, size_t offset);
+
+// Parse a run of pair objects cut from the "pairs" array at pair boundaries.
+int haversine_parse_pairs_fragment(Haversine_context *context, const char *json, size_t size, Haversine_pairs *pairs);
+
+double reference_haversine(double x0, double y0, double x1, double y1, double earth_radius);
+
+// Compute the first n distances of pairs into out, which must hold n doubles.
+void compute_distances(const Haversine_pairs *pairs, double *out, size_t n);
+double sum_distances(const Haversine_pairs *pairs, size_t n);
+double mean_distance(const Haversine_pairs *pairs, size_t n);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //HAVERSINE_LIB_H
@@ -0,0 +1,235 @@
+#ifndef HAVERSINE_PLATFORM_H
+#define HAVERSINE_PLATFORM_H
+
+//
+// Threads, atomics, timing and file system helpers. Windows is the main target,
+// the POSIX side keeps the library usable from the services that embed it.
+//
+
+#if _WIN32
+
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+
+typedef HANDLE Thread_handle;
+typedef DWORD Thread_result;
+#define THREAD_PROC(name) DWORD WINAPI name(void *parameter)
+typedef THREAD_PROC(Thread_proc);
+
+struct Platform_mutex {
+    CRITICAL_SECTION critical_section;
+};
+
+inline void init_mutex(Platform_mutex *mutex) { InitializeCriticalSection(&mutex->critical_section); }
+inline void destroy_mutex(Platform_mutex *mutex) { DeleteCriticalSection(&mutex->critical_section); }
+inline void lock_mutex(Platform_mutex *mutex) { EnterCriticalSection(&mutex->critical_section); }
+inline void unlock_mutex(Platform_mutex *mutex) { LeaveCriticalSection(&mutex->critical_section); }
+
+inline Thread_handle create_thread(Thread_proc *proc, void *parameter)
+{
+    Thread_handle result = CreateThread(0, 0, proc, parameter, 0, 0);
+
+    return result;
+}
+
+inline void join_thread(Thread_handle thread)
+{
+    WaitForSingleObject(thread, INFINITE);
+    CloseHandle(thread);
+}
+
+inline void yield_thread()
+{
+    SwitchToThread();
+}
+
+inline u32 get_processor_count()
+{
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+
+    return (u32)info.dwNumberOfProcessors;
+}
+
+inline s64 atomic_add_s64(s64 volatile *value, s64 addend)
+{
+    // Returns the new value
+    s64 result = InterlockedExchangeAdd64((LONG64 volatile *)value, addend) + addend;
+
+    return result;
+}
+
+inline f64 get_seconds()
+{
+    LARGE_INTEGER frequency;
+    LARGE_INTEGER counter;
+    QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&counter);
+
+    f64 result = (f64)counter.QuadPart / (f64)frequency.QuadPart;
+
+    return result;
+}
+
+inline bool is_directory(const char *path)
+{
+    DWORD attributes = GetFileAttributesA(path);
+    bool result = ((attributes != INVALID_FILE_ATTRIBUTES) &&
+                   (attributes & FILE_ATTRIBUTE_DIRECTORY));
+
+    return result;
+}
+
+inline s64 get_file_size(const char *path)
+{
+    s64 result = -1;
+
+    WIN32_FILE_ATTRIBUTE_DATA data;
+    if (GetFileAttributesExA(path, GetFileExInfoStandard, &data)) {
+        result = ((s64)data.nFileSizeHigh << 32) | (s64)data.nFileSizeLow;
+    }
+
+    return result;
+}
+
+#define FILE_VISITOR(name) void name(void *user_data, const char *path, s64 size)
+typedef FILE_VISITOR(File_visitor);
+
+// Calls visitor for every *.json file directly inside directory.
+inline void list_json_files(const char *directory, File_visitor *visitor, void *user_data)
+{
+    char pattern[MAX_PATH];
+    snprintf(pattern, sizeof(pattern), "%s\\*.json", directory);
+
+    WIN32_FIND_DATAA find_data;
+    HANDLE find = FindFirstFileA(pattern, &find_data);
+    if (find != INVALID_HANDLE_VALUE) {
+        do {
+            if (!(find_data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)) {
+                char path[MAX_PATH];
+                snprintf(path, sizeof(path), "%s\\%s", directory, find_data.cFileName);
+
+                s64 size = ((s64)find_data.nFileSizeHigh << 32) | (s64)find_data.nFileSizeLow;
+                visitor(user_data, path, size);
+            }
+        } while (FindNextFileA(find, &find_data));
+
+        FindClose(find);
+    }
+}
+
+#else
+
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <time.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+#ifndef MAX_PATH
+#define MAX_PATH 4096
+#endif
+
+typedef pthread_t Thread_handle;
+typedef void * Thread_result;
+#define THREAD_PROC(name) void * name(void *parameter)
+typedef THREAD_PROC(Thread_proc);
+
+struct Platform_mutex {
+    pthread_mutex_t mutex;
+};
+
+inline void init_mutex(Platform_mutex *mutex) { pthread_mutex_init(&mutex->mutex, 0); }
+inline void destroy_mutex(Platform_mutex *mutex) { pthread_mutex_destroy(&mutex->mutex); }
+inline void lock_mutex(Platform_mutex *mutex) { pthread_mutex_lock(&mutex->mutex); }
+inline void unlock_mutex(Platform_mutex *mutex) { pthread_mutex_unlock(&mutex->mutex); }
+
+inline Thread_handle create_thread(Thread_proc *proc, void *parameter)
+{
+    Thread_handle result;
+    pthread_create(&result, 0, proc, parameter);
+
+    return result;
+}
+
+inline void join_thread(Thread_handle thread)
+{
+    pthread_join(thread, 0);
+}
+
+inline void yield_thread()
+{
+    sched_yield();
+}
+
+inline u32 get_processor_count()
+{
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
+    u32 result = (count > 0) ? (u32)count : 1;
+
+    return result;
+}
+
+inline s64 atomic_add_s64(s64 volatile *value, s64 addend)
+{
+    // Returns the new value
+    s64 result = __atomic_add_fetch(value, addend, __ATOMIC_SEQ_CST);
+
+    return result;
+}
+
+inline f64 get_seconds()
+{
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    f64 result = (f64)now.tv_sec + (f64)now.tv_nsec*1.0e-9;
+
+    return result;
+}
+
+inline bool is_directory(const char *path)
+{
+    struct stat info;
+    bool result = ((stat(path, &info) == 0) && S_ISDIR(info.st_mode));
+
+    return result;
+}
+
+inline s64 get_file_size(const char *path)
+{
+    struct stat info;
+    s64 result = (stat(path, &info) == 0) ? (s64)info.st_size : -1;
+
+    return result;
+}
+
+#define FILE_VISITOR(name) void name(void *user_data, const char *path, s64 size)
+typedef FILE_VISITOR(File_visitor);
+
+// Calls visitor for every *.json file directly inside directory.
+inline void list_json_files(const char *directory, File_visitor *visitor, void *user_data)
+{
+    DIR *dir = opendir(directory);
+    if (dir) {
+        while (dirent *entry = readdir(dir)) {
+            size_t length = strlen(entry->d_name);
+            if (length > 5 && strcmp(entry->d_name + length - 5, ".json") == 0) {
+                char path[MAX_PATH];
+                snprintf(path, sizeof(path), "%s/%s", directory, entry->d_name);
+
+                s64 size = get_file_size(path);
+                if (size >= 0 && !is_directory(path)) {
+                    visitor(user_data, path, size);
+                }
+            }
+        }
+
+        closedir(dir);
+    }
+}
+
+#endif
+
+#endif //HAVERSINE_PLATFORM_H
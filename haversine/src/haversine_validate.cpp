@@ -0,0 +1,839 @@
+//
+// Validation mode: run the slow reference pipeline and an optimized pipeline over
+// the same input and compare them pair by pair.
+//
+// The reference side has its own plain scalar parser (byte by byte, strtod) and
+// reference_haversine(). Coordinates must match bit for bit, distances within a
+// number of ULPs. Both sides and the comparison run on all the threads, over
+// windows of the file, so memory stays bounded however big the file is.
+//
+
+#define VALIDATION_WINDOW_BYTES (64*1024*1024)
+#define VALIDATION_MAX_THREADS 64
+
+enum Validation_pipeline {
+    VALIDATION_PIPELINE_FRAGMENTS, // Pairs array split at pair boundaries, parsed in parallel (batch mode path)
+    VALIDATION_PIPELINE_DOCUMENT,  // Whole file through haversine_parse_buffer()
+};
+
+enum Validation_field {
+    VALIDATION_FIELD_X0,
+    VALIDATION_FIELD_Y0,
+    VALIDATION_FIELD_X1,
+    VALIDATION_FIELD_Y1,
+    VALIDATION_FIELD_DISTANCE,
+
+    VALIDATION_FIELD_COUNT,
+};
+
+static const char *validation_field_names[VALIDATION_FIELD_COUNT] = {
+    "x0", "y0", "x1", "y1", "distance",
+};
+
+// Growable structure of arrays, with the distance next to the coordinates.
+struct Validation_pairs {
+    u64 count;
+    u64 capacity;
+    f64 *values[VALIDATION_FIELD_COUNT];
+};
+
+struct Mismatch {
+    u64 pair_index;
+    Validation_field field;
+    f64 reference;
+    f64 optimized;
+    u64 ulps;
+};
+
+struct Validation_chunk {
+    size_t begin;
+    size_t end;
+
+    bool ok;
+    char error[128];
+    Validation_pairs pairs;
+    u64 first_pair; // Index of the first pair of this chunk in the window
+};
+
+struct Validation_compare {
+    u64 begin;
+    u64 end;
+
+    u64 mismatch_counts[VALIDATION_FIELD_COUNT];
+    u32 mismatch_count;
+    Mismatch *mismatches;
+};
+
+struct Validator {
+    Validation_pipeline pipeline;
+    u64 ulp_tolerance;
+    u32 report_count;
+    u32 thread_count;
+
+    Haversine_context *contexts[VALIDATION_MAX_THREADS];
+
+    // Current window
+    char *content;
+    Validation_chunk reference_chunks[VALIDATION_MAX_THREADS];
+    Validation_chunk optimized_chunks[VALIDATION_MAX_THREADS];
+    Validation_pairs reference;
+    Validation_pairs optimized;
+    Validation_compare compares[VALIDATION_MAX_THREADS];
+
+    // Totals
+    u64 pairs_before_window;
+    u64 reference_pair_count;
+    u64 optimized_pair_count;
+    u64 bytes_read;
+    u64 mismatch_counts[VALIDATION_FIELD_COUNT];
+    u32 mismatch_count;
+    Mismatch *mismatches;
+
+    bool failed;
+    char error[256];
+};
+
+//
+// Running work on every thread
+//
+
+#define PARALLEL_PROC(name) void name(Validator *validator, u32 index)
+typedef PARALLEL_PROC(Parallel_proc);
+
+struct Parallel_job {
+    Parallel_proc *proc;
+    Validator *validator;
+    u32 index;
+};
+
+static THREAD_PROC(parallel_thread_proc)
+{
+    Parallel_job *job = (Parallel_job *)parameter;
+    job->proc(job->validator, job->index);
+
+    return 0;
+}
+
+static void run_parallel(Validator *validator, Parallel_proc *proc)
+{
+    Parallel_job jobs[VALIDATION_MAX_THREADS];
+    Thread_handle threads[VALIDATION_MAX_THREADS];
+
+    for (u32 i = 0; i < validator->thread_count; ++i) {
+        jobs[i] = {proc, validator, i};
+    }
+
+    for (u32 i = 1; i < validator->thread_count; ++i) {
+        threads[i] = create_thread(parallel_thread_proc, jobs + i);
+    }
+    proc(validator, 0);
+    for (u32 i = 1; i < validator->thread_count; ++i) {
+        join_thread(threads[i]);
+    }
+}
+
+//
+// Pair arrays
+//
+
+static void reserve_pairs(Validation_pairs *pairs, u64 count)
+{
+    if (count > pairs->capacity) {
+        u64 capacity = pairs->capacity ? pairs->capacity : 1024;
+        while (capacity < count) {
+            capacity *= 2;
+        }
+
+        for (u32 field = 0; field < VALIDATION_FIELD_COUNT; ++field) {
+            pairs->values[field] = (f64 *)realloc(pairs->values[field], capacity*sizeof(f64));
+        }
+        pairs->capacity = capacity;
+    }
+}
+
+static void free_pairs(Validation_pairs *pairs)
+{
+    for (u32 field = 0; field < VALIDATION_FIELD_COUNT; ++field) {
+        free(pairs->values[field]);
+    }
+    *pairs = {};
+}
+
+static void copy_haversine_pairs(Validation_pairs *pairs, Haversine_pairs *source)
+{
+    reserve_pairs(pairs, source->count);
+    pairs->count = source->count;
+
+    size_t size = source->count*sizeof(f64);
+    memcpy(pairs->values[VALIDATION_FIELD_X0], source->x0, size);
+    memcpy(pairs->values[VALIDATION_FIELD_Y0], source->y0, size);
+    memcpy(pairs->values[VALIDATION_FIELD_X1], source->x1, size);
+    memcpy(pairs->values[VALIDATION_FIELD_Y1], source->y1, size);
+    compute_distances(source, pairs->values[VALIDATION_FIELD_DISTANCE], source->count);
+}
+
+//
+// Reference parser
+//
+
+inline bool reference_is_whitespace(char c)
+{
+    bool result = (c == ' ' || c == '\t' || c == '\n' || c == '\r');
+
+    return result;
+}
+
+// Start of the pair after the one that contains offset: past the '}' closing it and
+// past the ',' after that. Returns end if there is no following pair. from is a pair
+// boundary at or before offset, strings and nested values are followed from there so
+// a '}' inside them does not end the pair.
+static size_t reference_next_boundary(char *content, size_t from, size_t offset, size_t end)
+{
+    u32 depth = 0;
+    bool in_string = false;
+    bool closed = false;
+    for (size_t at = from; at < end; ++at) {
+        char c = content[at];
+        if (in_string) {
+            if (c == '\\') {
+                ++at;
+            } else if (c == '"') {
+                in_string = false;
+            }
+        } else if (c == '"') {
+            in_string = true;
+        } else if (c == '{' || c == '[') {
+            ++depth;
+        } else if (c == '}' || c == ']') {
+            if (!depth) {
+                return end;
+            }
+
+            --depth;
+            closed = (!depth && at >= offset);
+        } else if (c == ',' && closed) {
+            return at + 1;
+        }
+    }
+
+    return end;
+}
+
+// Plain byte by byte key reader, escapes are decoded so "x0" still reads as x0.
+static char * reference_read_key(char *at, char *end, char *key, u32 key_capacity, u32 *key_size)
+{
+    *key_size = 0;
+    while (at < end && *at != '"') {
+        char c = *at++;
+        if (c == '\\' && at < end) {
+            c = *at++;
+            if (c == 'u' && (end - at) >= 4) {
+                u32 code = 0;
+                for (int i = 0; i < 4; ++i) {
+                    char h = *at++;
+                    code <<= 4;
+                    if (h >= '0' && h <= '9') { code |= h - '0'; }
+                    else if (h >= 'a' && h <= 'f') { code |= 10 + h - 'a'; }
+                    else if (h >= 'A' && h <= 'F') { code |= 10 + h - 'A'; }
+                }
+
+                // Keys we care about are ASCII, anything else just needs to not match
+                c = (code < 0x80) ? (char)code : '?';
+            } else if (c == 'n') { c = '\n'; }
+            else if (c == 't') { c = '\t'; }
+            else if (c == 'r') { c = '\r'; }
+            else if (c == 'b') { c = '\b'; }
+            else if (c == 'f') { c = '\f'; }
+        }
+
+        if (*key_size < key_capacity) {
+            key[(*key_size)++] = c;
+        }
+    }
+
+    return (at < end) ? at + 1 : 0;
+}
+
+// Skip any value that is not a number: string, literal, object or array.
+static char * reference_skip_value(char *at, char *end)
+{
+    u32 depth = 0;
+    bool in_string = false;
+    while (at < end) {
+        char c = *at;
+        if (in_string) {
+            if (c == '\\') {
+                ++at;
+            } else if (c == '"') {
+                in_string = false;
+                if (!depth) {
+                    return at + 1;
+                }
+            }
+        } else if (c == '"') {
+            in_string = true;
+        } else if (c == '{' || c == '[') {
+            ++depth;
+        } else if (c == '}' || c == ']') {
+            if (!depth) {
+                return at;
+            }
+
+            --depth;
+            if (!depth) {
+                return at + 1;
+            }
+        } else if (!depth && (c == ',' || reference_is_whitespace(c))) {
+            return at;
+        }
+
+        ++at;
+    }
+
+    return at;
+}
+
+static bool reference_parse_fragment(char *content, size_t begin, size_t end, Validation_pairs *pairs, char *error, u32 error_size)
+{
+    pairs->count = 0;
+
+    char *at = content + begin;
+    char *stop = content + end;
+    for (;;) {
+        while (at < stop && (reference_is_whitespace(*at) || *at == ',')) {
+            ++at;
+        }
+
+        if (at >= stop || *at == ']') {
+            break;
+        }
+
+        if (*at != '{') {
+            snprintf(error, error_size, "Expected { at byte %llu", (unsigned long long)(at - content));
+            return false;
+        }
+        ++at;
+
+        f64 values[4] = {};
+        bool found[4] = {};
+        for (;;) {
+            while (at < stop && (reference_is_whitespace(*at) || *at == ',')) {
+                ++at;
+            }
+
+            if (at < stop && *at == '}') {
+                ++at;
+                break;
+            }
+
+            if (at >= stop || *at != '"') {
+                snprintf(error, error_size, "Expected a key at byte %llu", (unsigned long long)(at - content));
+                return false;
+            }
+
+            char key[16];
+            u32 key_size;
+            at = reference_read_key(at + 1, stop, key, sizeof(key), &key_size);
+            if (!at) {
+                snprintf(error, error_size, "Unterminated key");
+                return false;
+            }
+
+            while (at < stop && reference_is_whitespace(*at)) {
+                ++at;
+            }
+            if (at >= stop || *at != ':') {
+                snprintf(error, error_size, "Expected : at byte %llu", (unsigned long long)(at - content));
+                return false;
+            }
+            ++at;
+            while (at < stop && reference_is_whitespace(*at)) {
+                ++at;
+            }
+
+            s32 field = -1;
+            if (key_size == 2 && (key[0] == 'x' || key[0] == 'y') && (key[1] == '0' || key[1] == '1')) {
+                field = ((key[1] - '0') << 1) | (key[0] - 'x');
+            }
+
+            if (field >= 0) {
+                char *number_end;
+                values[field] = strtod(at, &number_end);
+                if (number_end == at) {
+                    snprintf(error, error_size, "Expected a number at byte %llu", (unsigned long long)(at - content));
+                    return false;
+                }
+
+                found[field] = true;
+                at = number_end;
+            } else {
+                at = reference_skip_value(at, stop);
+            }
+        }
+
+        if (!found[0] || !found[1] || !found[2] || !found[3]) {
+            snprintf(error, error_size, "Pair %llu is missing a coordinate", (unsigned long long)pairs->count);
+            return false;
+        }
+
+        reserve_pairs(pairs, pairs->count + 1);
+        u64 index = pairs->count++;
+        pairs->values[VALIDATION_FIELD_X0][index] = values[0];
+        pairs->values[VALIDATION_FIELD_Y0][index] = values[1];
+        pairs->values[VALIDATION_FIELD_X1][index] = values[2];
+        pairs->values[VALIDATION_FIELD_Y1][index] = values[3];
+        pairs->values[VALIDATION_FIELD_DISTANCE][index] = reference_haversine(values[0], values[1], values[2], values[3], HAVERSINE_EARTH_RADIUS);
+    }
+
+    return true;
+}
+
+//
+// Window passes
+//
+
+static void split_window(Validation_chunk *chunks, u32 chunk_count, char *content, size_t begin, size_t end, bool use_library_splitter)
+{
+    size_t chunk_size = (end - begin) / chunk_count;
+    size_t at = begin;
+    for (u32 i = 0; i < chunk_count; ++i) {
+        Validation_chunk *chunk = chunks + i;
+        chunk->begin = at;
+        if (i == chunk_count - 1) {
+            chunk->end = end;
+        } else if (use_library_splitter) {
+            size_t target = begin + (i + 1)*chunk_size;
+            chunk->end = (target > at) ? haversine_next_pair_boundary(content, end, at, target) : at;
+        } else {
+            size_t target = begin + (i + 1)*chunk_size;
+            chunk->end = (target > at) ? reference_next_boundary(content, at, target, end) : at;
+        }
+
+        at = chunk->end;
+    }
+}
+
+static PARALLEL_PROC(parse_reference_chunk)
+{
+    Validation_chunk *chunk = validator->reference_chunks + index;
+    chunk->ok = reference_parse_fragment(validator->content, chunk->begin, chunk->end, &chunk->pairs, chunk->error, sizeof(chunk->error));
+}
+
+static PARALLEL_PROC(parse_optimized_chunk)
+{
+    Validation_chunk *chunk = validator->optimized_chunks + index;
+    Haversine_context *context = validator->contexts[index];
+
+    Haversine_pairs pairs = {};
+    chunk->ok = haversine_parse_pairs_fragment(context, validator->content + chunk->begin, chunk->end - chunk->begin, &pairs) != 0;
+    if (chunk->ok) {
+        copy_haversine_pairs(&chunk->pairs, &pairs);
+        haversine_release_pairs(&pairs);
+    } else {
+        chunk->pairs.count = 0;
+        snprintf(chunk->error, sizeof(chunk->error), "%s", haversine_get_error(context));
+    }
+}
+
+static void gather_chunk(Validation_pairs *destination, Validation_chunk *chunk)
+{
+    for (u32 field = 0; field < VALIDATION_FIELD_COUNT; ++field) {
+        memcpy(destination->values[field] + chunk->first_pair, chunk->pairs.values[field], chunk->pairs.count*sizeof(f64));
+    }
+}
+
+static PARALLEL_PROC(gather_chunks)
+{
+    gather_chunk(&validator->reference, validator->reference_chunks + index);
+    if (validator->pipeline == VALIDATION_PIPELINE_FRAGMENTS) {
+        gather_chunk(&validator->optimized, validator->optimized_chunks + index);
+    }
+}
+
+inline u64 get_ulp_distance(f64 a, f64 b)
+{
+    // Map the bits to integers that are ordered like the doubles they come from.
+    s64 a_bits;
+    s64 b_bits;
+    memcpy(&a_bits, &a, sizeof(a_bits));
+    memcpy(&b_bits, &b, sizeof(b_bits));
+    if (a_bits < 0) {
+        a_bits = (s64)(0x8000000000000000ULL - (u64)a_bits);
+    }
+    if (b_bits < 0) {
+        b_bits = (s64)(0x8000000000000000ULL - (u64)b_bits);
+    }
+
+    u64 result = (a_bits > b_bits) ? ((u64)a_bits - (u64)b_bits) : ((u64)b_bits - (u64)a_bits);
+
+    return result;
+}
+
+static PARALLEL_PROC(compare_range)
+{
+    Validation_compare *compare = validator->compares + index;
+    compare->mismatch_count = 0;
+    for (u32 field = 0; field < VALIDATION_FIELD_COUNT; ++field) {
+        compare->mismatch_counts[field] = 0;
+    }
+
+    for (u32 field = 0; field < VALIDATION_FIELD_COUNT; ++field) {
+        f64 *reference = validator->reference.values[field];
+        f64 *optimized = validator->optimized.values[field];
+
+        for (u64 i = compare->begin; i < compare->end; ++i) {
+            u64 ulps;
+            bool equal;
+            if (field == VALIDATION_FIELD_DISTANCE) {
+                ulps = get_ulp_distance(reference[i], optimized[i]);
+                equal = (ulps <= validator->ulp_tolerance) || (reference[i] != reference[i] && optimized[i] != optimized[i]);
+            } else {
+                // Coordinates must be the exact same double
+                equal = (memcmp(reference + i, optimized + i, sizeof(f64)) == 0);
+                ulps = equal ? 0 : get_ulp_distance(reference[i], optimized[i]);
+            }
+
+            if (!equal) {
+                ++compare->mismatch_counts[field];
+                if (compare->mismatch_count < validator->report_count) {
+                    Mismatch *mismatch = compare->mismatches + compare->mismatch_count++;
+                    mismatch->pair_index = validator->pairs_before_window + i;
+                    mismatch->field = (Validation_field)field;
+                    mismatch->reference = reference[i];
+                    mismatch->optimized = optimized[i];
+                    mismatch->ulps = ulps;
+                }
+            }
+        }
+    }
+}
+
+static u64 layout_chunks(Validation_chunk *chunks, u32 chunk_count, Validator *validator)
+{
+    u64 total = 0;
+    for (u32 i = 0; i < chunk_count; ++i) {
+        Validation_chunk *chunk = chunks + i;
+        if (!chunk->ok && !validator->failed) {
+            validator->failed = true;
+            snprintf(validator->error, sizeof(validator->error), "%s", chunk->error);
+        }
+
+        chunk->first_pair = total;
+        total += chunk->pairs.count;
+    }
+
+    return total;
+}
+
+static void add_mismatch(Validator *validator, Mismatch *mismatch)
+{
+    // Keep the first report_count mismatches, by pair index then field.
+    u32 count = validator->mismatch_count;
+    u32 at = count;
+    while (at > 0 && (validator->mismatches[at - 1].pair_index > mismatch->pair_index ||
+                      (validator->mismatches[at - 1].pair_index == mismatch->pair_index &&
+                       validator->mismatches[at - 1].field > mismatch->field))) {
+        --at;
+    }
+
+    if (at >= validator->report_count) {
+        return;
+    }
+
+    if (count == validator->report_count) {
+        --count;
+    }
+
+    memmove(validator->mismatches + at + 1, validator->mismatches + at, (count - at)*sizeof(Mismatch));
+    validator->mismatches[at] = *mismatch;
+    validator->mismatch_count = count + 1;
+}
+
+// Validate the pairs in content[begin, end). In document mode validator->optimized is
+// already filled for the whole file.
+static void validate_window(Validator *validator, char *content, size_t begin, size_t end)
+{
+    u32 thread_count = validator->thread_count;
+    validator->content = content;
+
+    split_window(validator->reference_chunks, thread_count, content, begin, end, false);
+    run_parallel(validator, parse_reference_chunk);
+    u64 reference_count = layout_chunks(validator->reference_chunks, thread_count, validator);
+
+    u64 optimized_count = validator->optimized.count;
+    if (validator->pipeline == VALIDATION_PIPELINE_FRAGMENTS) {
+        split_window(validator->optimized_chunks, thread_count, content, begin, end, true);
+        run_parallel(validator, parse_optimized_chunk);
+        optimized_count = layout_chunks(validator->optimized_chunks, thread_count, validator);
+
+        reserve_pairs(&validator->optimized, optimized_count);
+        validator->optimized.count = optimized_count;
+    }
+
+    reserve_pairs(&validator->reference, reference_count);
+    validator->reference.count = reference_count;
+
+    run_parallel(validator, gather_chunks);
+
+    validator->reference_pair_count += reference_count;
+    validator->optimized_pair_count += optimized_count;
+
+    u64 compare_count = (reference_count < optimized_count) ? reference_count : optimized_count;
+    u64 per_thread = (compare_count + thread_count - 1) / thread_count;
+    for (u32 i = 0; i < thread_count; ++i) {
+        Validation_compare *compare = validator->compares + i;
+        compare->begin = i*per_thread;
+        compare->end = compare->begin + per_thread;
+        if (compare->begin > compare_count) {
+            compare->begin = compare_count;
+        }
+        if (compare->end > compare_count) {
+            compare->end = compare_count;
+        }
+    }
+
+    run_parallel(validator, compare_range);
+
+    for (u32 i = 0; i < thread_count; ++i) {
+        Validation_compare *compare = validator->compares + i;
+        for (u32 field = 0; field < VALIDATION_FIELD_COUNT; ++field) {
+            validator->mismatch_counts[field] += compare->mismatch_counts[field];
+        }
+        for (u32 m = 0; m < compare->mismatch_count; ++m) {
+            add_mismatch(validator, compare->mismatches + m);
+        }
+    }
+
+    validator->pairs_before_window += reference_count;
+}
+
+// Offset just past the last pair separator of content[begin, end), so the window can be
+// cut there and the rest carried over to the next one. 0 if there is none. begin is a
+// pair boundary, and the scan goes forward from it to step over commas and braces
+// inside strings and nested values.
+static size_t find_last_separator(char *content, size_t begin, size_t end)
+{
+    size_t result = 0;
+    u32 depth = 0;
+    bool in_string = false;
+    bool closed = false;
+    for (size_t at = begin; at < end; ++at) {
+        char c = content[at];
+        if (in_string) {
+            if (c == '\\') {
+                ++at;
+            } else if (c == '"') {
+                in_string = false;
+            }
+        } else if (c == '"') {
+            in_string = true;
+        } else if (c == '{' || c == '[') {
+            ++depth;
+        } else if (c == '}' || c == ']') {
+            if (!depth) {
+                break;
+            }
+
+            --depth;
+            closed = !depth;
+        } else if (c == ',' && closed) {
+            result = at + 1;
+            closed = false;
+        }
+    }
+
+    return result;
+}
+
+static bool validate_fragments(Validator *validator, FILE *file)
+{
+    size_t buffer_size = VALIDATION_WINDOW_BYTES;
+    char *buffer = (char *)malloc(buffer_size + JSON_CONTENT_PADDING);
+
+    size_t filled = fread(buffer, 1, buffer_size, file);
+    bool end_of_file = (filled < buffer_size);
+    validator->bytes_read += filled;
+
+    size_t begin = haversine_find_pairs_begin(buffer, filled);
+    if (!begin) {
+        snprintf(validator->error, sizeof(validator->error), "Missing \"pairs\" array in the first %zu bytes", filled);
+        free(buffer);
+        return false;
+    }
+
+    for (;;) {
+        memset(buffer + filled, 0, JSON_CONTENT_PADDING);
+
+        size_t cut = filled;
+        if (!end_of_file) {
+            cut = find_last_separator(buffer, begin, filled);
+            if (!cut) {
+                // Not even one whole pair in the window, make room for more
+                buffer_size *= 2;
+                buffer = (char *)realloc(buffer, buffer_size + JSON_CONTENT_PADDING);
+                size_t bytes_read = fread(buffer + filled, 1, buffer_size - filled, file);
+                filled += bytes_read;
+                validator->bytes_read += bytes_read;
+                end_of_file = (filled < buffer_size);
+                continue;
+            }
+        }
+
+        validate_window(validator, buffer, begin, cut);
+        if (validator->failed || end_of_file) {
+            break;
+        }
+
+        size_t carry = filled - cut;
+        memmove(buffer, buffer + cut, carry);
+        size_t bytes_read = fread(buffer + carry, 1, buffer_size - carry, file);
+        filled = carry + bytes_read;
+        validator->bytes_read += bytes_read;
+        end_of_file = (filled < buffer_size);
+        begin = 0;
+    }
+
+    free(buffer);
+
+    return !validator->failed;
+}
+
+static bool validate_document(Validator *validator, FILE *file)
+{
+    // Read in a loop rather than by the file size, so pipes work too
+    size_t capacity = VALIDATION_WINDOW_BYTES;
+    size_t size = 0;
+    char *content = (char *)malloc(capacity + JSON_CONTENT_PADDING);
+    for (;;) {
+        if (!content) {
+            snprintf(validator->error, sizeof(validator->error), "Could not allocate %zu bytes for the document", capacity + JSON_CONTENT_PADDING);
+            return false;
+        }
+
+        size += fread(content + size, 1, capacity - size, file);
+        if (size < capacity) {
+            break;
+        }
+
+        capacity *= 2;
+        char *grown = (char *)realloc(content, capacity + JSON_CONTENT_PADDING);
+        if (!grown) {
+            free(content);
+        }
+        content = grown;
+    }
+    memset(content + size, 0, JSON_CONTENT_PADDING);
+    validator->bytes_read = size;
+
+    Haversine_pairs pairs = {};
+    if (!haversine_parse_buffer(validator->contexts[0], content, size, &pairs)) {
+        snprintf(validator->error, sizeof(validator->error), "%s", haversine_get_error(validator->contexts[0]));
+        free(content);
+        return false;
+    }
+
+    copy_haversine_pairs(&validator->optimized, &pairs);
+    haversine_release_pairs(&pairs);
+
+    size_t begin = haversine_find_pairs_begin(content, size);
+    if (begin) {
+        validate_window(validator, content, begin, size);
+    } else {
+        snprintf(validator->error, sizeof(validator->error), "Missing \"pairs\" array");
+        validator->failed = true;
+    }
+
+    free(content);
+
+    return !validator->failed;
+}
+
+int run_validation(const char *filename, Validation_pipeline pipeline, u64 ulp_tolerance, u32 thread_count, u32 report_count)
+{
+    FILE *file = fopen(filename, "rb");
+    if (!file) {
+        fprintf(stderr, "ERROR: Could not open file %s\n", filename);
+        return 1;
+    }
+
+    if (!thread_count) {
+        thread_count = get_processor_count();
+    }
+    if (thread_count > VALIDATION_MAX_THREADS) {
+        thread_count = VALIDATION_MAX_THREADS;
+    }
+
+    Validator *validator = (Validator *)calloc(1, sizeof(Validator));
+    validator->pipeline = pipeline;
+    validator->ulp_tolerance = ulp_tolerance;
+    validator->report_count = report_count;
+    validator->thread_count = thread_count;
+    validator->mismatches = (Mismatch *)malloc((report_count + 1)*sizeof(Mismatch));
+    for (u32 i = 0; i < thread_count; ++i) {
+        validator->contexts[i] = haversine_create_context();
+        validator->compares[i].mismatches = (Mismatch *)malloc((report_count + 1)*sizeof(Mismatch));
+    }
+
+    f64 start_seconds = get_seconds();
+
+    bool ok;
+    if (pipeline == VALIDATION_PIPELINE_DOCUMENT) {
+        ok = validate_document(validator, file);
+    } else {
+        ok = validate_fragments(validator, file);
+    }
+
+    f64 elapsed_seconds = get_seconds() - start_seconds;
+    u64 file_size = validator->bytes_read;
+    fclose(file);
+
+    int result = 0;
+    printf("Pipeline: %s, %u threads, distance tolerance %llu ulps\n",
+           (pipeline == VALIDATION_PIPELINE_DOCUMENT) ? "document" : "fragments",
+           thread_count, (unsigned long long)ulp_tolerance);
+
+    if (!ok) {
+        printf("ERROR: %s\n", validator->error);
+        result = 2;
+    } else {
+        printf("Pair count: reference %llu, optimized %llu%s\n",
+               (unsigned long long)validator->reference_pair_count,
+               (unsigned long long)validator->optimized_pair_count,
+               (validator->reference_pair_count == validator->optimized_pair_count) ? "" : "  MISMATCH");
+        if (validator->reference_pair_count != validator->optimized_pair_count) {
+            result = 1;
+        }
+
+        for (u32 field = 0; field < VALIDATION_FIELD_COUNT; ++field) {
+            printf("%-8s mismatches: %llu\n", validation_field_names[field], (unsigned long long)validator->mismatch_counts[field]);
+            if (validator->mismatch_counts[field]) {
+                result = 1;
+            }
+        }
+
+        for (u32 i = 0; i < validator->mismatch_count; ++i) {
+            Mismatch *mismatch = validator->mismatches + i;
+            printf("  pair %llu %s: reference %.17g, optimized %.17g (%llu ulps)\n",
+                   (unsigned long long)mismatch->pair_index, validation_field_names[mismatch->field],
+                   mismatch->reference, mismatch->optimized, (unsigned long long)mismatch->ulps);
+        }
+
+        printf("%s\n", result ? "FAILED" : "OK");
+    }
+
+    printf("Time: %.3fs, %.2f MB/s\n", elapsed_seconds,
+           elapsed_seconds > 0 ? ((f64)file_size / (1024.0*1024.0)) / elapsed_seconds : 0);
+
+    for (u32 i = 0; i < thread_count; ++i) {
+        haversine_release_context(validator->contexts[i]);
+        free(validator->compares[i].mismatches);
+        free_pairs(&validator->reference_chunks[i].pairs);
+        free_pairs(&validator->optimized_chunks[i].pairs);
+    }
+    free_pairs(&validator->reference);
+    free_pairs(&validator->optimized);
+    free(validator->mismatches);
+    free(validator);
+
+    return result;
+}
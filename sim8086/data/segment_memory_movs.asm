@@ -0,0 +1,15 @@
+bits 16
+
+; Segment registers loaded from and stored to memory, in both directions and with
+; a segment override. cx reads back what ds was loaded from, so it ends up 0x1234.
+
+mov bx, 1000
+mov ax, 0x1234
+mov [bx + 2], ax
+mov es, [bx + 2]
+mov [bx + 4], es
+mov [es:bx + 6], es
+mov ds, [es:bx + 6]
+mov cx, [bx + 6]
+mov [2000], ds
+mov ss, [2000]
@@ -0,0 +1,19 @@
+bits 16
+
+; The first store rewrites the immediate of the last mov, which is in the same basic
+; block. The simulator has to leave the block and decode the mov again from the new
+; bytes, so cx ends up 5, not 1.
+
+mov word [patch + 1], 5
+mov ax, bx
+mov ax, bx
+mov ax, bx
+mov ax, bx
+mov ax, bx
+mov ax, bx
+mov ax, bx
+mov ax, bx
+mov ax, bx
+mov ax, bx
+patch:
+mov cx, 1
@@ -3,9 +3,15 @@
 #include <string.h>
 
 #include "sim8086.h"
+#include "sim8086_platform.h"
 
 u8 get_next_byte(FileContent *file_content)
 {
+    if (file_content->size_remaining < 1) {
+        file_content->truncated = true;
+        return 0;
+    }
+    
     u8 byte = *(u8 *)file_content->memory++;
     --file_content->size_remaining;
     
@@ -14,6 +20,13 @@ u8 get_next_byte(FileContent *file_content)
 
 u16 get_next_word(FileContent *file_content)
 {
+    if (file_content->size_remaining < 2) {
+        file_content->truncated = true;
+        file_content->memory += file_content->size_remaining;
+        file_content->size_remaining = 0;
+        return 0;
+    }
+    
     u16 word = *(u16 *)file_content->memory;
     file_content->memory += 2;
     file_content->size_remaining -= 2;
@@ -21,43 +34,48 @@ u16 get_next_word(FileContent *file_content)
     return word;
 }
 
-void print_memory_address_and_displacement(Instruction instruction)
+// A segment prefix is written inside the brackets, as nasm takes it: [es:bx + 2]
+void write_segment_override(TextBuffer *buffer, Instruction instruction)
+{
+    if (instruction.segment_override) {
+        write_string(buffer, segment_registers[instruction.segment].name);
+        write_char(buffer, ':');
+    }
+}
+
+void write_memory_address_and_displacement(TextBuffer *buffer, Instruction instruction)
 {
-    DisplacementAddress displacement = instruction.displacement_address;
-    if (displacement.first_displacement.type != Register_none ||
-        displacement.second_displacement.type != Register_none ||
-        displacement.offset)
+    u8 first_register = instruction.address_registers & 0xF;
+    u8 second_register = instruction.address_registers >> 4;
+    s16 displacement = instruction.displacement;
+    if (instruction.mod != MOD_REGISTER_MODE)
     {
-        printf("[");
+        write_char(buffer, '[');
+        write_segment_override(buffer, instruction);
         
-        if (displacement.first_displacement.type != Register_none) {
-            char *first_register = displacement.first_displacement.name;
-            printf("%s", first_register);
+        if (first_register) {
+            write_string(buffer, get_address_register_name(first_register));
             
-            if (displacement.second_displacement.type != Register_none) {
-                char *second_register = displacement.second_displacement.name;
-                printf(" + %s", second_register);
+            if (second_register) {
+                write_string(buffer, " + ");
+                write_string(buffer, get_address_register_name(second_register));
             }
             
-            if (displacement.offset) {
-                bool is_negative = (displacement.offset < 0);
-                char sign = is_negative ? '-' : '+';
-                s16 offset = is_negative ? displacement.offset * -1 : displacement.offset;
-                printf(" %c %d", sign, offset);
+            if (displacement) {
+                bool is_negative = (displacement < 0);
+                write_string(buffer, is_negative ? " - " : " + ");
+                write_decimal(buffer, is_negative ? -(s32)displacement : displacement);
             }
             
         } else {
-            if (displacement.offset) {
-                bool is_negative = (displacement.offset < 0);
-                if (is_negative) {
-                    printf("- ");
-                }
-                s16 offset = is_negative ? displacement.offset * -1 : displacement.offset;
-                printf("%d", offset);
+            bool is_negative = (displacement < 0);
+            if (is_negative) {
+                write_string(buffer, "- ");
             }
+            write_decimal(buffer, is_negative ? -(s32)displacement : displacement);
         }
         
-        printf("]");
+        write_char(buffer, ']');
     }
 }
 
@@ -100,124 +118,120 @@ char * get_opcode_name(OperationType operation_type, u8 binary)
     return operation;
 }
 
-void print_instruction(Instruction instruction)
+// Longest text of an instruction with its clocks, bigger than anything write_instruction
+// and write_instruction_clocks can produce.
+#define MAX_INSTRUCTION_TEXT 128
+
+void write_instruction(TextBuffer *buffer, Instruction instruction)
 {
-    printf(get_opcode_name(instruction.operation_type, instruction.binary));
+    write_string(buffer, get_opcode_name((OperationType)instruction.operation_type, instruction.binary));
     
     if (instruction.operation_type == Op_jmp) {
-        printf(" $%d", ((s8)instruction.value + 2)); // Explicit ip value (instead of label) should not consider the 2 bytes used in this instruction.
+        write_string(buffer, " $");
+        write_decimal(buffer, (s8)instruction.value + 2); // Explicit ip value (instead of label) should not consider the 2 bytes used in this instruction.
         
         return;
     }
     
     if (instruction.flags & WORD_BYTE_TEXT_REQUIRED) {
         if (instruction.w) {
-            printf("word ");
+            write_string(buffer, "word ");
         } else {
-            printf("byte ");
+            write_string(buffer, "byte ");
         }
     }
     
     
     if (instruction.flags & IMMEDIATE_ACCUMULATOR) {
-        printf("%s", instruction.dest_register.name);
+        write_string(buffer, register_operands[instruction.dest_register].name);
     }
     
-    if (instruction.flags & REG_SOURCE_DEST && instruction.dest_register.type != Register_none) {
-        printf("%s, ", instruction.dest_register.name);
+    if (instruction.flags & REG_SOURCE_DEST && instruction.dest_register) {
+        write_string(buffer, register_operands[instruction.dest_register].name);
+        write_string(buffer, ", ");
     } else if (instruction.mod == MOD_REGISTER_MODE) {
-        printf("%s", instruction.dest_register.name);
+        write_string(buffer, register_operands[instruction.dest_register].name);
+    } else if ((instruction.flags & SEGMENT) && instruction.dest_register) {
+        write_string(buffer, register_operands[instruction.dest_register].name);
+        write_string(buffer, ", ");
     }
     
     if (instruction.flags & DISPLACEMENT) {
-        print_memory_address_and_displacement(instruction);
+        write_memory_address_and_displacement(buffer, instruction);
     }
     
     if (instruction.flags & IMMEDIATE) {
-        u16 number = instruction.value;
-        printf("%s, %d", instruction.dest_register.name, number);
+        write_string(buffer, register_operands[instruction.dest_register].name);
+        write_string(buffer, ", ");
+        write_decimal(buffer, instruction.value);
     } else if (instruction.flags & ACCUMULATOR_ADDRESS) {
-        u16 number = instruction.value;
         if (instruction.d) {
-            printf("%s, [%d]", instruction.dest_register.name, number);
+            write_string(buffer, register_operands[instruction.dest_register].name);
+            write_string(buffer, ", [");
+            write_segment_override(buffer, instruction);
+            write_decimal(buffer, instruction.value);
+            write_char(buffer, ']');
         } else {
-            printf("[%d], %s", number, instruction.source_register.name);
+            write_char(buffer, '[');
+            write_segment_override(buffer, instruction);
+            write_decimal(buffer, instruction.value);
+            write_string(buffer, "], ");
+            write_string(buffer, register_operands[instruction.source_register].name);
         }
     } else if (instruction.flags & REG_SOURCE_DEST) {
-        if (instruction.source_register.type != Register_none) {
-            if (instruction.flags & DISPLACEMENT &&
-                instruction.displacement_address.first_displacement.type != Register_none) {
-                printf(", ");
+        if (instruction.source_register) {
+            if (instruction.flags & DISPLACEMENT && (instruction.address_registers & 0xF)) {
+                write_string(buffer, ", ");
             }
             
-            printf("%s", instruction.source_register.name);
+            write_string(buffer, register_operands[instruction.source_register].name);
         }
-    } else if ((instruction.flags & SEGMENT) && instruction.source_register.type != Register_none) {
-        printf(", %s", instruction.source_register.name);
+    } else if (instruction.flags & SEGMENT) {
+        if (instruction.source_register) {
+            write_string(buffer, ", ");
+            write_string(buffer, register_operands[instruction.source_register].name);
+        }
+    } else if (instruction.s && instruction.w) {
+        write_string(buffer, ", ");
+        write_decimal(buffer, (s16)instruction.value);
     } else {
-        printf(", %d", instruction.value);
+        write_string(buffer, ", ");
+        write_decimal(buffer, instruction.value);
     }
 }
 
-void print_instructions(Instruction *instructions, u32 count)
+// instruction_clocks is what the instruction took, which on top of its base and
+// effective address clocks has the bus penalties of its memory transfers.
+void write_instruction_clocks(TextBuffer *buffer, Instruction instruction, u32 instruction_clocks, u64 total_clocks)
 {
-    if (count)
-    {
-        u32 total_clocks = 0;
-        printf("bits 16\n");
-        for (int i = 0; i < count; ++i) {
-            Instruction instruction = instructions[i];
-            print_instruction(instruction);
-            
-            
-            u8 instruction_clocks = instruction.clocks;
-            u8 ea_clocks = instruction.displacement_address.clocks;
-            u8 total_instruction_clocks = instruction_clocks + ea_clocks;
-            
-            total_clocks += total_instruction_clocks;
-            
-            printf(" ; Clocks: +%d = %d", total_instruction_clocks, total_clocks);
-            
-            if (ea_clocks) {
-                printf(" (%d + %dea)", instruction_clocks, ea_clocks);
-            }
-            
-            
-            printf("\n");
+    write_string(buffer, " ; Clocks: +");
+    write_decimal(buffer, instruction_clocks);
+    write_string(buffer, " = ");
+    write_decimal(buffer, total_clocks);
+    
+    u32 ea_clocks = instruction.ea_clocks;
+    u32 penalty_clocks = instruction_clocks - instruction.clocks - ea_clocks;
+    if (instruction.operation_type != Op_jmp && (ea_clocks || penalty_clocks)) {
+        write_string(buffer, " (");
+        write_decimal(buffer, instruction.clocks);
+        if (ea_clocks) {
+            write_string(buffer, " + ");
+            write_decimal(buffer, ea_clocks);
+            write_string(buffer, "ea");
+        }
+        if (penalty_clocks) {
+            write_string(buffer, " + ");
+            write_decimal(buffer, penalty_clocks);
+            write_char(buffer, 'p');
         }
+        write_char(buffer, ')');
     }
 }
 
-bool is_opcode_jump(u8 opcode)
-{
-    bool is_jump = ((opcode == OPCODE_JE) ||
-                    (opcode == OPCODE_JL) ||
-                    (opcode == OPCODE_JLE) ||
-                    (opcode == OPCODE_JB) ||
-                    (opcode == OPCODE_JBE) ||
-                    (opcode == OPCODE_JP) ||
-                    (opcode == OPCODE_JO) ||
-                    (opcode == OPCODE_JS) ||
-                    (opcode == OPCODE_JNE) ||
-                    (opcode == OPCODE_JNL) ||
-                    (opcode == OPCODE_JNLE) ||
-                    (opcode == OPCODE_JNB) ||
-                    (opcode == OPCODE_JNBE) ||
-                    (opcode == OPCODE_JNP) ||
-                    (opcode == OPCODE_JNO) ||
-                    (opcode == OPCODE_JNS) ||
-                    (opcode == OPCODE_LOOP) ||
-                    (opcode == OPCODE_LOOPZ) ||
-                    (opcode == OPCODE_LOOPNZ) ||
-                    (opcode == OPCODE_JCXZ));
-    
-    return is_jump;
-}
-
 void set_source_and_dest_registers(Instruction *instruction, FileContent *file_content)
 {
-    RegisterDefinition reg_register = get_register_definition(instruction->w, instruction->reg);
-    RegisterDefinition rm_register  = get_register_definition(instruction->w, instruction->rm);
+    u8 reg_register = get_register_operand(instruction->w, instruction->reg);
+    u8 rm_register  = get_register_operand(instruction->w, instruction->rm);
     
     if (instruction->flags & HAS_DATA) {
         u16 number;
@@ -226,11 +240,8 @@ void set_source_and_dest_registers(Instruction *instruction, FileContent *file_c
                 number = get_next_word(file_content);
                 instruction->bytes_used += 2;
             } else {
-                number = (u16)get_next_byte(file_content);
-                if (number < 0) {
-                    // Sign-extended
-                    number |= 0xFF00;
-                }
+                // Sign-extended
+                number = (u16)(s16)(s8)get_next_byte(file_content);
                 
                 instruction->bytes_used += 1;
             }
@@ -262,19 +273,19 @@ void set_source_and_dest_registers(Instruction *instruction, FileContent *file_c
         }
     }
     
-    if (instruction->mod == MOD_REGISTER_MODE) {
-        if (instruction->flags & SEGMENT) {
-            RegisterDefinition segment_register = get_segment_register_definition(instruction->sr);
-            if (instruction->d) {
-                instruction->dest_register = rm_register;
-                instruction->source_register = segment_register;
-            } else {
-                instruction->dest_register = segment_register;
-                instruction->source_register = rm_register;
-            }
+    if (instruction->flags & SEGMENT) {
+        // A memory operand leaves the other side without a register
+        u8 segment_register = get_segment_register_operand(instruction->reg);
+        u8 other_register = (instruction->mod == MOD_REGISTER_MODE) ? rm_register : 0;
+        if (instruction->d) {
+            instruction->dest_register = other_register;
+            instruction->source_register = segment_register;
         } else {
-            instruction->dest_register = rm_register;
+            instruction->dest_register = segment_register;
+            instruction->source_register = other_register;
         }
+    } else if (instruction->mod == MOD_REGISTER_MODE) {
+        instruction->dest_register = rm_register;
     }
 }
 
@@ -284,56 +295,57 @@ void calculate_displacement(Instruction *instruction, FileContent *file_content)
         return;
     }
     
-    DisplacementAddress displacement = {};
+    u8 first_register = Register_none;
+    u8 second_register = Register_none;
     
     if (instruction->mod != MOD_REGISTER_MODE)
     {
         switch (instruction->rm)
         {
             case 0b000: {
-                displacement.first_displacement = registers_definitions[3][1];
-                displacement.second_displacement = registers_definitions[6][1];
-                displacement.clocks += 7;
+                first_register = Register_b;
+                second_register = Register_si;
+                instruction->ea_clocks += 7;
             } break;
             
             case 0b001: {
-                displacement.first_displacement = registers_definitions[3][1];
-                displacement.second_displacement = registers_definitions[7][1];
-                displacement.clocks += 8;
+                first_register = Register_b;
+                second_register = Register_di;
+                instruction->ea_clocks += 8;
             } break;
             
             case 0b010: {
-                displacement.first_displacement = registers_definitions[5][1];
-                displacement.second_displacement = registers_definitions[6][1];
-                displacement.clocks += 8;
+                first_register = Register_bp;
+                second_register = Register_si;
+                instruction->ea_clocks += 8;
             } break;
             
             case 0b011: {
-                displacement.first_displacement = registers_definitions[5][1];
-                displacement.second_displacement = registers_definitions[7][1];
-                displacement.clocks += 7;
+                first_register = Register_bp;
+                second_register = Register_di;
+                instruction->ea_clocks += 7;
             } break;
             
             case 0b100: {
-                displacement.first_displacement = registers_definitions[6][1];
-                displacement.clocks += 5;
+                first_register = Register_si;
+                instruction->ea_clocks += 5;
             } break;
             
             case 0b101: {
-                displacement.first_displacement = registers_definitions[7][1];
-                displacement.clocks += 5;
+                first_register = Register_di;
+                instruction->ea_clocks += 5;
             } break;
             
             case 0b110: {
                 if (instruction->mod != MOD_MEMORY_MODE) {
-                    displacement.first_displacement = registers_definitions[5][1];
-                    displacement.clocks += 5;
+                    first_register = Register_bp;
+                    instruction->ea_clocks += 5;
                 }
             } break;
             
             case 0b111: {
-                displacement.first_displacement = registers_definitions[3][1];
-                displacement.clocks += 5;
+                first_register = Register_b;
+                instruction->ea_clocks += 5;
             } break;
         }
     }
@@ -342,22 +354,27 @@ void calculate_displacement(Instruction *instruction, FileContent *file_content)
     {
         case MOD_MEMORY_MODE: {
             if (instruction->rm == 0b110) {
-                displacement.offset = (s16)get_next_word(file_content);
+                instruction->displacement = (s16)get_next_word(file_content);
                 instruction->bytes_used += 2;
-                displacement.clocks += 6;
+                instruction->ea_clocks += 6;
             }
         } break;
         
+        // A zero displacement costs nothing, like in [bp] which can only be encoded with one
         case MOD_MEMORY_MODE_8_BIT_DISPLACEMENT: {
-            displacement.offset = (s8)get_next_byte(file_content);
+            instruction->displacement = (s8)get_next_byte(file_content);
             instruction->bytes_used += 1;
-            displacement.clocks += 4;
+            if (instruction->displacement) {
+                instruction->ea_clocks += 4;
+            }
         } break;
         
         case MOD_MEMORY_MODE_16_BIT_DISPLACEMENT: {
-            displacement.offset = (s16)get_next_word(file_content);
+            instruction->displacement = (s16)get_next_word(file_content);
             instruction->bytes_used += 2;
-            displacement.clocks += 4;
+            if (instruction->displacement) {
+                instruction->ea_clocks += 4;
+            }
         } break;
         
         case MOD_REGISTER_MODE: {
@@ -365,258 +382,550 @@ void calculate_displacement(Instruction *instruction, FileContent *file_content)
         } break;
     }
     
-    instruction->displacement_address = displacement;
+    instruction->address_registers = first_register | (second_register << 4);
 }
 
-void calculate_instruction_clocks(Instruction *instruction)
+DecodeEntry decode_table[256];
+
+void set_decode_entries(u8 first, u8 last, DecodeForm form, OperationType operation_type, u8 flags, u8 clock_class, u8 clocks = 0)
 {
-    if (((instruction->binary >> 2) & 0b111111) == OPCODE_MOV_REGISTER_MEMORY_TO_OR_FROM_REGISTER)
-    {
-        if (instruction->dest_register.type != Register_none &&
-            instruction->source_register.type != Register_none) {
-            instruction->clocks += 2;
-        } else if (instruction->dest_register.type != Register_none &&
-                   instruction->source_register.type == Register_none) {
-            instruction->clocks += 8;
-        } else if (instruction->dest_register.type == Register_none &&
-                   instruction->source_register.type != Register_none) {
-            instruction->clocks += 9;
-        }
-    }
-    else if (((instruction->binary >> 1) & 0b1111111) == OPCODE_MOV_IMMEDIATE_TO_REGISTER_OR_MEMORY)
-    {
-        if (instruction->dest_register.type == Register_none) {
-            instruction->clocks += 10;
-        } else {
-            instruction->clocks += 4;
+    for (u32 binary = first; binary <= last; ++binary) {
+        DecodeEntry *entry = decode_table + binary;
+        entry->operation_type = operation_type;
+        entry->form = (u8)form;
+        entry->flags = flags;
+        entry->clock_class = clock_class;
+        entry->clocks = clocks;
+        
+        switch (form)
+        {
+            case Form_rm_reg: {
+                entry->w = binary & 1;
+                entry->d = (binary >> 1) & 1;
+            } break;
+            
+            case Form_arithmetic_immediate: {
+                entry->w = binary & 1;
+                entry->s = (binary >> 1) & 1;
+            } break;
+            
+            case Form_rm_immediate:
+            case Form_accumulator_immediate: {
+                entry->w = binary & 1;
+            } break;
+            
+            case Form_reg_immediate: {
+                entry->w = (binary >> 3) & 1;
+                entry->reg = binary & 0b111;
+            } break;
+            
+            case Form_accumulator_address:
+            case Form_segment: {
+                // The direction bit is inverted for these: 0 means to the register
+                entry->w = (form == Form_segment) ? 1 : (binary & 1);
+                entry->d = ((binary >> 1) & 1) ^ 1;
+            } break;
+            
+            default: break;
         }
     }
-    else if (((instruction->binary >> 4) & 0b1111) == OPCODE_MOV_IMMEDIATE_TO_REGISTER)
-    {
-        instruction->clocks += 4;
-    }
-    else if (((instruction->binary >> 1) & 0b1111111) == OPCODE_MOV_MEMORY_TO_ACCUMULATOR ||
-             ((instruction->binary >> 1) & 0b1111111) == OPCODE_MOV_ACCUMULATOR_TO_MEMORY)
-    {
-        instruction->clocks += 10;
+}
+
+void build_decode_table()
+{
+    set_decode_entries(0x88, 0x8B, Form_rm_reg, Op_mov, REG_SOURCE_DEST, Clocks_mov_rm);
+    set_decode_entries(0xC6, 0xC7, Form_rm_immediate, Op_mov, WORD_BYTE_TEXT_REQUIRED | DISPLACEMENT | HAS_DATA, Clocks_mov_immediate_rm);
+    set_decode_entries(0xB0, 0xBF, Form_reg_immediate, Op_mov, IMMEDIATE | HAS_DATA, Clocks_fixed, 4);
+    set_decode_entries(0xA0, 0xA3, Form_accumulator_address, Op_mov, ACCUMULATOR_ADDRESS, Clocks_fixed, 10);
+    set_decode_entries(OPCODE_MOV_SEGMENT_REGISTER_TO_REGISTER_OR_MEMORY, OPCODE_MOV_SEGMENT_REGISTER_TO_REGISTER_OR_MEMORY,
+                       Form_segment, Op_mov, SEGMENT, Clocks_mov_rm);
+    set_decode_entries(OPCODE_MOV_REGISTER_OR_MEMORY_TO_SEGMENT_REGISTER, OPCODE_MOV_REGISTER_OR_MEMORY_TO_SEGMENT_REGISTER,
+                       Form_segment, Op_mov, SEGMENT, Clocks_mov_rm);
+    
+    set_decode_entries(0x80, 0x83, Form_arithmetic_immediate, Op_none, WORD_BYTE_TEXT_REQUIRED | DISPLACEMENT | HAS_DATA, Clocks_arithmetic_immediate);
+    
+    set_decode_entries(0x00, 0x03, Form_rm_reg, Op_add, REG_SOURCE_DEST | DISPLACEMENT, Clocks_arithmetic_rm);
+    set_decode_entries(0x28, 0x2B, Form_rm_reg, Op_sub, REG_SOURCE_DEST | DISPLACEMENT, Clocks_arithmetic_rm);
+    set_decode_entries(0x38, 0x3B, Form_rm_reg, Op_cmp, REG_SOURCE_DEST | DISPLACEMENT, Clocks_arithmetic_rm);
+    
+    set_decode_entries(0x04, 0x05, Form_accumulator_immediate, Op_add, IMMEDIATE_ACCUMULATOR | HAS_DATA, Clocks_fixed, 4);
+    set_decode_entries(0x2C, 0x2D, Form_accumulator_immediate, Op_sub, IMMEDIATE_ACCUMULATOR | HAS_DATA, Clocks_fixed, 4);
+    set_decode_entries(0x3C, 0x3D, Form_accumulator_immediate, Op_cmp, IMMEDIATE_ACCUMULATOR | HAS_DATA, Clocks_fixed, 4);
+    
+    // Jumps are charged their not taken cost here, the handler adds the rest when the jump is taken
+    set_decode_entries(0x70, 0x7F, Form_jump, Op_jmp, 0, Clocks_fixed, 4);
+    set_decode_entries(0xE0, 0xE3, Form_jump, Op_jmp, 0, Clocks_fixed);
+    decode_table[OPCODE_LOOP].clocks = 5;
+    decode_table[OPCODE_LOOPZ].clocks = 6;
+    decode_table[OPCODE_LOOPNZ].clocks = 5;
+    decode_table[OPCODE_JCXZ].clocks = 6;
+}
+
+inline bool is_opcode_jump(u8 opcode)
+{
+    bool is_jump = (decode_table[opcode].form == Form_jump);
+    
+    return is_jump;
+}
+
+// Picks between the three costs of a mod reg r/m instruction: reg, reg / reg, mem / mem, reg.
+inline u8 get_rm_clocks(Instruction *instruction, u8 register_to_register, u8 memory_to_register, u8 register_to_memory)
+{
+    u8 clocks = 0;
+    if (instruction->dest_register && instruction->source_register) {
+        clocks = register_to_register;
+    } else if (instruction->dest_register) {
+        clocks = memory_to_register;
+    } else if (instruction->source_register) {
+        clocks = register_to_memory;
     }
-    else if ((instruction->binary == OPCODE_MOV_REGISTER_OR_MEMORY_TO_SEGMENT_REGISTER) ||
-             (instruction->binary == OPCODE_MOV_SEGMENT_REGISTER_TO_REGISTER_OR_MEMORY))
-    {
-        if (instruction->dest_register.type != Register_none &&
-            instruction->source_register.type != Register_none) {
-            instruction->clocks += 2;
-        } else if (instruction->dest_register.type != Register_none &&
-                   instruction->source_register.type == Register_none) {
-            instruction->clocks += 8;
-        } else if (instruction->dest_register.type == Register_none &&
-                   instruction->source_register.type != Register_none) {
-            instruction->clocks += 9;
-        }
-    }
-    else if (((instruction->binary >> 2) & 0b111111) == OPCODE_ARITHMETIC_IMMEDIATE_TO_REGISTER_OR_MEMORY)
+    
+    return clocks;
+}
+
+void calculate_instruction_clocks(Instruction *instruction, DecodeEntry *entry)
+{
+    switch (entry->clock_class)
     {
-        if (instruction->dest_register.type != Register_none) {
-            instruction->clocks += 4;
-        } else {
-            if (instruction->operation_type == Op_add ||
-                instruction->operation_type == Op_sub) {
+        case Clocks_mov_rm: {
+            instruction->clocks += get_rm_clocks(instruction, 2, 8, 9);
+        } break;
+        
+        case Clocks_mov_immediate_rm: {
+            instruction->clocks += instruction->dest_register ? 4 : 10;
+        } break;
+        
+        case Clocks_fixed: {
+            instruction->clocks += entry->clocks;
+        } break;
+        
+        case Clocks_arithmetic_immediate: {
+            if (instruction->dest_register) {
+                instruction->clocks += 4;
+            } else if (instruction->operation_type == Op_add ||
+                       instruction->operation_type == Op_sub) {
                 instruction->clocks += 17;
             } else if (instruction->operation_type == Op_cmp) {
                 instruction->clocks += 10;
             }
-        }
+        } break;
+        
+        case Clocks_arithmetic_rm: {
+            u8 register_to_memory = (instruction->operation_type == Op_cmp) ? 9 : 16;
+            instruction->clocks += get_rm_clocks(instruction, 3, 9, register_to_memory);
+        } break;
+    }
+}
+
+#include "sim8086_memory.cpp"
+#include "sim8086_snapshot.cpp"
+#include "sim8086_execute.cpp"
+
+// Decodes the instruction at the current position of file_content. Returns false (after
+// printing why) if the opcode is not supported or the instruction is cut short.
+bool decode_instruction(FileContent *file_content, Instruction *instruction)
+{
+    *instruction = {};
+    
+    u32 offset = file_content->total_size - file_content->size_remaining;
+    
+    u8 first_byte = get_next_byte(file_content);
+    instruction->bytes_used += 1;
+    
+    // A segment prefix is decoded as part of the instruction it applies to
+    if (is_segment_prefix(first_byte)) {
+        instruction->segment = (first_byte >> 3) & 0b11;
+        instruction->segment_override = 1;
+        
+        first_byte = get_next_byte(file_content);
+        instruction->bytes_used += 1;
     }
-    else if ((((instruction->binary >> 2) & 0b111111) == OPCODE_ADD_REGISTER_OR_MEMORY) ||
-             (((instruction->binary >> 2) & 0b111111) == OPCODE_SUB_REGISTER_OR_MEMORY) ||
-             (((instruction->binary >> 2) & 0b111111) == OPCODE_CMP_REGISTER_OR_MEMORY))
+    
+    instruction->binary = first_byte;
+    
+    DecodeEntry *entry = decode_table + first_byte;
+    instruction->operation_type = entry->operation_type;
+    instruction->flags = entry->flags;
+    instruction->w = entry->w;
+    instruction->d = entry->d;
+    instruction->reg = entry->reg;
+    
+    switch (entry->form)
     {
-        if (instruction->dest_register.type != Register_none &&
-            instruction->source_register.type != Register_none) {
-            instruction->clocks += 3;
-        } else if (instruction->dest_register.type != Register_none &&
-                   instruction->source_register.type == Register_none) {
-            instruction->clocks += 9;
-        } else if (instruction->dest_register.type == Register_none &&
-                   instruction->source_register.type != Register_none) {
-            if (instruction->operation_type == Op_cmp) {
-                instruction->clocks += 9;
-            } else {
-                instruction->clocks += 16;
+        case Form_rm_reg:
+        case Form_rm_immediate:
+        case Form_segment:
+        case Form_arithmetic_immediate: {
+            u8 second_byte = get_next_byte(file_content);
+            instruction->bytes_used += 1;
+            
+            instruction->mod = (second_byte >> 6) & 0b11;
+            instruction->rm = second_byte & 0b111;
+            
+            if (entry->form == Form_rm_reg) {
+                instruction->reg = (second_byte >> 3) & 0b111;
+                if (instruction->mod != MOD_REGISTER_MODE) {
+                    instruction->flags |= DISPLACEMENT;
+                }
+            } else if (entry->form == Form_segment) {
+                // The segment register takes the place of reg
+                instruction->reg = (second_byte >> 3) & 0b111;
+                if (instruction->mod != MOD_REGISTER_MODE) {
+                    instruction->flags |= DISPLACEMENT;
+                }
+            } else if (entry->form == Form_arithmetic_immediate) {
+                instruction->s = entry->s;
+                instruction->operation_type = arithmetic_operations[(second_byte >> 3) & 0b111];
             }
-        }
+        } break;
+        
+        case Form_jump: {
+            instruction->value = get_next_byte(file_content);
+            instruction->bytes_used += 1;
+        } break;
+        
+        case Form_invalid: {
+            printf("ERROR: opcode given by first byte [%c%c%c%c%c%c%c%c] not implemented\n", BYTE_TO_BINARY(instruction->binary));
+            
+            return false;
+        } break;
     }
-    else if ((((instruction->binary >> 1) & 0b1111111) == OPCODE_ADD_IMMEDIATE_TO_ACCUMULATOR) ||
-             (((instruction->binary >> 1) & 0b1111111) == OPCODE_SUB_IMMEDIATE_FROM_ACCUMULATOR) ||
-             (((instruction->binary >> 1) & 0b1111111) == OPCODE_CMP_IMMEDIATE_WITH_ACCUMULATOR))
-    {
-        instruction->clocks += 4;
+    
+    calculate_displacement(instruction, file_content);
+    set_source_and_dest_registers(instruction, file_content);
+    calculate_instruction_clocks(instruction, entry);
+    select_handler(instruction);
+    
+    if (instruction->segment_override) {
+        instruction->clocks += 2;
+    } else if ((instruction->address_registers & 0xF) == Register_bp) {
+        // Addressing through bp is into the stack
+        instruction->segment = Segment_ss;
+    } else {
+        instruction->segment = Segment_ds;
     }
-    else if (is_opcode_jump(instruction->binary))
-    {
-        switch (instruction->binary)
-        {
-            case OPCODE_JE:     { instruction->clocks += 16; } break;
-            case OPCODE_JL:     {  } break;
-            case OPCODE_JLE:    {  } break;
-            case OPCODE_JB:     { instruction->clocks += 16; } break;
-            case OPCODE_JBE:    {  } break;
-            case OPCODE_JP:     { instruction->clocks += 16; } break;
-            case OPCODE_JO:     {  } break;
-            case OPCODE_JS:     {  } break;
-            case OPCODE_JNE:    { instruction->clocks += 16; } break;
-            case OPCODE_JNL:    {  } break;
-            case OPCODE_JNLE:   {  } break;
-            case OPCODE_JNB:    {  } break;
-            case OPCODE_JNBE:   {  } break;
-            case OPCODE_JNP:    {  } break;
-            case OPCODE_JNO:    {  } break;
-            case OPCODE_JNS:    {  } break;
-            case OPCODE_LOOP:   { instruction->clocks += 17; } break;
-            case OPCODE_LOOPZ:  {  } break;
-            case OPCODE_LOOPNZ: { instruction->clocks += 19; } break;
-            case OPCODE_JCXZ:   {  } break;
-        }
-    }
-}
-
-u32 decode_asm_8086(FileContent *file_content, Instruction *instructions)
-{
-    u32 instruction_count = 0;
+    
+    if (file_content->truncated) {
+        printf("ERROR: instruction at byte %u runs past the end of the program\n", offset);
+        
+        return false;
+    }
+    
+    return true;
+}
+
+u32 decode_asm_8086(FileContent *file_content, InstructionStore *store)
+{
+    store->count = 0;
     while (file_content->size_remaining)
     {
-        Instruction instruction = {};
-        
-        u8 first_byte = get_next_byte(file_content);
-        instruction.bytes_used += 1;
-        
-        instruction.binary = first_byte;
-        
-        if (((instruction.binary >> 2) & 0b111111) == OPCODE_MOV_REGISTER_MEMORY_TO_OR_FROM_REGISTER)
-        {
-            u8 second_byte = get_next_byte(file_content);
-            instruction.bytes_used += 1;
+        Instruction *instruction = push_instruction(store);
+        if (!instruction) {
+            printf("ERROR: out of memory for decoded instructions\n");
             
-            instruction.operation_type = Op_mov;
-            instruction.w = instruction.binary & 1;
-            instruction.d = instruction.binary & 2;
-            instruction.mod = ((second_byte >> 6) & 0b11);
-            instruction.rm = second_byte & 0b111;
-            instruction.reg = ((second_byte >> 3) & 0b111);
-            instruction.flags = REG_SOURCE_DEST;
-            if (instruction.mod != MOD_REGISTER_MODE) {
-                instruction.flags |= DISPLACEMENT;
-            }
+            store->count = 0;
+            break;
         }
-        else if (((instruction.binary >> 1) & 0b1111111) == OPCODE_MOV_IMMEDIATE_TO_REGISTER_OR_MEMORY)
-        {
-            u8 second_byte = get_next_byte(file_content);
-            instruction.bytes_used += 1;
-            
-            instruction.operation_type = Op_mov;
-            instruction.w = instruction.binary & 1;
-            instruction.mod = (second_byte >> 6) & 0b11;
-            instruction.rm = second_byte & 0b111;
-            instruction.flags = WORD_BYTE_TEXT_REQUIRED | DISPLACEMENT | HAS_DATA;
+        
+        if (!decode_instruction(file_content, instruction)) {
+            store->count = 0;
+            break;
         }
-        else if (((instruction.binary >> 4) & 0b1111) == OPCODE_MOV_IMMEDIATE_TO_REGISTER)
-        {
-            instruction.operation_type = Op_mov;
-            instruction.w = (instruction.binary >> 3) & 1;
-            instruction.reg = instruction.binary & 0b111;
-            instruction.flags = IMMEDIATE | HAS_DATA;
+    }
+    
+    return store->count;
+}
+
+// Listing line of an instruction with its clocks. Jumps count as not taken, the listing
+// does not know where execution goes.
+inline void write_listed_instruction(TextBuffer *buffer, Instruction instruction, u64 *total_clocks)
+{
+    write_instruction(buffer, instruction);
+    
+    u32 instruction_clocks = instruction.clocks + instruction.ea_clocks;
+    *total_clocks += instruction_clocks;
+    write_instruction_clocks(buffer, instruction, instruction_clocks, *total_clocks);
+    
+    write_char(buffer, '\n');
+}
+
+void write_listing(InstructionStore *store, FILE *output)
+{
+    char text[KILOBYTES(16)];
+    TextBuffer buffer = {text, sizeof(text), 0};
+    write_string(&buffer, "bits 16\n");
+    
+    u64 total_clocks = 0;
+    for (u32 i = 0; i < store->count; ++i) {
+        if (buffer.capacity - buffer.used < MAX_INSTRUCTION_TEXT) {
+            flush_text(&buffer, output);
         }
-        else if (((instruction.binary >> 1) & 0b1111111) == OPCODE_MOV_MEMORY_TO_ACCUMULATOR ||
-                 ((instruction.binary >> 1) & 0b1111111) == OPCODE_MOV_ACCUMULATOR_TO_MEMORY)
-        {
-            instruction.operation_type = Op_mov;
-            instruction.w = instruction.binary & 1;
-            instruction.reg = 0b000;
-            instruction.d = ((instruction.binary >> 1) & 1) ^ 1;
-            instruction.flags = ACCUMULATOR_ADDRESS;
-        }
-        else if ((instruction.binary == OPCODE_MOV_REGISTER_OR_MEMORY_TO_SEGMENT_REGISTER) ||
-                 (instruction.binary == OPCODE_MOV_SEGMENT_REGISTER_TO_REGISTER_OR_MEMORY))
-        {
-            u8 second_byte = get_next_byte(file_content);
-            instruction.bytes_used += 1;
-            
-            instruction.operation_type = Op_mov;
-            instruction.w = 1;
-            instruction.mod = (second_byte >> 6) & 0b11;
-            instruction.sr = (second_byte >> 3) & 0b111;
-            instruction.rm = second_byte & 0b111;
-            instruction.d = ((instruction.binary >> 1) & 1) ^ 1;
-            instruction.flags = SEGMENT;
-        }
-        else if (((instruction.binary >> 2) & 0b111111) == OPCODE_ARITHMETIC_IMMEDIATE_TO_REGISTER_OR_MEMORY)
-        {
-            u8 second_byte = get_next_byte(file_content);
-            instruction.bytes_used += 1;
+        
+        write_listed_instruction(&buffer, *get_instruction(store, i), &total_clocks);
+    }
+    
+    flush_text(&buffer, output);
+}
+
+#define STREAM_CHUNK_SIZE KILOBYTES(64)
+
+// Whether the instruction at code has an opcode the decoder knows, after its segment
+// prefix if it has one. The instruction has to have at least two bytes.
+inline bool has_known_opcode(u8 *code)
+{
+    u8 opcode = is_segment_prefix(code[0]) ? code[1] : code[0];
+    bool result = (decode_table[opcode].form != Form_invalid);
+    
+    return result;
+}
+
+// Disassembles the input as it is read, a chunk at a time, and writes every instruction
+// as soon as it is decoded. Decoding stops short of the end of a chunk, where an
+// instruction can be cut, and the bytes left are carried over in front of the next
+// chunk. Memory use is the chunk and the text buffer, whatever the size of the input.
+// Returns false if the input does not decode, or could not be read.
+bool disassemble_stream(FILE *input, FILE *output)
+{
+    u8 *chunk = (u8 *)malloc(MAX_INSTRUCTION_SIZE + STREAM_CHUNK_SIZE);
+    
+    char text[KILOBYTES(16)];
+    TextBuffer buffer = {text, sizeof(text), 0};
+    write_string(&buffer, "bits 16\n");
+    
+    u64 total_clocks = 0;
+    u32 chunk_offset = 0; // Of the first byte of the chunk in the input
+    u32 carried = 0;
+    bool result = true;
+    for (;;) {
+        u32 read = (u32)fread(chunk + carried, 1, STREAM_CHUNK_SIZE, input);
+        bool at_end = (read < STREAM_CHUNK_SIZE);
+        if (ferror(input)) {
+            flush_text(&buffer, output);
+            printf("ERROR: could not read the input\n");
+            result = false;
+            break;
+        }
+        
+        // Offsets in decode errors count from the start of the input
+        u32 size = carried + read;
+        FileContent code = {};
+        code.memory = chunk;
+        code.total_size = chunk_offset + size;
+        code.size_remaining = size;
+        
+        u32 keep = at_end ? 0 : MAX_INSTRUCTION_SIZE - 1;
+        while (code.size_remaining > keep) {
+            if (buffer.capacity - buffer.used < MAX_INSTRUCTION_TEXT) {
+                flush_text(&buffer, output);
+            }
             
-            instruction.s = (instruction.binary >> 1) & 1;
-            instruction.w = instruction.binary & 1;
-            instruction.mod = (second_byte >> 6) & 0b11;
-            instruction.rm = second_byte & 0b111;
-            instruction.operation_type = arithmetic_operations[(second_byte >> 3) & 0b111];
-            instruction.flags = WORD_BYTE_TEXT_REQUIRED | DISPLACEMENT | HAS_DATA;
-        }
-        else if ((((instruction.binary >> 2) & 0b111111) == OPCODE_ADD_REGISTER_OR_MEMORY) ||
-                 (((instruction.binary >> 2) & 0b111111) == OPCODE_SUB_REGISTER_OR_MEMORY) ||
-                 (((instruction.binary >> 2) & 0b111111) == OPCODE_CMP_REGISTER_OR_MEMORY))
-        {
-            u8 second_byte = get_next_byte(file_content);
-            instruction.bytes_used += 1;
+            // The decoder prints what is wrong, after the instructions before it
+            if (code.size_remaining < MAX_INSTRUCTION_SIZE || !has_known_opcode(code.memory)) {
+                flush_text(&buffer, output);
+            }
             
-            instruction.d = (instruction.binary >> 1) & 1;
-            instruction.w = instruction.binary & 1;
-            instruction.mod = (second_byte >> 6) & 0b11;
-            instruction.reg = (second_byte >> 3) & 0b111;
-            instruction.rm = second_byte & 0b111;
-            instruction.operation_type = arithmetic_operations[(instruction.binary >> 3) & 0b111];
-            instruction.flags = REG_SOURCE_DEST | DISPLACEMENT;
-        }
-        else if ((((instruction.binary >> 1) & 0b1111111) == OPCODE_ADD_IMMEDIATE_TO_ACCUMULATOR) ||
-                 (((instruction.binary >> 1) & 0b1111111) == OPCODE_SUB_IMMEDIATE_FROM_ACCUMULATOR) ||
-                 (((instruction.binary >> 1) & 0b1111111) == OPCODE_CMP_IMMEDIATE_WITH_ACCUMULATOR))
-        {
-            instruction.w = instruction.binary & 1;
-            instruction.reg = 0b000; // ax || al register
-            instruction.operation_type = arithmetic_operations[(instruction.binary >> 3) & 0b111];
-            instruction.flags = IMMEDIATE_ACCUMULATOR | HAS_DATA;
-        }
-        else if (is_opcode_jump(instruction.binary))
-        {
-            u8 second_byte = get_next_byte(file_content);
-            instruction.bytes_used += 1;
+            Instruction instruction;
+            if (!decode_instruction(&code, &instruction)) {
+                result = false;
+                break;
+            }
             
-            instruction.operation_type = Op_jmp;
-            instruction.value = second_byte;
+            write_listed_instruction(&buffer, instruction, &total_clocks);
         }
-        else
-        {
-            printf("ERROR: opcode given by first byte [%c%c%c%c%c%c%c%c] not implemented\n", BYTE_TO_BINARY(instruction.binary));
-            
-            instruction_count = 0;
+        
+        flush_text(&buffer, output);
+        if (!result || at_end) {
             break;
         }
         
-        calculate_displacement(&instruction, file_content);
-        set_source_and_dest_registers(&instruction, file_content);
-        calculate_instruction_clocks(&instruction);
+        carried = code.size_remaining;
+        memmove(chunk, code.memory, carried);
+        chunk_offset += size - carried;
+    }
+    
+    free(chunk);
+    
+    return result;
+}
+
+void init_decode_cache(DecodeCache *cache, MemoryArena *arena, u32 memory_size)
+{
+    *cache = {};
+    cache->index = push_array(arena, SEGMENT_SIZE, u32);
+    memset(cache->index, 0, SEGMENT_SIZE*sizeof(u32));
+    
+    // Every IP starts at most one instruction
+    init_instruction_store(&cache->store, arena, SEGMENT_SIZE);
+    
+    cache->code_map_size = (memory_size >> CODE_LINE_SHIFT) + 1;
+    cache->code_map = push_array(arena, cache->code_map_size, u8);
+    memset(cache->code_map, 0, cache->code_map_size);
+    
+    cache->blocks = push_array(arena, SEGMENT_SIZE, BasicBlock *);
+    memset(cache->blocks, 0, SEGMENT_SIZE*sizeof(BasicBlock *));
+}
+
+void flush_blocks(DecodeCache *cache);
+
+void flush_decode_cache(DecodeCache *cache, u16 segment)
+{
+    // Only what was decoded since the last flush needs clearing, which keeps flushes
+    // cheap when a cache is reused for many small programs
+    if (cache->decoded_end) {
+        memset(cache->index, 0, cache->decoded_end*sizeof(u32));
         
-        instructions[instruction_count++] = instruction;
+        // The segment wraps around at the end of the megabyte
+        u32 segment_base = (u32)cache->segment << 4;
+        u32 first_line = segment_base >> CODE_LINE_SHIFT;
+        u32 last_line = (segment_base + cache->decoded_end - 1) >> CODE_LINE_SHIFT;
+        u32 line_count = MEMORY_SIZE >> CODE_LINE_SHIFT;
+        if (last_line < line_count) {
+            memset(cache->code_map + first_line, 0, last_line - first_line + 1);
+        } else {
+            memset(cache->code_map + first_line, 0, line_count - first_line);
+            memset(cache->code_map, 0, last_line - line_count + 1);
+        }
+    }
+    
+    cache->store.count = 0;
+    flush_blocks(cache);
+    
+    cache->segment = segment;
+    cache->decoded_end = 0;
+    cache->code_rewritten = false;
+}
+
+inline void mark_code(DecodeCache *cache, u32 segment_base, u16 ip, u32 size)
+{
+    for (u32 i = 0; i < size; ++i) {
+        u32 linear = (segment_base + (u16)(ip + i)) & MEMORY_ADDRESS_MASK;
+        cache->code_map[linear >> CODE_LINE_SHIFT] = 1;
+    }
+}
+
+// Bytes of the instruction at CS:ip the way they are fetched: IP wraps around at the end
+// of the segment, and the address at the end of the megabyte. Points into memory when the
+// bytes follow each other there, which is everywhere but the last few bytes of the
+// segment or of memory, or else into bytes, which has room for MAX_INSTRUCTION_SIZE.
+u8 * get_code_bytes(State *state, u16 ip, u8 *bytes)
+{
+    u32 segment_base = (u32)get_code_segment(state) << 4;
+    u32 linear = (segment_base + ip) & MEMORY_ADDRESS_MASK;
+    if (ip <= SEGMENT_SIZE - MAX_INSTRUCTION_SIZE && linear <= MEMORY_SIZE - MAX_INSTRUCTION_SIZE) {
+        return state->memory + linear;
     }
     
-    return instruction_count;
+    for (u32 i = 0; i < MAX_INSTRUCTION_SIZE; ++i) {
+        bytes[i] = state->memory[(segment_base + (u16)(ip + i)) & MEMORY_ADDRESS_MASK];
+    }
+    
+    return bytes;
 }
 
+// Instruction at CS:ip, decoded from memory if it has not been seen before. 0 if it can't be decoded.
+Instruction * decode_at_ip(DecodeCache *cache, State *state, u16 ip)
+{
+    u16 code_segment = get_code_segment(state);
+    if (code_segment != cache->segment) {
+        flush_decode_cache(cache, code_segment);
+    }
+    
+    u32 entry = cache->index[ip];
+    if (entry) {
+        return get_instruction(&cache->store, entry - 1);
+    }
+    
+    u32 segment_base = (u32)code_segment << 4;
+    
+    // Decode errors give the offset of the instruction, which is ip
+    u8 bytes[MAX_INSTRUCTION_SIZE];
+    FileContent code = {};
+    code.memory = get_code_bytes(state, ip, bytes);
+    code.total_size = (u32)ip + MAX_INSTRUCTION_SIZE;
+    code.size_remaining = MAX_INSTRUCTION_SIZE;
+    
+    Instruction *instruction = push_instruction(&cache->store);
+    if (!instruction) {
+        // Only happens after a lot of code was rewritten and decoded again
+        flush_decode_cache(cache, code_segment);
+        instruction = push_instruction(&cache->store);
+    }
+    
+    if (!decode_instruction(&code, instruction)) {
+        --cache->store.count;
+        return 0;
+    }
+    
+    cache->index[ip] = cache->store.count;
+    u32 end = (u32)ip + instruction->bytes_used;
+    if (end > SEGMENT_SIZE) {
+        // Runs over into the start of the segment, which is already below decoded_end
+        end = SEGMENT_SIZE;
+    }
+    if (end > cache->decoded_end) {
+        cache->decoded_end = end;
+    }
+    mark_code(cache, segment_base, ip, instruction->bytes_used);
+    
+    return instruction;
+}
+
+inline Instruction * get_decoded_instruction(DecodeCache *cache, State *state)
+{
+    u32 entry = cache->index[state->ip_register.value];
+    if (entry && get_code_segment(state) == cache->segment) {
+        return cache->store.chunks[(entry - 1) >> INSTRUCTION_CHUNK_SHIFT] + ((entry - 1) & INSTRUCTION_CHUNK_MASK);
+    }
+    
+    return decode_at_ip(cache, state, state->ip_register.value);
+}
+
+#include "sim8086_blocks.cpp"
+#include "sim8086_trace.cpp"
+#include "sim8086_profile.cpp"
+#include "sim8086_cfg.cpp"
+#include "sim8086_estimate.cpp"
+#include "sim8086_run.cpp"
+#include "sim8086_legacy_decode.cpp"
+#include "sim8086_parallel_decode.cpp"
+
 void print_usage(char *program_name)
 {
     fprintf(stdout, "USAGE:  %s [flags] [compiled 8086 program]\n", program_name);
     fprintf(stdout, "    flags:\n");
-    fprintf(stdout, "        nothing: print the dissasembly\n");
-    fprintf(stdout, "        --sim: simulate the instructions\n");
+    fprintf(stdout, "        nothing: print the dissasembly as the program is read, - in place of the program reads stdin\n");
+    fprintf(stdout, "        --sim: simulate the instructions, printing each one with the clocks it took and what it changed\n");
+    fprintf(stdout, "        --no-trace: with --sim, only print the final state\n");
+    fprintf(stdout, "        --binary-trace file: with --sim, write the trace to the file in the compact binary format\n");
+    fprintf(stdout, "        --trace-to-text: print the binary trace given in place of the program as text\n");
+    fprintf(stdout, "        --profile: simulate the instructions and report where the executions and the clocks went\n");
+    fprintf(stdout, "        --break ip: stop the simulation before the instruction at ip (up to %d of them)\n", MAX_BREAKPOINTS);
+    fprintf(stdout, "        --watch address: stop the simulation after the word at address changes\n");
+    fprintf(stdout, "        --dump-full: dump the whole memory to memory_dump.data instead of the written pages to\n");
+    fprintf(stdout, "            memory_dump.sparse\n");
+    fprintf(stdout, "        --dump-every n: add the pages changed in the last n instructions to memory_dump.sparse\n");
+    fprintf(stdout, "            every n instructions\n");
+    fprintf(stdout, "        --checkpoint n file: save a snapshot of the state to the file after n instructions\n");
+    fprintf(stdout, "        --resume: continue from the snapshot given in place of the program\n");
+    fprintf(stdout, "        --threads n: decode the whole program on n threads before printing it, 0 for one per core\n");
+    fprintf(stdout, "        --cfg: print the control flow graph of the program: blocks, edges, dominators and loops\n");
+    fprintf(stdout, "        --cfg-dot file: write the control flow graph to the file in Graphviz DOT\n");
+    fprintf(stdout, "        --estimate: estimate the clocks of every block and loop, and of the whole program, without\n");
+    fprintf(stdout, "            running it\n");
+    fprintf(stdout, "        --bench-decode: measure the decode throughput of the table and the legacy decoders\n");
+    fprintf(stdout, "        --bench-sim: measure how many instructions per second every variant of the run loop does\n");
+    fprintf(stdout, "        --8088: take the clocks of the 8088 instead of the 8086\n");
+    fprintf(stdout, "USAGE:  %s --batch [manifest] [batch options]\n", program_name);
+    fprintf(stdout, "        %s --batch-seeds [compiled 8086 program] [seed file or seed count] [batch options]\n", program_name);
+    fprintf(stdout, "    Simulates every program listed in the manifest (one path per line), or one program once per\n");
+    fprintf(stdout, "    line of the seed file (initial registers as ax=0x10 cx=5 ...), and writes one line per run.\n");
+    fprintf(stdout, "    batch options:\n");
+    fprintf(stdout, "        --threads n: worker threads, one per core by default\n");
+    fprintf(stdout, "        --output file: where to write the results instead of stdout\n");
+    fprintf(stdout, "        --cpu 8086|8088: processor to take the clocks of\n");
+    fprintf(stdout, "        --snapshot file: start every run from this snapshot, with the seeds only setting the registers\n");
+    fprintf(stdout, "            they name\n");
+    fprintf(stdout, "        --max-instructions n: stop runs that go past n instructions (%llu by default)\n", (unsigned long long)BATCH_DEFAULT_MAX_INSTRUCTIONS);
 }
 
 void print_final_state(State state)
@@ -635,294 +944,388 @@ void print_final_state(State state)
     printf("\tcs: 0x%04hx (%d)\n", state.registers[9].value, state.registers[9].value);
     printf("\tss: 0x%04hx (%d)\n", state.registers[10].value, state.registers[10].value);
     printf("\tds: 0x%04hx (%d)\n", state.registers[11].value, state.registers[11].value);
-    printf("\tip: 0x%04hx (%d)\n", state.registers[12].value, state.registers[12].value);
+    printf("\tip: 0x%04hx (%d)\n", state.ip_register.value, state.ip_register.value);
     printf("\n");
     
     printf("    Flags: ");
-    if (state.carry_flag)           { printf("C"); }
-    if (state.parity_flag)          { printf("P"); }
-    if (state.auxiliary_carry_flag) { printf("A"); }
-    if (state.zero_flag)            { printf("Z"); }
-    if (state.sign_flag)            { printf("S"); }
-    if (state.overflow_flag)        { printf("O"); }
+    u16 flags = get_flags(&state);
+    if (flags & FLAG_CARRY)           { printf("C"); }
+    if (flags & FLAG_PARITY)          { printf("P"); }
+    if (flags & FLAG_AUXILIARY_CARRY) { printf("A"); }
+    if (flags & FLAG_ZERO)            { printf("Z"); }
+    if (flags & FLAG_SIGN)            { printf("S"); }
+    if (flags & FLAG_OVERFLOW)        { printf("O"); }
+    printf("\n");
+    
+    printf("    Clocks: %llu\n", state.clocks);
 }
 
-s8 simulate_instruction(State *state, Instruction *instruction)
+void reset_registers(State *state)
 {
-    s8 instructions_to_move = 1;
+    for (u32 i = 0; i < REGISTER_FILE_COUNT; ++i) {
+        state->registers[i].value = 0;
+    }
+    state->ip_register.value = 0;
     
-    state->ip_register.value += instruction->bytes_used;
+    set_flags_value(state, 0);
     
-    // Calculate memory displacement
-    s16 displacement = instruction->displacement_address.offset;
-    if (instruction->displacement_address.first_displacement.type != Register_none) {
-        displacement += state->registers[instruction->displacement_address.first_displacement.type - 1].value;
+    state->clocks = 0;
+}
+
+// Copies the program to CS:0 and returns the size loaded.
+u32 load_program(State *state, u8 *program, u32 program_size)
+{
+    if (program_size > SEGMENT_SIZE) {
+        program_size = SEGMENT_SIZE;
     }
+    memcpy(state->memory, program, program_size);
+    mark_memory_written(state, 0, program_size);
     
-    if (instruction->displacement_address.second_displacement.type != Register_none) {
-        displacement += state->registers[instruction->displacement_address.second_displacement.type - 1].value;
+    return program_size;
+}
+
+struct SimulateOptions {
+    CpuModel cpu;
+    bool trace; // Trace of the executed instructions, as text on stdout unless binary_trace_path is set
+    char *binary_trace_path; // Binary trace to this file
+    bool profile; // Report where the executions and clocks went
+    u16 breakpoints[MAX_BREAKPOINTS]; // IPs to stop at
+    u32 breakpoint_count;
+    bool watching;
+    u32 watch_address; // Stop when the word at this linear address changes
+    bool full_dump; // Raw image of the whole memory instead of the sparse dump
+    u64 dump_interval; // Instructions between incremental sparse dumps, 0 for one dump at the end
+    char *checkpoint_path; // Snapshot saved here after checkpoint_at instructions
+    u64 checkpoint_at;
+    Snapshot *resume_from; // Start from this snapshot instead of loading the program
+};
+
+// Loads the program at CS:0 and runs it until IP leaves the loaded code, with the
+// features of the options, then dumps the memory. Only the run loop for those features
+// is used, see sim8086_run.cpp.
+void simulate_asm_8086(u8 *program, u32 program_size, SimulateOptions *options)
+{
+    State state = {};
+    reset_registers(&state);
+    set_cpu_model(&state, options->cpu);
+    if (!init_memory(&state, MEMORY_SIZE)) {
+        printf("ERROR: could not allocate the simulated memory\n");
+        free_memory(&state);
+        return;
     }
     
+    u32 code_end;
+    if (options->resume_from) {
+        if (!restore_snapshot(&state, options->resume_from)) {
+            printf("ERROR: the snapshot is for a different memory size\n");
+            free_memory(&state);
+            return;
+        }
+        code_end = options->resume_from->header.code_end;
+    } else {
+        code_end = load_program(&state, program, program_size);
+    }
     
-    switch (instruction->operation_type)
-    {
-        case Op_mov: {
-            if (instruction->source_register.type == Register_none)
-            {
-                if (instruction->dest_register.type == Register_none) {
-                    // To memory
-                    *(state->memory + displacement) = (instruction->value & 0xFF);
-                    if (instruction->w) {
-                        *(state->memory + displacement + 1) = (instruction->value >> 8);
-                    }
-                } else if ((instruction->dest_register.bytes >> 3) & 1) {
-                    if (displacement) {
-                        state->registers[instruction->dest_register.type - 1].value = *((u16 *)(state->memory + displacement));
-                    } else {
-                        state->registers[instruction->dest_register.type - 1].value = instruction->value;
-                    }
-                } else {
-                    u16 value;
-                    if (instruction->dest_register.bytes & 0b0100) {
-                        // High bits
-                        state->registers[instruction->dest_register.type - 1].value &= 0x00FF;
-                        value = (instruction->value << 8);
-                    } else {
-                        // Lower bits
-                        state->registers[instruction->dest_register.type - 1].value &= 0xFF00;
-                        value = (u8)instruction->value;
-                    }
-                    
-                    state->registers[instruction->dest_register.type - 1].value |= value;
-                }
-            }
-            else
-            {
-                u16 source_register_value = state->registers[instruction->source_register.type - 1].value;
-                if (instruction->dest_register.type == Register_none) {
-                    // To memory
-                    *(state->memory + displacement) = (source_register_value & 0xFF);
-                    if (instruction->w) {
-                        *(state->memory + displacement + 1) = (source_register_value >> 8);
-                    }
-                } else if ((instruction->source_register.bytes >> 3) & 1) {
-                    if (displacement) {
-                        state->registers[instruction->dest_register.type - 1].value = *((u16 *)(state->memory + displacement));
-                    } else {
-                        state->registers[instruction->dest_register.type - 1].value = source_register_value;
-                    }
-                    
-                } else {
-                    u16 value;
-                    if (instruction->source_register.bytes & 0b0100) {
-                        // High bits
-                        value = (source_register_value >> 8);
-                    } else {
-                        // Lower bits
-                        value = (source_register_value & 0xFF);
-                    }
-                    
-                    if (instruction->dest_register.bytes & 0b0100) {
-                        // High bits
-                        state->registers[instruction->dest_register.type - 1].value &= 0x00FF;
-                        state->registers[instruction->dest_register.type - 1].value |= (value << 8);
-                    } else {
-                        // Lower bits
-                        state->registers[instruction->dest_register.type - 1].value &= 0xFF00;
-                        state->registers[instruction->dest_register.type - 1].value |= (value & 0xFF);
-                    }
-                }
-            }
-            
-            state->parity_flag = false;
-            state->zero_flag = false;
-            state->sign_flag = false;
-            state->overflow_flag = false;
-            state->carry_flag = false;
-            state->auxiliary_carry_flag = false;
-        } break;
-        
-        case Op_add: {
-            u16 new_value;
-            u16 prev_value = state->registers[instruction->dest_register.type - 1].value;
-            u16 source_value;
-            if (instruction->source_register.type == Register_none) {
-                source_value = instruction->value;
-            } else {
-                source_value = state->registers[instruction->source_register.type - 1].value;
-            }
-            
-            
-            if (displacement) {
-                if (instruction->dest_register.type == Register_none) {
-                    *((u16 *)(state->memory + displacement)) += source_value;
-                    new_value = *((u16 *)(state->memory + displacement));
-                } else {
-                    state->registers[instruction->dest_register.type - 1].value += *((u16 *)(state->memory + displacement));
-                    new_value = state->registers[instruction->dest_register.type - 1].value;
-                }
-            } else {
-                state->registers[instruction->dest_register.type - 1].value += source_value;
-                new_value = state->registers[instruction->dest_register.type - 1].value;
-            }
-            
-            state->parity_flag = (count_one_bits((u8)new_value) % 2 == 0);
-            state->zero_flag = (new_value == 0);
-            state->sign_flag = ((new_value >> 15) & 1);
-            state->overflow_flag = (((prev_value & 0x8000) == (source_value & 0x8000)) && 
-                                    ((new_value & 0x8000) != (prev_value & 0x8000)));
-            state->carry_flag = (MAX_U16 - prev_value) < source_value;
-            state->auxiliary_carry_flag = ((((prev_value >> 3) & 1) != ((new_value >> 3) & 1)) &&
-                                           (((prev_value >> 4) & 1) != ((new_value >> 4) & 1)));
-        } break;
+    FILE *trace_file = stdout;
+    if (options->trace && options->binary_trace_path) {
+        trace_file = fopen(options->binary_trace_path, "wb");
+    }
+    
+    const char *dump_path = options->full_dump ? "memory_dump.data" : "memory_dump.sparse";
+    FILE *dump_file = fopen(dump_path, "wb");
+    
+    if (!trace_file || !dump_file) {
+        printf("ERROR: could not write file %s\n", trace_file ? dump_path : options->binary_trace_path);
+        if (trace_file && trace_file != stdout) {
+            fclose(trace_file);
+        }
+        if (dump_file) {
+            fclose(dump_file);
+        }
+        free_memory(&state);
+        return;
+    }
+    
+    MemoryArena arena = {};
+    DecodeCache cache;
+    init_decode_cache(&cache, &arena, state.memory_size);
+    
+    RunHooks hooks = {};
+    
+    TraceWriter trace;
+    if (options->trace) {
+        begin_trace(&trace, trace_file, options->binary_trace_path != 0, &state, options->cpu);
+        hooks.trace = &trace;
+    }
+    
+    if (options->profile) {
+        hooks.profile = (Profile *)calloc(1, sizeof(Profile));
+    }
+    
+    Watchpoints watch;
+    if (options->breakpoint_count || options->watching) {
+        init_watchpoints(&watch);
+        for (u32 i = 0; i < options->breakpoint_count; ++i) {
+            watch.breakpoints[options->breakpoints[i]] = 1;
+        }
+        if (options->watching) {
+            set_watch_address(&watch, &state, options->watch_address);
+        }
+        hooks.watch = &watch;
+    }
+    
+    RunProgramProc *run = select_run_program(&hooks);
+    
+    // Runs are cut at block ends, so dumps and the checkpoint can come a few instructions late
+    bool incremental = !options->full_dump && options->dump_interval;
+    u64 next_dump = incremental ? options->dump_interval : ~0ull;
+    u64 checkpoint_at = options->checkpoint_path ? options->checkpoint_at : ~0ull;
+    u64 executed = 0;
+    for (;;) {
+        u64 stop = (next_dump < checkpoint_at) ? next_dump : checkpoint_at;
+        executed += run(&state, &cache, code_end, stop - executed, &hooks);
+        if (executed < stop || state.ip_register.value >= code_end) {
+            break;
+        }
         
-        case Op_sub: {
-            u16 prev_value = state->registers[instruction->dest_register.type - 1].value;
-            u16 source_value;
-            if (instruction->source_register.type == Register_none) {
-                source_value = instruction->value;
-            } else {
-                source_value = state->registers[instruction->source_register.type - 1].value;
+        if (executed >= checkpoint_at) {
+            Snapshot snapshot = {};
+            if (!take_snapshot(&state, &snapshot, code_end) || !save_snapshot(&snapshot, options->checkpoint_path)) {
+                printf("ERROR: could not write file %s\n", options->checkpoint_path);
             }
-            
-            state->registers[instruction->dest_register.type - 1].value -= source_value;
-            
-            u16 new_value = state->registers[instruction->dest_register.type - 1].value;
-            state->parity_flag = (count_one_bits((u8)new_value) % 2 == 0);
-            state->zero_flag = (new_value == 0);
-            state->sign_flag = ((new_value >> 15) & 1);
-            state->overflow_flag = (((prev_value & 0x8000) != (source_value & 0x8000)) && 
-                                    ((new_value & 0x8000) != (prev_value & 0x8000)));
-            state->carry_flag = prev_value < source_value;
-            state->auxiliary_carry_flag = ((((prev_value >> 3) & 1) != ((new_value >> 3) & 1)) &&
-                                           (((prev_value >> 4) & 1) != ((new_value >> 4) & 1)));
-        } break;
+            free_snapshot(&snapshot);
+            checkpoint_at = ~0ull;
+        }
         
-        case Op_cmp: {
-            u16 prev_value = state->registers[instruction->dest_register.type - 1].value;
-            u16 source_value;
-            if (instruction->source_register.type == Register_none) {
-                source_value = instruction->value;
-            } else {
-                source_value = state->registers[instruction->source_register.type - 1].value;
-            }
-            
-            u16 new_value = prev_value - source_value;
-            
-            state->parity_flag = (count_one_bits((u8)new_value) % 2 == 0);
-            state->zero_flag = (new_value == 0);
-            state->sign_flag = ((new_value >> 15) & 1);
-            state->overflow_flag = (((prev_value & 0x8000) != (source_value & 0x8000)) && 
-                                    ((new_value & 0x8000) != (prev_value & 0x8000)));
-            state->carry_flag = prev_value < source_value;
-            state->auxiliary_carry_flag = ((((prev_value >> 3) & 1) != ((new_value >> 3) & 1)) &&
-                                           (((prev_value >> 4) & 1) != ((new_value >> 4) & 1)));
-        } break;
+        if (executed >= next_dump) {
+            write_memory_dump(&state, dump_file, true, executed);
+            next_dump = executed + options->dump_interval;
+        }
+    }
+    
+    if (hooks.trace) {
+        end_trace(&trace);
+        if (trace_file != stdout) {
+            fclose(trace_file);
+        }
+    }
+    
+    if (hooks.watch) {
+        if (watch.stop == Watch_breakpoint) {
+            printf("\nStopped at the breakpoint at ip 0x%04x\n", watch.stop_ip);
+        } else if (watch.stop == Watch_changed) {
+            printf("\nStopped after the instruction at ip 0x%04x changed the word at 0x%05x from 0x%04x to 0x%04x\n",
+                   watch.stop_ip, watch.watch_address, watch.old_value, watch.watch_value);
+        }
+        free_watchpoints(&watch);
+    }
+    
+    if (hooks.profile) {
+        if (hooks.trace || hooks.watch) {
+            printf("\n");
+        }
+        print_profile(&state, hooks.profile);
+        free(hooks.profile);
+    }
+    
+    print_final_state(state);
+    
+    if (options->full_dump) {
+        write_full_memory_dump(&state, dump_file);
+    } else {
+        write_memory_dump(&state, dump_file, incremental, executed);
+    }
+    fclose(dump_file);
+    
+    flush_blocks(&cache);
+    free_arena(&arena);
+    free_memory(&state);
+}
+
+// Runs the program over and over from a fresh register state with every variant of the
+// run loop, and prints how many simulated instructions per second each one does. The
+// decode cache stays warm between runs. The trace is formatted but not written out,
+// and the watch variants check for breakpoints that are never hit.
+void bench_simulate(u8 *program, u32 program_size, CpuModel cpu)
+{
+    State state = {};
+    set_cpu_model(&state, cpu);
+    Profile *profile = (Profile *)calloc(1, sizeof(Profile));
+    if (!init_memory(&state, MEMORY_SIZE) || !profile) {
+        printf("ERROR: could not allocate the simulated memory\n");
+        free_memory(&state);
+        free(profile);
+        return;
+    }
+    
+    MemoryArena arena = {};
+    DecodeCache cache;
+    init_decode_cache(&cache, &arena, state.memory_size);
+    
+    TraceWriter trace;
+    begin_trace(&trace, 0, false, &state, cpu);
+    
+    Watchpoints watch;
+    init_watchpoints(&watch);
+    
+    printf("Simulated instructions per second, by run loop:\n");
+    for (u32 variant = 0; variant < RUN_VARIANT_COUNT; ++variant) {
+        RunHooks hooks = {};
+        hooks.trace = (variant & RUN_TRACE) ? &trace : 0;
+        hooks.profile = (variant & RUN_PROFILE) ? profile : 0;
+        hooks.watch = (variant & RUN_WATCH) ? &watch : 0;
+        RunProgramProc *run = select_run_program(&hooks);
         
-        case Op_jmp: {
-            bool should_jump = false;
-            switch (instruction->binary)
-            {
-                case OPCODE_JE:     { should_jump = state->zero_flag; } break;
-                case OPCODE_JL:     { should_jump = false; } break;
-                case OPCODE_JLE:    { should_jump = false; } break;
-                case OPCODE_JB:     { should_jump = state->carry_flag; } break;
-                case OPCODE_JBE:    { should_jump = false; } break;
-                case OPCODE_JP:     { should_jump = state->parity_flag; } break;
-                case OPCODE_JO:     { should_jump = false; } break;
-                case OPCODE_JS:     { should_jump = false; } break;
-                case OPCODE_JNE:    { should_jump = !state->zero_flag; } break;
-                case OPCODE_JNL:    { should_jump = false; } break;
-                case OPCODE_JNLE:   { should_jump = false; } break;
-                case OPCODE_JNB:    { should_jump = false; } break;
-                case OPCODE_JNBE:   { should_jump = false; } break;
-                case OPCODE_JNP:    { should_jump = false; } break;
-                case OPCODE_JNO:    { should_jump = false; } break;
-                case OPCODE_JNS:    { should_jump = false; } break;
-                case OPCODE_LOOP:   { should_jump = ((s16)--state->registers[2].value > 0); } break;
-                case OPCODE_LOOPZ:  { should_jump = false; } break;
-                case OPCODE_LOOPNZ: { should_jump = !state->zero_flag; } break;
-                case OPCODE_JCXZ:   { should_jump = false; } break;
-            }
+        u64 runs = 0;
+        u64 executed = 0;
+        double start = get_seconds();
+        double elapsed = 0;
+        do {
+            reset_registers(&state);
+            u32 code_end = load_program(&state, program, program_size);
+            executed += run(&state, &cache, code_end, ~0ull, &hooks);
+            ++runs;
             
-            if (should_jump) {
-                if (instruction->binary == OPCODE_LOOPNZ) {
-                    if (--state->registers[2].value == 0) {
-                        break;
-                    }
-                }
-                
-                state->ip_register.value += (s8)instruction->value;
-                instructions_to_move = 0;
-                
-                if ((s8)instruction->value < 0) {
-                    s8 bytes_remaining = -instruction->bytes_used - (s8)instruction->value;
-                    
-                    while (bytes_remaining) {
-                        --instruction;
-                        --instructions_to_move;
-                        bytes_remaining -= instruction->bytes_used;
-                    }
-                } else {
-                    s8 bytes_remaining = instruction->bytes_used + (s8)instruction->value;
-                    
-                    while (bytes_remaining) {
-                        bytes_remaining -= instruction->bytes_used;
-                        ++instruction;
-                        ++instructions_to_move;
-                    }
-                }
-            }
-        } break;
+            elapsed = get_seconds() - start;
+        } while (elapsed < 0.5);
         
+        printf("    %-20s %8.2f million instructions/s  (%llu runs)\n", run_variant_names[variant],
+               ((double)executed / elapsed) / 1000000.0, runs);
     }
     
-    return instructions_to_move;
+    end_trace(&trace);
+    free_watchpoints(&watch);
+    free(profile);
+    
+    flush_blocks(&cache);
+    free_arena(&arena);
+    free_memory(&state);
 }
 
-void dump_memory(u8 *memory, u32 size)
+// Decodes the program over and over and returns the throughput in MB/s of machine code.
+// The legacy decoder writes to a flat array, the table decoder to the instruction store.
+double measure_decode(u8 *code, u32 size, InstructionStore *store, LegacyInstruction *legacy_instructions, u32 thread_count = 1)
 {
-    FILE *file = fopen("memory_dump.data", "wb");
-    if (file)
-    {
-        fwrite(memory, 1, size, file);
+    u64 total_bytes = 0;
+    double start = get_seconds();
+    double elapsed = 0;
+    do {
+        FileContent file_content = {};
+        file_content.memory = code;
+        file_content.total_size = size;
+        file_content.size_remaining = size;
         
-        fclose(file);
+        u32 count;
+        if (store && thread_count != 1) {
+            count = parallel_decode_asm_8086(code, size, store, thread_count);
+        } else if (store) {
+            count = decode_asm_8086(&file_content, store);
+        } else {
+            count = legacy_decode_asm_8086(&file_content, legacy_instructions);
+        }
+        
+        if (!count) {
+            return 0;
+        }
+        
+        total_bytes += size;
+        elapsed = get_seconds() - start;
+    } while (elapsed < 1.0);
+    
+    double result = ((double)total_bytes / (double)MEGABYTES(1)) / elapsed;
+    
+    return result;
+}
+
+void bench_decode(u8 *program, u32 program_size)
+{
+    // Repeat the program to get a block big enough to not be dominated by the loop
+    // setup, but small enough to stay in the cache together with its instructions.
+    u32 copies = (KILOBYTES(16) + program_size - 1) / program_size;
+    u32 size = copies*program_size;
+    u8 *code = (u8 *)malloc(size);
+    for (u32 i = 0; i < copies; ++i) {
+        memcpy(code + i*program_size, program, program_size);
+    }
+    
+    MemoryArena arena = {};
+    InstructionStore store;
+    init_instruction_store(&store, &arena, size);
+    LegacyInstruction *legacy_instructions = (LegacyInstruction *)malloc(size*sizeof(LegacyInstruction));
+    
+    double table_speed = measure_decode(code, size, &store, 0);
+    double legacy_speed = measure_decode(code, size, 0, legacy_instructions);
+    
+    printf("Decode throughput over %u bytes of code:\n", size);
+    printf("    table:  %.2f MB/s\n", table_speed);
+    printf("    legacy: %.2f MB/s\n", legacy_speed);
+    if (legacy_speed > 0) {
+        printf("    speedup: %.2fx\n", table_speed / legacy_speed);
     }
+    
+    // Threads only pay off on images far bigger than the cache
+    u32 image_copies = (MEGABYTES(8) + program_size - 1) / program_size;
+    u32 image_size = image_copies*program_size;
+    u8 *image = (u8 *)malloc(image_size);
+    for (u32 i = 0; i < image_copies; ++i) {
+        memcpy(image + i*program_size, program, program_size);
+    }
+    
+    MemoryArena image_arena = {};
+    InstructionStore image_store;
+    init_instruction_store(&image_store, &image_arena, image_size);
+    
+    u32 thread_count = get_processor_count();
+    double sequential_speed = measure_decode(image, image_size, &image_store, 0);
+    double parallel_speed = measure_decode(image, image_size, &image_store, 0, thread_count);
+    
+    printf("Decode throughput over %u bytes of code:\n", image_size);
+    printf("    table:    %.2f MB/s\n", sequential_speed);
+    printf("    parallel: %.2f MB/s on %u threads\n", parallel_speed, thread_count);
+    
+    free_arena(&image_arena);
+    free(image);
+    free(legacy_instructions);
+    free_arena(&arena);
+    free(code);
 }
 
-void simulate_asm_8086(Instruction *instructions, u32 count)
+void analyze_control_flow(InstructionStore *store, u32 code_size, bool print, char *dot_path, bool estimate, CpuModel cpu)
 {
-    State state = {};
-    state.registers[0] = {Register_a, 0};
-    state.registers[1] = {Register_b, 0};
-    state.registers[2] = {Register_c, 0};
-    state.registers[3] = {Register_d, 0};
-    state.registers[4] = {Register_sp, 0};
-    state.registers[5] = {Register_bp, 0};
-    state.registers[6] = {Register_si, 0};
-    state.registers[7] = {Register_di, 0};
-    state.registers[8] = {Register_es, 0};
-    state.registers[9] = {Register_cs, 0};
-    state.registers[10] = {Register_ss, 0};
-    state.registers[11] = {Register_ds, 0};
-    state.ip_register = {Register_ip, 0};
-    state.memory_size = MEGABYTES(1);
-    state.memory = (u8 *)malloc(state.memory_size);
-    
-    for (int instruction_index = 0; instruction_index < count;) {
-        Instruction *instruction = instructions + instruction_index;
-        s8 instructions_to_move = simulate_instruction(&state, instruction);
-        instruction_index += instructions_to_move;
-    }
-    
-    print_instructions(instructions, count);
+    MemoryArena arena = {};
+    Cfg cfg;
     
-    print_final_state(state);
+    double start = get_seconds();
+    bool built = build_cfg(&cfg, store, code_size, &arena);
+    double build_seconds = get_seconds() - start;
+    
+    if (!built) {
+        printf("ERROR: no instructions to build the control flow graph from\n");
+    } else {
+        if (print) {
+            print_cfg(&cfg, build_seconds);
+        }
+        
+        if (estimate) {
+            if (print) {
+                printf("\n");
+            }
+            
+            CostEstimate cost_estimate;
+            estimate_costs(&cfg, store, cpu, &cost_estimate, &arena);
+            print_cost_estimate(&cfg, &cost_estimate);
+        }
+        
+        if (dot_path && !write_cfg_dot(&cfg, store, dot_path)) {
+            printf("ERROR: could not write %s\n", dot_path);
+        }
+    }
     
-    dump_memory(state.memory, state.memory_size);
+    free_arena(&arena);
 }
 
+#include "sim8086_batch.cpp"
+
 int main(int argc, char **argv)
 {
     char *program_name = argv[0];
@@ -931,27 +1334,168 @@ int main(int argc, char **argv)
         return 1;
     }
     
+    if (str_equals(argv[1], "--batch") || str_equals(argv[1], "--batch-seeds")) {
+        bool seeds = str_equals(argv[1], "--batch-seeds");
+        int first_option = seeds ? 4 : 3;
+        if (argc < first_option) {
+            print_usage(program_name);
+            return 1;
+        }
+        
+        BatchOptions options = {};
+        options.max_instructions = BATCH_DEFAULT_MAX_INSTRUCTIONS;
+        Snapshot snapshot = {};
+        for (int i = first_option; i < argc; i += 2) {
+            if (i + 1 >= argc) {
+                print_usage(program_name);
+                return 1;
+            }
+            
+            if (str_equals(argv[i], "--threads")) {
+                options.thread_count = atoi(argv[i + 1]);
+            } else if (str_equals(argv[i], "--output")) {
+                options.output_path = argv[i + 1];
+            } else if (str_equals(argv[i], "--max-instructions")) {
+                options.max_instructions = strtoull(argv[i + 1], 0, 10);
+            } else if (str_equals(argv[i], "--cpu") && (str_equals(argv[i + 1], "8086") || str_equals(argv[i + 1], "8088"))) {
+                options.cpu = str_equals(argv[i + 1], "8088") ? Cpu_8088 : Cpu_8086;
+            } else if (str_equals(argv[i], "--snapshot")) {
+                if (!load_snapshot(&snapshot, argv[i + 1]) || snapshot.header.memory_size != MEMORY_SIZE) {
+                    printf("ERROR: could not read snapshot %s\n", argv[i + 1]);
+                    return 1;
+                }
+                options.snapshot = &snapshot;
+            } else {
+                print_usage(program_name);
+                return 1;
+            }
+        }
+        
+        build_decode_table();
+        init_register_operands();
+        init_execute_handlers();
+        
+        int result;
+        if (seeds) {
+            result = run_seed_batch(argv[2], argv[3], &options);
+        } else {
+            result = run_program_batch(argv[2], &options);
+        }
+        
+        free_snapshot(&snapshot);
+        
+        return result;
+    }
+    
     char *filename;
     char *flag;
     
     bool simulate = false;
+    bool benchmark = false;
+    bool benchmark_simulation = false;
+    bool trace_to_text = false;
+    bool resume = false;
+    bool no_trace = false;
+    bool show_cfg = false;
+    bool estimate = false;
+    bool parallel_decode = false;
+    u32 decode_threads = 0;
+    char *cfg_dot_path = 0;
+    CpuModel cpu = Cpu_8086;
+    SimulateOptions simulate_options = {};
     
-    if (argc == 3) {
-        flag = argv[1];
+    for (int i = 1; i < argc - 1; ++i) {
+        flag = argv[i];
         
-        if (!str_equals(flag, "--sim")) {
+        if (str_equals(flag, "--sim")) {
+            simulate = true;
+        } else if (str_equals(flag, "--bench-decode")) {
+            benchmark = true;
+        } else if (str_equals(flag, "--bench-sim")) {
+            benchmark_simulation = true;
+        } else if (str_equals(flag, "--profile")) {
+            simulate_options.profile = true;
+        } else if (str_equals(flag, "--no-trace")) {
+            no_trace = true;
+        } else if (str_equals(flag, "--break") && i + 1 < argc - 1 && simulate_options.breakpoint_count < MAX_BREAKPOINTS) {
+            simulate_options.breakpoints[simulate_options.breakpoint_count++] = (u16)strtoul(argv[++i], 0, 0);
+        } else if (str_equals(flag, "--watch") && i + 1 < argc - 1) {
+            simulate_options.watching = true;
+            simulate_options.watch_address = strtoul(argv[++i], 0, 0) & (MEMORY_SIZE - 2);
+        } else if (str_equals(flag, "--8088")) {
+            cpu = Cpu_8088;
+        } else if (str_equals(flag, "--binary-trace") && i + 1 < argc - 1) {
+            simulate_options.binary_trace_path = argv[++i];
+        } else if (str_equals(flag, "--dump-full")) {
+            simulate_options.full_dump = true;
+        } else if (str_equals(flag, "--dump-every") && i + 1 < argc - 1) {
+            simulate_options.dump_interval = strtoull(argv[++i], 0, 10);
+        } else if (str_equals(flag, "--checkpoint") && i + 2 < argc - 1) {
+            simulate_options.checkpoint_at = strtoull(argv[++i], 0, 10);
+            simulate_options.checkpoint_path = argv[++i];
+        } else if (str_equals(flag, "--resume")) {
+            resume = true;
+        } else if (str_equals(flag, "--cfg")) {
+            show_cfg = true;
+        } else if (str_equals(flag, "--threads") && i + 1 < argc - 1) {
+            parallel_decode = true;
+            decode_threads = strtoul(argv[++i], 0, 10);
+        } else if (str_equals(flag, "--estimate")) {
+            estimate = true;
+        } else if (str_equals(flag, "--cfg-dot") && i + 1 < argc - 1) {
+            cfg_dot_path = argv[++i];
+        } else if (str_equals(flag, "--trace-to-text")) {
+            trace_to_text = true;
+        } else {
             print_usage(program_name);
             return 2;
         }
+    }
+    
+    filename = argv[argc - 1];
+    
+    simulate_options.cpu = cpu;
+    simulate_options.trace = simulate && !no_trace;
+    
+    build_decode_table();
+    init_register_operands();
+    init_execute_handlers();
+    
+    if (trace_to_text) {
+        return convert_trace(filename);
+    }
+    
+    if (resume) {
+        Snapshot snapshot;
+        if (!load_snapshot(&snapshot, filename)) {
+            printf("ERROR: could not read snapshot %s\n", filename);
+            return 1;
+        }
         
-        filename = argv[2];
-        simulate = true;
-    } else {
-        filename = argv[1];
+        simulate_options.resume_from = &snapshot;
+        simulate_asm_8086(0, 0, &simulate_options);
+        
+        free_snapshot(&snapshot);
+        return 0;
+    }
+    
+    bool disassemble = !(simulate || simulate_options.profile || benchmark || benchmark_simulation ||
+                         show_cfg || cfg_dot_path || estimate || parallel_decode);
+    if (disassemble && str_equals(filename, "-")) {
+        set_binary_mode(stdin);
+        bool ok = disassemble_stream(stdin, stdout);
+        return ok ? 0 : 1;
     }
     
     FILE *file = fopen(filename, "rb");
-    if (file)
+    if (file && disassemble) {
+        bool ok = disassemble_stream(file, stdout);
+        fclose(file);
+        if (!ok) {
+            return 1;
+        }
+    }
+    else if (file)
     {
         fseek(file, 0, SEEK_END);
         u32 size = ftell(file);
@@ -968,14 +1512,38 @@ int main(int argc, char **argv)
         file_content.size_remaining = size;
         
         
-        Instruction instructions[256];
-        u32 count = decode_asm_8086(&file_content, instructions);
+        if (benchmark) {
+            bench_decode(memory, size);
+            return 0;
+        }
         
-        if (simulate) {
-            simulate_asm_8086(instructions, count);
+        if (benchmark_simulation) {
+            bench_simulate(memory, size, cpu);
+            return 0;
+        }
+        
+        if (simulate || simulate_options.profile) {
+            simulate_asm_8086(memory, size, &simulate_options);
         } else {
-            print_instructions(instructions, count);
+            MemoryArena arena = {};
+            InstructionStore store;
+            init_instruction_store(&store, &arena, size);
+            if (parallel_decode) {
+                parallel_decode_asm_8086(memory, size, &store, decode_threads);
+            } else {
+                decode_asm_8086(&file_content, &store);
+            }
+            
+            if (show_cfg || cfg_dot_path || estimate) {
+                analyze_control_flow(&store, size, show_cfg, cfg_dot_path, estimate, cpu);
+            } else {
+                write_listing(&store, stdout);
+            }
+            
+            free_arena(&arena);
         }
+        
+        free(memory);
     }
     else
     {
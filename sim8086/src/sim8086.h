@@ -93,6 +93,23 @@ enum OperationType {
     Op_jmp,
 };
 
+// The operation that last set the flags in State.
+enum FlagsOperation {
+    Flags_value, // flags_result holds the flag bits as laid out in the 8086 FLAGS register
+    Flags_add,
+    Flags_sub,
+};
+
+// Bits of the 8086 FLAGS register.
+enum FlagBits {
+    FLAG_CARRY           = 0x0001,
+    FLAG_PARITY          = 0x0004,
+    FLAG_AUXILIARY_CARRY = 0x0010,
+    FLAG_ZERO            = 0x0040,
+    FLAG_SIGN            = 0x0080,
+    FLAG_OVERFLOW        = 0x0800,
+};
+
 enum Flags {
     WORD_BYTE_TEXT_REQUIRED = 0x1,
     REG_SOURCE_DEST = 0x2,
@@ -104,6 +121,44 @@ enum Flags {
     SEGMENT = 0x80,
 };
 
+// Shape of the bytes that follow the first byte of an instruction.
+enum DecodeForm {
+    Form_invalid,
+    
+    Form_rm_reg,                 // mod reg r/m, [disp]
+    Form_rm_immediate,           // mod 000 r/m, [disp], data
+    Form_reg_immediate,          // reg in the first byte, data
+    Form_accumulator_address,    // addr-lo addr-hi
+    Form_segment,                // mod 0 sr r/m, [disp]
+    Form_arithmetic_immediate,   // mod op r/m, [disp], data (operation given by op)
+    Form_accumulator_immediate,  // data
+    Form_jump,                   // ip-inc8
+};
+
+enum ClockClass {
+    Clocks_none,
+    
+    Clocks_mov_rm,               // reg, reg: 2; reg, mem: 8; mem, reg: 9
+    Clocks_mov_immediate_rm,     // reg: 4; mem: 10
+    Clocks_fixed,                // Always DecodeEntry::clocks
+    Clocks_arithmetic_immediate, // reg: 4; mem: add/sub 17, cmp 10
+    Clocks_arithmetic_rm,        // reg, reg: 3; reg, mem: 9; mem, reg: add/sub 16, cmp 9
+};
+
+// One entry per possible first byte, so the decoder only needs one indexed load to
+// know the whole form of the instruction.
+struct DecodeEntry {
+    OperationType operation_type; // Op_none on arithmetic groups, the operation is in the second byte
+    u8 form;
+    u8 flags;
+    u8 w;
+    u8 d;
+    u8 s;
+    u8 reg;
+    u8 clock_class;
+    u8 clocks;
+};
+
 OperationType arithmetic_operations[8] = {
     Op_add,  // 000
     Op_none, // 001
@@ -120,8 +175,149 @@ struct FileContent {
     u8 *memory;
     u32 total_size;
     u32 size_remaining;
+    bool truncated; // Set when an instruction needed more bytes than there were left
+};
+
+// Text built in memory and written out in big pieces. The writers do not check for
+// room, callers make sure there is space for the longest thing they write.
+struct TextBuffer {
+    char *data;
+    u32 capacity;
+    u32 used;
+};
+
+inline void write_char(TextBuffer *buffer, char c)
+{
+    buffer->data[buffer->used++] = c;
+}
+
+inline void write_string(TextBuffer *buffer, const char *s)
+{
+    while (*s) {
+        buffer->data[buffer->used++] = *s++;
+    }
+}
+
+inline void write_bytes(TextBuffer *buffer, void *bytes, u32 size)
+{
+    memcpy(buffer->data + buffer->used, bytes, size);
+    buffer->used += size;
+}
+
+inline void write_decimal(TextBuffer *buffer, s64 value)
+{
+    u64 magnitude = (u64)value;
+    if (value < 0) {
+        write_char(buffer, '-');
+        magnitude = 0 - magnitude;
+    }
+    
+    char digits[20];
+    u32 count = 0;
+    do {
+        digits[count++] = (char)('0' + magnitude % 10);
+        magnitude /= 10;
+    } while (magnitude);
+    
+    while (count) {
+        buffer->data[buffer->used++] = digits[--count];
+    }
+}
+
+// Lowercase with a 0x prefix and no leading zeros, like the reference traces.
+inline void write_hex(TextBuffer *buffer, u32 value)
+{
+    write_char(buffer, '0');
+    write_char(buffer, 'x');
+    
+    u32 shift = 28;
+    while (shift && !(value >> shift)) {
+        shift -= 4;
+    }
+    for (;;) {
+        buffer->data[buffer->used++] = "0123456789abcdef"[(value >> shift) & 0xF];
+        if (!shift) {
+            break;
+        }
+        shift -= 4;
+    }
+}
+
+// Without a file the text is dropped, for benchmarks of the formatting.
+inline void flush_text(TextBuffer *buffer, FILE *file)
+{
+    if (buffer->used) {
+        if (file) {
+            fwrite(buffer->data, 1, buffer->used, file);
+        }
+        buffer->used = 0;
+    }
+}
+
+struct MemoryBlock {
+    MemoryBlock *prev;
+    size_t size;
+    size_t used;
 };
 
+// Growable arena made of chained blocks. Nothing allocated from it moves, so
+// pointers into it stay valid while it grows.
+struct MemoryArena {
+    MemoryBlock *current;
+    size_t minimum_block_size;
+};
+
+#define DEFAULT_ARENA_BLOCK_SIZE MEGABYTES(4)
+
+#define push_struct(arena, type) (type *)push_size(arena, sizeof(type))
+#define push_array(arena, count, type) (type *)push_size(arena, (count)*sizeof(type))
+
+inline void * push_size(MemoryArena *arena, size_t size, size_t alignment = 8)
+{
+    MemoryBlock *block = arena->current;
+    size_t offset = 0;
+    if (block) {
+        offset = (block->used + (alignment - 1)) & ~(alignment - 1);
+    }
+    
+    if (!block || (offset + size) > block->size) {
+        size_t block_size = arena->minimum_block_size ? arena->minimum_block_size : DEFAULT_ARENA_BLOCK_SIZE;
+        if (block_size < size) {
+            block_size = size;
+        }
+        
+        MemoryBlock *new_block = (MemoryBlock *)malloc(sizeof(MemoryBlock) + block_size);
+        if (!new_block) {
+            return 0;
+        }
+        
+        new_block->prev = block;
+        new_block->size = block_size;
+        new_block->used = 0;
+        
+        arena->current = new_block;
+        block = new_block;
+        offset = 0;
+    }
+    
+    void *result = (u8 *)(block + 1) + offset;
+    block->used = offset + size;
+    
+    return result;
+}
+
+inline void free_arena(MemoryArena *arena)
+{
+    MemoryBlock *block = arena->current;
+    while (block) {
+        MemoryBlock *to_free = block;
+        block = block->prev;
+        free(to_free);
+    }
+    
+    arena->current = 0;
+}
+
 enum RegisterType {
     Register_none,
     
@@ -170,50 +366,326 @@ RegisterDefinition segment_registers[4] = {
     {Register_ds, "ds", 0b1111},
 };
 
-struct DisplacementAddress {
-    RegisterDefinition first_displacement;
-    RegisterDefinition second_displacement;
-    s16 offset;
-    u8 clocks;
+// Segment registers by their sr encoding, the order of segment_registers.
+enum SegmentRegister {
+    Segment_es,
+    Segment_cs,
+    Segment_ss,
+    Segment_ds,
 };
 
+// es:, cs:, ss: and ds: prefixes are 001sr110.
+inline bool is_segment_prefix(u8 byte)
+{
+    bool result = ((byte & 0b11100111) == 0b00100110);
+    
+    return result;
+}
+
+// Register operands of a decoded instruction are indices into register_operands: 0 is
+// no register, then the 8-bit and 16-bit registers in (w, reg) encoding order and
+// the segment registers.
+#define REGISTER_OPERAND_SEGMENT 17
+#define REGISTER_OPERAND_COUNT 21
+
+RegisterDefinition register_operands[REGISTER_OPERAND_COUNT];
+
+// Byte offset of every register operand in State::register_bytes, so reading or writing
+// one is a load or store at the offset with nothing to work out.
+u8 register_operand_offsets[REGISTER_OPERAND_COUNT];
+
+void init_register_operands()
+{
+    register_operands[0] = {Register_none, "", 0};
+    for (u32 reg = 0; reg < 8; ++reg) {
+        register_operands[1 + reg] = registers_definitions[reg][0];
+        register_operands[9 + reg] = registers_definitions[reg][1];
+    }
+    for (u32 sr = 0; sr < 4; ++sr) {
+        register_operands[REGISTER_OPERAND_SEGMENT + sr] = segment_registers[sr];
+    }
+    
+    register_operand_offsets[0] = 0;
+    for (u32 operand = 1; operand < REGISTER_OPERAND_COUNT; ++operand) {
+        RegisterDefinition *reg = register_operands + operand;
+        u32 offset;
+        if (reg->bytes & 0b1000) {
+            offset = (reg->type - 1)*2;
+        } else {
+            // The high half (ah, ch, dh, bh) has bit 2 set in the encoding
+            offset = (reg->type - 1)*2 + ((reg->bytes >> 2) & 1);
+        }
+        register_operand_offsets[operand] = (u8)offset;
+    }
+}
+
+inline u8 get_register_operand(u8 w, u8 reg)
+{
+    u8 result = 1 + ((w << 3) | reg);
+    
+    return result;
+}
+
+inline u8 get_segment_register_operand(u8 sr)
+{
+    u8 result = REGISTER_OPERAND_SEGMENT + (sr & 0b11);
+    
+    return result;
+}
+
+// Name of a 16-bit register used in an effective address.
+char * get_address_register_name(u8 type)
+{
+    char *result = "";
+    for (u32 reg = 0; reg < 8; ++reg) {
+        if (registers_definitions[reg][1].type == type) {
+            result = registers_definitions[reg][1].name;
+            break;
+        }
+    }
+    
+    return result;
+}
+
+struct State;
+struct Instruction;
+
+// Runs one decoded instruction. IP has already been moved past it.
+typedef void ExecuteHandler(State *state, Instruction *instruction);
+
+// Decoded instruction, packed in 16 bytes so four of them share a cache line. Operands
+// are small indices (the handler into execute_handlers, registers into register_operands)
+// and names are only looked up when printing.
 struct Instruction {
-    OperationType operation_type;
-    RegisterDefinition source_register;
-    RegisterDefinition dest_register;
-    u8 bytes_used;
+    u16 value;
+    s16 displacement;         // Offset of the memory operand
+    u8 handler;
     u8 binary;
-    u8 d;
-    u8 s;
-    u8 w;
-    u8 mod;
-    u8 reg;
-    u8 rm;
-    u8 sr;
+    u8 operation_type;        // OperationType
     u8 flags;
-    u16 value;
-    DisplacementAddress displacement_address;
+    u8 bytes_used;
+    u8 source_register;
+    u8 dest_register;
+    u8 address_registers;     // RegisterType of the base in the low 4 bits, of the index in the high 4 bits
     u8 clocks;
+    u8 ea_clocks;
+    u8 w : 1;
+    u8 d : 1;
+    u8 s : 1;
+    u8 mod : 2;
+    u8 reg : 3;
+    u8 rm : 3;
+    u8 segment : 2;           // SegmentRegister of the memory operand
+    u8 segment_override : 1;  // Set by a prefix instead of the default of the addressing mode
+};
+
+static_assert(sizeof(Instruction) == 16, "Instruction must stay packed in 16 bytes");
+
+// Decoded instructions, in fixed size chunks allocated from an arena as decoding goes.
+// The chunk table is sized from the code size up front (an instruction takes at least
+// one byte), so the store never reallocates and indexing is two loads.
+#define INSTRUCTION_CHUNK_SHIFT 12
+#define INSTRUCTION_CHUNK_SIZE (1 << INSTRUCTION_CHUNK_SHIFT)
+#define INSTRUCTION_CHUNK_MASK (INSTRUCTION_CHUNK_SIZE - 1)
+
+struct InstructionStore {
+    MemoryArena *arena;
+    Instruction **chunks;
+    u32 max_chunk_count;
+    u32 chunk_count;
+    u32 count;
+};
+
+inline void init_instruction_store(InstructionStore *store, MemoryArena *arena, u32 code_size)
+{
+    *store = {};
+    store->arena = arena;
+    store->max_chunk_count = (code_size >> INSTRUCTION_CHUNK_SHIFT) + 1;
+    store->chunks = push_array(arena, store->max_chunk_count, Instruction *);
+}
+
+// Returns 0 when the store is full, which only happens if it is fed more code than it was sized for.
+inline Instruction * push_instruction(InstructionStore *store)
+{
+    u32 chunk_index = store->count >> INSTRUCTION_CHUNK_SHIFT;
+    if (chunk_index >= store->chunk_count) {
+        if (chunk_index >= store->max_chunk_count) {
+            return 0;
+        }
+        
+        Instruction *chunk = push_array(store->arena, INSTRUCTION_CHUNK_SIZE, Instruction);
+        if (!chunk) {
+            return 0;
+        }
+        
+        store->chunks[store->chunk_count++] = chunk;
+    }
+    
+    Instruction *result = store->chunks[chunk_index] + (store->count & INSTRUCTION_CHUNK_MASK);
+    ++store->count;
+    
+    return result;
+}
+
+inline Instruction * get_instruction(InstructionStore *store, u32 index)
+{
+    assert(index < store->count);
+    
+    Instruction *result = store->chunks[index >> INSTRUCTION_CHUNK_SHIFT] + (index & INSTRUCTION_CHUNK_MASK);
+    
+    return result;
+}
+
+// Decoded instructions of the code segment, keyed by IP. Instructions are decoded from
+// simulated memory the first time execution reaches them, so a jump to any IP is one
+// lookup.
+#define SEGMENT_SIZE KILOBYTES(64)
+
+// Memory is the megabyte the 20 address lines reach, segment*16 + offset wraps around at its end.
+#define MEMORY_SIZE MEGABYTES(1)
+#define MEMORY_ADDRESS_MASK (MEMORY_SIZE - 1)
+
+// Memory is tracked in lines of this size to know which stores hit decoded code.
+#define CODE_LINE_SHIFT 6
+
+// Longest 8086 instruction: segment prefix, opcode, mod reg r/m, 16-bit displacement and
+// 16-bit data. A store can change instructions starting up to this many bytes before it.
+#define MAX_INSTRUCTION_SIZE 7
+
+#define MAX_BLOCK_INSTRUCTIONS 256
+#define MAX_BLOCK_COUNT KILOBYTES(64)
+
+// Straight run of instructions ending at a conditional jump or loop, compiled once into a
+// contiguous copy of its decoded instructions and executed as a unit.
+struct BasicBlock {
+    BasicBlock *next; // Live blocks, to find the ones hit by a store
+    u32 start_ip;
+    u32 end_ip; // Past the last instruction, can go past the end of the segment
+    u32 instruction_count;
+    u32 clocks;
+    Instruction *instructions;
+};
+
+// Batch runs (see sim8086_batch.cpp) stop after this many instructions unless told otherwise.
+#define BATCH_DEFAULT_MAX_INSTRUCTIONS 100000000ull
+
+struct DecodeCache {
+    u16 segment;
+    u32 *index; // Per IP: index in store + 1 of the instruction starting there, 0 if not decoded yet
+    InstructionStore store;
+    u32 decoded_end; // One past the last byte decoded since the last flush
+    
+    u8 *code_map; // One byte per memory line, set if decoded code lives in it
+    u32 code_map_size;
+    
+    BasicBlock **blocks; // Per IP: block entered there
+    BasicBlock *first_block;
+    u32 block_count; // Including the ones dropped by stores, which stay in the arena until the next flush
+    MemoryArena block_arena;
+    
+    bool code_rewritten; // Stores replaced decoded code since the last flush
+};
+
+// Simulated memory is tracked in pages of this size to know what stores wrote, so dumps
+// and clearing only touch those (see sim8086_memory.cpp).
+#define MEMORY_PAGE_SHIFT 12
+#define MEMORY_PAGE_SIZE (1 << MEMORY_PAGE_SHIFT)
+
+enum PageFlags {
+    Page_written  = 0x1, // Since the memory was cleared
+    Page_changed  = 0x2, // Since the last dump
+    Page_modified = 0x4, // Since the last snapshot taken or restored, see sim8086_snapshot.cpp
+};
+
+#define PAGE_ALL_FLAGS (Page_written | Page_changed | Page_modified)
+
+enum CpuModel {
+    Cpu_8086, // 16-bit bus: a word at an odd address takes two bus cycles
+    Cpu_8088, // 8-bit bus: every word takes two bus cycles
 };
 
 struct Register {
-    RegisterType type;
     u16 value;
 };
 
+// Number of registers in State::registers, one per RegisterType from Register_a to Register_ds
+#define REGISTER_FILE_COUNT 12
+
 struct State {
-    Register registers[12];
+    // The register file is packed words in RegisterType order, and the 8-bit registers
+    // are the bytes of their word (al at the offset of ax, ah one after). A register
+    // operand is then a byte offset into it, see register_operand_offsets.
+    union {
+        Register registers[REGISTER_FILE_COUNT];
+        u8 register_bytes[REGISTER_FILE_COUNT*2];
+    };
     Register ip_register;
     u32 memory_size;
     u8 *memory;
-    bool carry_flag;
-    bool parity_flag;
-    bool zero_flag;
-    bool sign_flag;
-    bool overflow_flag;
-    bool auxiliary_carry_flag;
+    
+    // Flags are evaluated lazily: arithmetic only records its operands and result, and
+    // the flags are worked out from them when a jump or the final dump reads them.
+    u32 flags_a;
+    u32 flags_b;
+    u32 flags_result; // Full result, so the carry is in the bit above the operand width. Packed flags for Flags_value.
+    u8 flags_operation;
+    u8 flags_bits;
+    
+    u64 clocks;
+    
+    // Extra clocks of a word memory transfer, indexed by the low bit of the address.
+    // Set from the CpuModel by set_cpu_model().
+    u8 word_transfer_clocks[2];
+    
+    // Stores that hit decoded code (see DecodeCache::code_map) are collected here and
+    // the affected blocks are dropped before the next instruction runs.
+    u8 *code_map;
+    bool code_written;
+    u32 code_written_low;
+    u32 code_written_high;
+    
+    // PageFlags per memory page, and the written pages in the order they were first written.
+    u8 *page_flags;
+    u32 *written_pages;
+    u32 written_page_count;
+    
+    // Pages modified since memory matched the snapshot with this id, 0 for none.
+    u32 *modified_pages;
+    u32 modified_page_count;
+    s64 snapshot_id;
 };
 
+inline void set_cpu_model(State *state, CpuModel cpu)
+{
+    // Every extra bus cycle costs 4 clocks
+    state->word_transfer_clocks[0] = (cpu == Cpu_8088) ? 4 : 0;
+    state->word_transfer_clocks[1] = 4;
+}
+
+// Grows the range of written code that gets invalidated before the next instruction.
+inline void note_code_write(State *state, u32 low, u32 high)
+{
+    if (!state->code_written) {
+        state->code_written = true;
+        state->code_written_low = low;
+        state->code_written_high = high;
+    } else {
+        if (low < state->code_written_low) {
+            state->code_written_low = low;
+        }
+        if (high > state->code_written_high) {
+            state->code_written_high = high;
+        }
+    }
+}
+
+inline u16 get_code_segment(State *state)
+{
+    u16 result = state->registers[Register_cs - 1].value;
+    
+    return result;
+}
+
 inline bool str_equals(char *a, char *b)
 {
     return strcmp(a, b) == 0;
@@ -236,15 +708,105 @@ inline RegisterDefinition get_segment_register_definition(u8 sr)
     return segment_register;
 }
 
-inline u8 count_one_bits(u8 n)
+inline void set_flags_value(State *state, u16 flags)
+{
+    state->flags_operation = Flags_value;
+    state->flags_result = flags;
+}
+
+inline bool get_carry_flag(State *state)
+{
+    bool result;
+    if (state->flags_operation == Flags_value) {
+        result = (state->flags_result & FLAG_CARRY) != 0;
+    } else {
+        result = (state->flags_result >> state->flags_bits) & 1;
+    }
+    
+    return result;
+}
+
+inline bool get_parity_flag(State *state)
+{
+    bool result;
+    if (state->flags_operation == Flags_value) {
+        result = (state->flags_result & FLAG_PARITY) != 0;
+    } else {
+        // Set when the low byte has an even number of one bits
+        u32 bits = state->flags_result & 0xFF;
+        bits ^= bits >> 4;
+        result = ((0x6996 >> (bits & 0xF)) & 1) == 0;
+    }
+    
+    return result;
+}
+
+inline bool get_auxiliary_carry_flag(State *state)
+{
+    bool result;
+    if (state->flags_operation == Flags_value) {
+        result = (state->flags_result & FLAG_AUXILIARY_CARRY) != 0;
+    } else {
+        result = ((state->flags_a ^ state->flags_b ^ state->flags_result) & 0x10) != 0;
+    }
+    
+    return result;
+}
+
+inline bool get_zero_flag(State *state)
+{
+    bool result;
+    if (state->flags_operation == Flags_value) {
+        result = (state->flags_result & FLAG_ZERO) != 0;
+    } else {
+        u32 mask = (1 << state->flags_bits) - 1;
+        result = (state->flags_result & mask) == 0;
+    }
+    
+    return result;
+}
+
+inline bool get_sign_flag(State *state)
+{
+    bool result;
+    if (state->flags_operation == Flags_value) {
+        result = (state->flags_result & FLAG_SIGN) != 0;
+    } else {
+        result = (state->flags_result >> (state->flags_bits - 1)) & 1;
+    }
+    
+    return result;
+}
+
+inline bool get_overflow_flag(State *state)
 {
-    u8 count = 0;
-    while (n) {
-        count += (n & 1);
-        n >>= 1;
+    u32 a = state->flags_a;
+    u32 b = state->flags_b;
+    u32 value = state->flags_result;
+    
+    bool result;
+    if (state->flags_operation == Flags_value) {
+        result = (value & FLAG_OVERFLOW) != 0;
+    } else if (state->flags_operation == Flags_add) {
+        result = (((a ^ value) & (b ^ value)) >> (state->flags_bits - 1)) & 1;
+    } else {
+        result = (((a ^ b) & (a ^ value)) >> (state->flags_bits - 1)) & 1;
     }
     
-    return count;
+    return result;
+}
+
+inline u16 get_flags(State *state)
+{
+    u16 result = 0;
+    if (get_carry_flag(state))           { result |= FLAG_CARRY; }
+    if (get_parity_flag(state))          { result |= FLAG_PARITY; }
+    if (get_auxiliary_carry_flag(state)) { result |= FLAG_AUXILIARY_CARRY; }
+    if (get_zero_flag(state))            { result |= FLAG_ZERO; }
+    if (get_sign_flag(state))            { result |= FLAG_SIGN; }
+    if (get_overflow_flag(state))        { result |= FLAG_OVERFLOW; }
+    
+    return result;
 }
 
 #endif //SIM8086_H
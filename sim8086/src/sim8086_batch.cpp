@@ -0,0 +1,471 @@
+//
+// Batch simulation: many independent runs on a pool of worker threads, either one run
+// per program of a manifest or one program run once per set of initial registers.
+//
+// Every worker owns a State with its memory and a decode cache, reused from run to run:
+// between runs only the memory pages the last run wrote are cleared, and the decoded
+// code is kept while the worker stays on the same program and nothing rewrote it.
+//
+
+// Most runs taken from the shared counter at a time. Consecutive runs usually share
+// the program, so a worker keeps hitting its decode cache.
+#define BATCH_MAX_RUNS_PER_GRAB 16
+
+enum RunStatus {
+    Run_done,        // IP went past the end of the code
+    Run_limit,       // Stopped at max_instructions
+    Run_decode_error,
+};
+
+char *run_status_names[] = { "done", "limit", "error" };
+
+struct BatchOptions {
+    u32 thread_count;
+    char *output_path;
+    u64 max_instructions;
+    CpuModel cpu;
+    Snapshot *snapshot; // Runs start from it instead of a fresh load of the program
+};
+
+struct BatchProgram {
+    char *path;
+    u8 *code;
+    u32 size;
+};
+
+struct BatchRun {
+    u32 program_index;
+    s32 seed_index; // -1 when the registers start at 0
+    u16 initial_registers[12];
+    u16 seeded_registers; // Bit per register of initial_registers the seed set
+    
+    u8 status;
+    u16 final_registers[13];
+    u16 flags;
+    u64 instructions;
+    u64 clocks;
+};
+
+struct Batch;
+
+struct BatchWorker {
+    Batch *batch;
+    u32 index;
+    ThreadHandle thread;
+    
+    State state;
+    MemoryArena arena;
+    DecodeCache cache;
+    s32 cached_program; // Program whose code is in the decode cache, -1 if none
+    
+    u64 runs;
+    u64 instructions;
+    double busy_seconds;
+};
+
+struct Batch {
+    BatchOptions *options;
+    
+    BatchProgram *programs;
+    u32 program_count;
+    
+    BatchRun *runs;
+    u32 run_count;
+    
+    s64 volatile next_run;
+    u32 runs_per_grab;
+};
+
+bool load_batch_program(BatchProgram *program, char *path)
+{
+    *program = {};
+    program->path = path;
+    
+    FILE *file = fopen(path, "rb");
+    if (!file) {
+        return false;
+    }
+    
+    fseek(file, 0, SEEK_END);
+    program->size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    
+    program->code = (u8 *)malloc(program->size ? program->size : 1);
+    fread(program->code, program->size, 1, file);
+    
+    fclose(file);
+    
+    return true;
+}
+
+// Copies s without the trailing newline and spaces.
+char * copy_trimmed_line(char *s)
+{
+    size_t length = strlen(s);
+    while (length && (s[length - 1] == '\n' || s[length - 1] == '\r' || s[length - 1] == ' ' || s[length - 1] == '\t')) {
+        --length;
+    }
+    
+    char *result = (char *)malloc(length + 1);
+    memcpy(result, s, length);
+    result[length] = 0;
+    
+    return result;
+}
+
+// Index of the register in State::registers, or -1 if the name is not a 16-bit register.
+s32 find_register_index(char *name)
+{
+    for (u32 reg = 0; reg < 8; ++reg) {
+        if (str_equals(registers_definitions[reg][1].name, name)) {
+            return registers_definitions[reg][1].type - 1;
+        }
+    }
+    for (u32 sr = 0; sr < 4; ++sr) {
+        if (str_equals(segment_registers[sr].name, name)) {
+            return segment_registers[sr].type - 1;
+        }
+    }
+    
+    return -1;
+}
+
+// Parses a line like "ax=0x10 cx=5" into the registers of run.
+bool parse_seed_line(char *line, BatchRun *run)
+{
+    char *token = strtok(line, " \t\r\n");
+    while (token) {
+        char *equals = strchr(token, '=');
+        if (!equals) {
+            return false;
+        }
+        
+        *equals = 0;
+        s32 index = find_register_index(token);
+        if (index < 0) {
+            return false;
+        }
+        
+        char *end;
+        unsigned long value = strtoul(equals + 1, &end, 0);
+        if (*end || value > 0xFFFF) {
+            return false;
+        }
+        
+        run->initial_registers[index] = (u16)value;
+        run->seeded_registers |= (1 << index);
+        
+        token = strtok(0, " \t\r\n");
+    }
+    
+    return true;
+}
+
+void run_batch_run(BatchWorker *worker, BatchRun *run)
+{
+    Batch *batch = worker->batch;
+    BatchProgram *program = batch->programs + run->program_index;
+    State *state = &worker->state;
+    DecodeCache *cache = &worker->cache;
+    
+    if (worker->cached_program != (s32)run->program_index || cache->code_rewritten) {
+        flush_decode_cache(cache, 0);
+        worker->cached_program = run->program_index;
+    }
+    
+    u32 code_end;
+    Snapshot *snapshot = batch->options->snapshot;
+    if (snapshot) {
+        // Only copies back the pages the last run from the snapshot modified
+        restore_snapshot(state, snapshot);
+        for (u32 i = 0; i < array_count(run->initial_registers); ++i) {
+            if (run->seeded_registers & (1 << i)) {
+                state->registers[i].value = run->initial_registers[i];
+            }
+        }
+        code_end = snapshot->header.code_end;
+    } else {
+        clear_written_memory(state);
+        reset_registers(state);
+        for (u32 i = 0; i < array_count(run->initial_registers); ++i) {
+            state->registers[i].value = run->initial_registers[i];
+        }
+        code_end = load_program(state, program->code, program->size);
+    }
+    
+    u64 executed = run_program(state, cache, code_end, batch->options->max_instructions);
+    
+    if (state->ip_register.value >= code_end) {
+        run->status = Run_done;
+    } else if (executed >= batch->options->max_instructions) {
+        run->status = Run_limit;
+    } else {
+        run->status = Run_decode_error;
+    }
+    
+    for (u32 i = 0; i < array_count(state->registers); ++i) {
+        run->final_registers[i] = state->registers[i].value;
+    }
+    run->final_registers[12] = state->ip_register.value;
+    run->flags = get_flags(state);
+    run->instructions = executed;
+    run->clocks = state->clocks;
+    
+    ++worker->runs;
+    worker->instructions += executed;
+}
+
+THREAD_PROC(batch_worker_proc)
+{
+    BatchWorker *worker = (BatchWorker *)parameter;
+    Batch *batch = worker->batch;
+    
+    for (;;) {
+        s64 first = atomic_fetch_add_s64(&batch->next_run, batch->runs_per_grab);
+        if (first >= batch->run_count) {
+            break;
+        }
+        
+        s64 end = first + batch->runs_per_grab;
+        if (end > batch->run_count) {
+            end = batch->run_count;
+        }
+        
+        double start = get_seconds();
+        for (s64 i = first; i < end; ++i) {
+            run_batch_run(worker, batch->runs + i);
+        }
+        worker->busy_seconds += get_seconds() - start;
+    }
+    
+    return 0;
+}
+
+int run_batch(Batch *batch)
+{
+    BatchOptions *options = batch->options;
+    
+    FILE *output = stdout;
+    if (options->output_path) {
+        output = fopen(options->output_path, "w");
+        if (!output) {
+            printf("ERROR: could not open output file %s\n", options->output_path);
+            return 1;
+        }
+    }
+    
+    u32 worker_count = options->thread_count ? options->thread_count : get_processor_count();
+    BatchWorker *workers = (BatchWorker *)calloc(worker_count, sizeof(BatchWorker));
+    for (u32 i = 0; i < worker_count; ++i) {
+        BatchWorker *worker = workers + i;
+        worker->batch = batch;
+        worker->index = i;
+        worker->cached_program = -1;
+        
+        set_cpu_model(&worker->state, options->cpu);
+        init_memory(&worker->state, MEMORY_SIZE);
+        init_decode_cache(&worker->cache, &worker->arena, worker->state.memory_size);
+    }
+    
+    // Small enough that every worker gets a few grabs
+    batch->runs_per_grab = batch->run_count / (worker_count*4);
+    if (batch->runs_per_grab > BATCH_MAX_RUNS_PER_GRAB) {
+        batch->runs_per_grab = BATCH_MAX_RUNS_PER_GRAB;
+    } else if (batch->runs_per_grab == 0) {
+        batch->runs_per_grab = 1;
+    }
+    
+    double start = get_seconds();
+    
+    // Worker 0 is this thread
+    for (u32 i = 1; i < worker_count; ++i) {
+        workers[i].thread = create_thread(batch_worker_proc, workers + i);
+    }
+    batch_worker_proc(workers);
+    for (u32 i = 1; i < worker_count; ++i) {
+        join_thread(workers[i].thread);
+    }
+    
+    double elapsed = get_seconds() - start;
+    
+    u32 status_counts[array_count(run_status_names)] = {};
+    u64 total_instructions = 0;
+    
+    fprintf(output, "# program\tseed\tstatus\tax bx cx dx sp bp si di es cs ss ds ip\tflags\tinstructions\tclocks\n");
+    for (u32 i = 0; i < batch->run_count; ++i) {
+        BatchRun *run = batch->runs + i;
+        
+        fprintf(output, "%s\t", batch->programs[run->program_index].path);
+        if (run->seed_index >= 0) {
+            fprintf(output, "%d\t", run->seed_index);
+        } else {
+            fprintf(output, "-\t");
+        }
+        fprintf(output, "%s\t", run_status_names[run->status]);
+        for (u32 reg = 0; reg < array_count(run->final_registers); ++reg) {
+            fprintf(output, (reg == 0) ? "%04x" : " %04x", run->final_registers[reg]);
+        }
+        fprintf(output, "\t%04x\t%llu\t%llu\n", run->flags, run->instructions, run->clocks);
+        
+        ++status_counts[run->status];
+        total_instructions += run->instructions;
+    }
+    
+    fprintf(output, "# Runs: %u (%u done, %u stopped at the instruction limit, %u decode errors)\n",
+            batch->run_count, status_counts[Run_done], status_counts[Run_limit], status_counts[Run_decode_error]);
+    fprintf(output, "# Time: %.3fs with %u threads, %llu instructions, %.2f million instructions/s\n",
+            elapsed, worker_count, total_instructions,
+            (elapsed > 0) ? ((double)total_instructions / elapsed) / 1000000.0 : 0);
+    for (u32 i = 0; i < worker_count; ++i) {
+        BatchWorker *worker = workers + i;
+        fprintf(output, "#   worker %u: %llu runs, %llu instructions in %.3fs, %.2f million instructions/s\n",
+                i, worker->runs, worker->instructions, worker->busy_seconds,
+                (worker->busy_seconds > 0) ? ((double)worker->instructions / worker->busy_seconds) / 1000000.0 : 0);
+    }
+    
+    if (output != stdout) {
+        fclose(output);
+    }
+    
+    for (u32 i = 0; i < worker_count; ++i) {
+        flush_blocks(&workers[i].cache);
+        free_arena(&workers[i].arena);
+        free_memory(&workers[i].state);
+    }
+    free(workers);
+    
+    return 0;
+}
+
+// One run per program listed in the manifest.
+int run_program_batch(char *manifest_path, BatchOptions *options)
+{
+    FILE *manifest = fopen(manifest_path, "r");
+    if (!manifest) {
+        printf("ERROR: could not read manifest %s\n", manifest_path);
+        return 1;
+    }
+    
+    u32 capacity = 64;
+    Batch batch = {};
+    batch.options = options;
+    batch.programs = (BatchProgram *)malloc(capacity*sizeof(BatchProgram));
+    
+    char line[1024];
+    while (fgets(line, sizeof(line), manifest)) {
+        char *path = copy_trimmed_line(line);
+        if (!path[0] || path[0] == '#') {
+            free(path);
+            continue;
+        }
+        
+        if (batch.program_count == capacity) {
+            capacity *= 2;
+            batch.programs = (BatchProgram *)realloc(batch.programs, capacity*sizeof(BatchProgram));
+        }
+        
+        if (!load_batch_program(batch.programs + batch.program_count, path)) {
+            printf("ERROR: could not read file %s\n", path);
+            return 1;
+        }
+        
+        ++batch.program_count;
+    }
+    
+    fclose(manifest);
+    
+    batch.run_count = batch.program_count;
+    batch.runs = (BatchRun *)calloc(batch.run_count ? batch.run_count : 1, sizeof(BatchRun));
+    for (u32 i = 0; i < batch.run_count; ++i) {
+        batch.runs[i].program_index = i;
+        batch.runs[i].seed_index = -1;
+    }
+    
+    int result = run_batch(&batch);
+    
+    for (u32 i = 0; i < batch.program_count; ++i) {
+        free(batch.programs[i].code);
+        free(batch.programs[i].path);
+    }
+    free(batch.programs);
+    free(batch.runs);
+    
+    return result;
+}
+
+// One run of the program per line of the seed file. When seeds is a number instead of
+// a file, that many runs start with pseudo-random general purpose registers.
+int run_seed_batch(char *program_path, char *seeds, BatchOptions *options)
+{
+    BatchProgram program;
+    if (!load_batch_program(&program, program_path)) {
+        printf("ERROR: could not read file %s\n", program_path);
+        return 1;
+    }
+    
+    Batch batch = {};
+    batch.options = options;
+    batch.programs = &program;
+    batch.program_count = 1;
+    
+    FILE *seed_file = fopen(seeds, "r");
+    if (seed_file) {
+        u32 capacity = 64;
+        batch.runs = (BatchRun *)malloc(capacity*sizeof(BatchRun));
+        
+        u32 line_number = 0;
+        char line[1024];
+        while (fgets(line, sizeof(line), seed_file)) {
+            ++line_number;
+            if (line[0] == '#') {
+                continue;
+            }
+            
+            if (batch.run_count == capacity) {
+                capacity *= 2;
+                batch.runs = (BatchRun *)realloc(batch.runs, capacity*sizeof(BatchRun));
+            }
+            
+            BatchRun *run = batch.runs + batch.run_count;
+            *run = {};
+            run->seed_index = batch.run_count;
+            if (!parse_seed_line(line, run)) {
+                printf("ERROR: %s:%u: expected register=value pairs\n", seeds, line_number);
+                return 1;
+            }
+            
+            ++batch.run_count;
+        }
+        
+        fclose(seed_file);
+    } else {
+        char *end;
+        batch.run_count = strtoul(seeds, &end, 10);
+        if (*end || !batch.run_count) {
+            printf("ERROR: could not read seed file %s\n", seeds);
+            return 1;
+        }
+        
+        batch.runs = (BatchRun *)calloc(batch.run_count, sizeof(BatchRun));
+        u32 random = 0x2545F491;
+        for (u32 i = 0; i < batch.run_count; ++i) {
+            BatchRun *run = batch.runs + i;
+            run->seed_index = i;
+            for (u32 reg = 0; reg < 8; ++reg) {
+                // xorshift32
+                random ^= random << 13;
+                random ^= random >> 17;
+                random ^= random << 5;
+                run->initial_registers[reg] = (u16)random;
+            }
+            run->seeded_registers = 0xFF;
+        }
+    }
+    
+    int result = run_batch(&batch);
+    
+    free(program.code);
+    free(batch.runs);
+    
+    return result;
+}
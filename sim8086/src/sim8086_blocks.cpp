@@ -0,0 +1,145 @@
+//
+// Basic block cache. Straight runs of instructions, ending at a conditional jump or
+// loop, are compiled once into a contiguous copy of their decoded instructions keyed
+// by entry IP. The run loop then dispatches a whole block without going back to the
+// decode cache, and adds the clocks of the block in one step.
+//
+// Stores that hit a memory line holding decoded code are noted by the handlers, and the
+// run loop leaves the block right after the instruction that did it. The blocks and
+// decoded instructions overlapping the written bytes are then dropped, so the next
+// instruction, even one of the same block, is decoded again from the new bytes.
+//
+
+void flush_blocks(DecodeCache *cache)
+{
+    if (cache->block_count) {
+        // Blocks only start where instructions were decoded
+        memset(cache->blocks, 0, cache->decoded_end*sizeof(BasicBlock *));
+        free_arena(&cache->block_arena);
+        cache->first_block = 0;
+        cache->block_count = 0;
+    }
+}
+
+BasicBlock * build_block(DecodeCache *cache, State *state, u16 entry_ip, u32 code_end)
+{
+    if (cache->block_count >= MAX_BLOCK_COUNT) {
+        // Self modifying code keeps dropping blocks, start over
+        flush_blocks(cache);
+    }
+    
+    // Collected here first: decoding can flush the caches, and with them a half built block
+    Instruction instructions[MAX_BLOCK_INSTRUCTIONS];
+    u32 count = 0;
+    u32 clocks = 0;
+    u32 ip = entry_ip;
+    while (count < MAX_BLOCK_INSTRUCTIONS && ip < code_end) {
+        Instruction *instruction = decode_at_ip(cache, state, (u16)ip);
+        if (!instruction) {
+            break;
+        }
+        
+        instructions[count++] = *instruction;
+        clocks += instruction->clocks + instruction->ea_clocks;
+        ip += instruction->bytes_used;
+        
+        // Loading CS moves the code somewhere else, the next instruction is not this one's neighbor
+        if (instruction->operation_type == Op_jmp || instruction->dest_register == REGISTER_OPERAND_SEGMENT + Segment_cs) {
+            break;
+        }
+    }
+    
+    if (!count) {
+        return 0;
+    }
+    
+    BasicBlock *block = push_struct(&cache->block_arena, BasicBlock);
+    block->start_ip = entry_ip;
+    block->end_ip = ip;
+    block->instruction_count = count;
+    block->clocks = clocks;
+    block->instructions = push_array(&cache->block_arena, count, Instruction);
+    memcpy(block->instructions, instructions, count*sizeof(Instruction));
+    
+    block->next = cache->first_block;
+    cache->first_block = block;
+    cache->blocks[entry_ip] = block;
+    ++cache->block_count;
+    
+    return block;
+}
+
+inline BasicBlock * get_block(DecodeCache *cache, State *state, u32 code_end)
+{
+    u16 ip = state->ip_register.value;
+    u16 code_segment = get_code_segment(state);
+    if (code_segment != cache->segment) {
+        flush_decode_cache(cache, code_segment);
+    }
+    
+    BasicBlock *block = cache->blocks[ip];
+    if (!block) {
+        block = build_block(cache, state, ip, code_end);
+    }
+    
+    return block;
+}
+
+// Drops every block and decoded instruction that overlaps IPs [first_ip, end_ip).
+void invalidate_code_ips(DecodeCache *cache, u32 first_ip, u32 end_ip)
+{
+    BasicBlock **link = &cache->first_block;
+    while (*link) {
+        BasicBlock *block = *link;
+        
+        // A block can run over the end of the segment into its start
+        bool overlaps = ((block->start_ip < end_ip && first_ip < block->end_ip) ||
+                         (block->start_ip < end_ip + SEGMENT_SIZE && first_ip + SEGMENT_SIZE < block->end_ip));
+        if (overlaps) {
+            if (cache->blocks[block->start_ip] == block) {
+                cache->blocks[block->start_ip] = 0;
+            }
+            
+            *link = block->next;
+        } else {
+            link = &block->next;
+        }
+    }
+    
+    // An instruction starting up to MAX_INSTRUCTION_SIZE - 1 bytes before the store can
+    // include it, IP wraps around
+    if (end_ip - first_ip >= SEGMENT_SIZE) {
+        memset(cache->index, 0, SEGMENT_SIZE*sizeof(u32));
+    } else {
+        for (u32 ip = first_ip + SEGMENT_SIZE - (MAX_INSTRUCTION_SIZE - 1); ip < end_ip + SEGMENT_SIZE; ++ip) {
+            cache->index[(u16)ip] = 0;
+        }
+    }
+}
+
+// Drops every block and decoded instruction that overlaps the bytes written since the last call.
+void invalidate_written_code(DecodeCache *cache, State *state)
+{
+    u32 low = state->code_written_low;
+    u32 high = state->code_written_high;
+    state->code_written = false;
+    cache->code_rewritten = true;
+    
+    // The code segment wraps around at the end of the megabyte, so the written bytes
+    // can be at its end, or at its start when it runs over into the start of memory
+    s64 segment_base = (s64)cache->segment << 4;
+    for (s64 base = segment_base; base >= segment_base - MEMORY_SIZE; base -= MEMORY_SIZE) {
+        s64 first_ip = (s64)low - base;
+        s64 end_ip = (s64)high - base;
+        if (first_ip < 0) {
+            first_ip = 0;
+        }
+        if (end_ip > SEGMENT_SIZE) {
+            end_ip = SEGMENT_SIZE;
+        }
+        
+        if (first_ip < end_ip) {
+            invalidate_code_ips(cache, (u32)first_ip, (u32)end_ip);
+        }
+    }
+}
@@ -0,0 +1,543 @@
+//
+// Static control flow graph of decoded code. Blocks start at the first instruction, at
+// every jump target and after every jump, and have up to two edges out: falling through
+// to the next block, and the jump being taken. On top of that come the dominators, and
+// the natural loops: a jump back to a block that dominates it closes a loop, whose body
+// is everything that reaches the jump without going through the header.
+//
+// Building the graph is a few passes over the instructions and the blocks, so a whole
+// code segment of 64 KB takes about a millisecond.
+//
+
+#define CFG_NO_BLOCK 0xFFFFFFFF
+
+// Marks per byte of code
+enum CfgMark {
+    Cfg_instruction = 0x1, // An instruction starts here
+    Cfg_leader      = 0x2, // A block starts here, if an instruction does
+};
+
+struct CfgBlock {
+    u32 start; // Offset in the code of the first instruction
+    u32 end;   // Offset past the last instruction
+    u32 first_instruction; // Index in the instruction store
+    u32 instruction_count;
+    
+    u32 fall_through; // Next block, if the code goes on after this one
+    u32 taken; // Target of the jump ending the block, if it has one in the code
+    
+    u32 order; // Position in reverse postorder, CFG_NO_BLOCK if unreachable from the entry
+    u32 dominator; // Immediate dominator, CFG_NO_BLOCK for the entry and unreachable blocks
+    u32 loop; // Innermost loop holding the block
+    u32 loop_depth;
+};
+
+struct CfgLoop {
+    u32 header;
+    u32 parent; // Loop this one is nested in, CFG_NO_BLOCK if none
+    u32 depth; // 1 for outermost loops
+    u32 back_edge_count;
+    u32 block_count;
+    u32 *blocks; // Header first, then the body in no particular order
+};
+
+struct Cfg {
+    u32 code_size;
+    u32 *instruction_offsets; // Per instruction of the store
+    
+    u32 block_count;
+    CfgBlock *blocks;
+    
+    // Predecessors of block b are predecessors[predecessor_start[b] .. predecessor_start[b + 1]]
+    u32 edge_count;
+    u32 *predecessor_start;
+    u32 *predecessors;
+    
+    u32 reachable_count;
+    u32 *reverse_postorder; // The reachable blocks
+    
+    u32 loop_count;
+    CfgLoop *loops; // Inner loops before the loops they are nested in
+    
+    u32 unaligned_targets; // Jumps into the middle of an instruction, left without an edge
+    u32 outside_targets;   // Jumps out of the code, left without an edge
+};
+
+inline Instruction * get_last_instruction(Cfg *cfg, InstructionStore *store, u32 block_index)
+{
+    CfgBlock *block = cfg->blocks + block_index;
+    
+    Instruction *result = get_instruction(store, block->first_instruction + block->instruction_count - 1);
+    
+    return result;
+}
+
+// Offset of the last instruction of the block, to show it like the profiler does.
+inline u32 get_last_offset(Cfg *cfg, u32 block_index)
+{
+    CfgBlock *block = cfg->blocks + block_index;
+    
+    u32 result = cfg->instruction_offsets[block->first_instruction + block->instruction_count - 1];
+    
+    return result;
+}
+
+inline s32 get_jump_target(u32 offset, Instruction *jump)
+{
+    s32 result = (s32)offset + jump->bytes_used + (s8)jump->value;
+    
+    return result;
+}
+
+inline bool dominates(Cfg *cfg, u32 dominator, u32 block_index)
+{
+    // Dominators come before the blocks they dominate in reverse postorder
+    u32 order = cfg->blocks[dominator].order;
+    while (block_index != CFG_NO_BLOCK && cfg->blocks[block_index].order > order) {
+        block_index = cfg->blocks[block_index].dominator;
+    }
+    
+    bool result = (block_index == dominator);
+    
+    return result;
+}
+
+void split_cfg_blocks(Cfg *cfg, InstructionStore *store, MemoryArena *arena, u8 *marks, u32 *block_at)
+{
+    u32 offset = 0;
+    for (u32 i = 0; i < store->count; ++i) {
+        Instruction *instruction = get_instruction(store, i);
+        cfg->instruction_offsets[i] = offset;
+        marks[offset] |= Cfg_instruction;
+        
+        u32 next = offset + instruction->bytes_used;
+        if (instruction->operation_type == Op_jmp) {
+            marks[next] |= Cfg_leader;
+            
+            s32 target = get_jump_target(offset, instruction);
+            if (target >= 0 && (u32)target < cfg->code_size) {
+                marks[target] |= Cfg_leader;
+            }
+        }
+        
+        offset = next;
+    }
+    
+    cfg->block_count = 0;
+    for (u32 i = 0; i < store->count; ++i) {
+        u32 offset = cfg->instruction_offsets[i];
+        if (i == 0 || (marks[offset] & Cfg_leader)) {
+            ++cfg->block_count;
+        }
+    }
+    
+    cfg->blocks = push_array(arena, cfg->block_count, CfgBlock);
+    
+    CfgBlock *block = 0;
+    for (u32 i = 0; i < store->count; ++i) {
+        u32 offset = cfg->instruction_offsets[i];
+        if (i == 0 || (marks[offset] & Cfg_leader)) {
+            block = block ? block + 1 : cfg->blocks;
+            *block = {};
+            block->start = offset;
+            block->first_instruction = i;
+            block->fall_through = CFG_NO_BLOCK;
+            block->taken = CFG_NO_BLOCK;
+            block->order = CFG_NO_BLOCK;
+            block->dominator = CFG_NO_BLOCK;
+            block->loop = CFG_NO_BLOCK;
+            
+            block_at[offset] = (u32)(block - cfg->blocks);
+        }
+        
+        ++block->instruction_count;
+        block->end = offset + get_instruction(store, i)->bytes_used;
+    }
+}
+
+void link_cfg_blocks(Cfg *cfg, InstructionStore *store, MemoryArena *arena, u8 *marks, u32 *block_at)
+{
+    // Every jump is conditional, so every block goes on to the next one
+    cfg->edge_count = 0;
+    for (u32 block_index = 0; block_index < cfg->block_count; ++block_index) {
+        CfgBlock *block = cfg->blocks + block_index;
+        if (block_index + 1 < cfg->block_count) {
+            block->fall_through = block_index + 1;
+            ++cfg->edge_count;
+        }
+        
+        Instruction *last = get_last_instruction(cfg, store, block_index);
+        if (last->operation_type == Op_jmp) {
+            s32 target = get_jump_target(get_last_offset(cfg, block_index), last);
+            if (target < 0 || (u32)target >= cfg->code_size) {
+                ++cfg->outside_targets;
+            } else if (!(marks[target] & Cfg_instruction)) {
+                ++cfg->unaligned_targets;
+            } else {
+                block->taken = block_at[target];
+                ++cfg->edge_count;
+            }
+        }
+    }
+    
+    // Predecessor lists, counted first and then filled in
+    cfg->predecessor_start = push_array(arena, cfg->block_count + 1, u32);
+    cfg->predecessors = push_array(arena, cfg->edge_count, u32);
+    memset(cfg->predecessor_start, 0, (cfg->block_count + 1)*sizeof(u32));
+    
+    for (u32 block_index = 0; block_index < cfg->block_count; ++block_index) {
+        CfgBlock *block = cfg->blocks + block_index;
+        if (block->fall_through != CFG_NO_BLOCK) { ++cfg->predecessor_start[block->fall_through + 1]; }
+        if (block->taken != CFG_NO_BLOCK)        { ++cfg->predecessor_start[block->taken + 1]; }
+    }
+    for (u32 block_index = 0; block_index < cfg->block_count; ++block_index) {
+        cfg->predecessor_start[block_index + 1] += cfg->predecessor_start[block_index];
+    }
+    
+    u32 *fill = push_array(arena, cfg->block_count, u32);
+    memcpy(fill, cfg->predecessor_start, cfg->block_count*sizeof(u32));
+    for (u32 block_index = 0; block_index < cfg->block_count; ++block_index) {
+        CfgBlock *block = cfg->blocks + block_index;
+        if (block->fall_through != CFG_NO_BLOCK) { cfg->predecessors[fill[block->fall_through]++] = block_index; }
+        if (block->taken != CFG_NO_BLOCK)        { cfg->predecessors[fill[block->taken]++] = block_index; }
+    }
+}
+
+void order_cfg_blocks(Cfg *cfg, MemoryArena *arena)
+{
+    // Depth first from the entry with an explicit stack, the blocks are numbered as they
+    // are finished and the numbers turned around.
+    u32 *stack = push_array(arena, cfg->block_count, u32);
+    u8 *next_edge = push_array(arena, cfg->block_count, u8);
+    u32 *postorder = push_array(arena, cfg->block_count, u32);
+    memset(next_edge, 0, cfg->block_count*sizeof(u8));
+    
+    u32 finished = 0;
+    u32 depth = 0;
+    stack[depth++] = 0;
+    cfg->blocks[0].order = 0; // Seen
+    while (depth) {
+        u32 block_index = stack[depth - 1];
+        CfgBlock *block = cfg->blocks + block_index;
+        
+        u32 successor = CFG_NO_BLOCK;
+        while (successor == CFG_NO_BLOCK && next_edge[block_index] < 2) {
+            u32 edge = next_edge[block_index]++;
+            u32 candidate = edge ? block->taken : block->fall_through;
+            if (candidate != CFG_NO_BLOCK && cfg->blocks[candidate].order == CFG_NO_BLOCK) {
+                successor = candidate;
+            }
+        }
+        
+        if (successor != CFG_NO_BLOCK) {
+            cfg->blocks[successor].order = 0;
+            stack[depth++] = successor;
+        } else {
+            postorder[finished++] = block_index;
+            --depth;
+        }
+    }
+    
+    cfg->reachable_count = finished;
+    cfg->reverse_postorder = push_array(arena, finished, u32);
+    for (u32 i = 0; i < finished; ++i) {
+        u32 block_index = postorder[finished - 1 - i];
+        cfg->reverse_postorder[i] = block_index;
+        cfg->blocks[block_index].order = i;
+    }
+}
+
+inline u32 intersect_dominators(Cfg *cfg, u32 a, u32 b)
+{
+    while (a != b) {
+        while (cfg->blocks[a].order > cfg->blocks[b].order) {
+            a = cfg->blocks[a].dominator;
+        }
+        while (cfg->blocks[b].order > cfg->blocks[a].order) {
+            b = cfg->blocks[b].dominator;
+        }
+    }
+    
+    return a;
+}
+
+// Cooper, Harvey and Kennedy, "A Simple, Fast Dominance Algorithm": the immediate
+// dominators are refined over the blocks in reverse postorder until nothing changes,
+// which for loops that are only entered through their header takes two passes.
+void find_dominators(Cfg *cfg)
+{
+    // The entry stands for its own dominator while the others are computed
+    cfg->blocks[0].dominator = 0;
+    
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (u32 i = 1; i < cfg->reachable_count; ++i) {
+            u32 block_index = cfg->reverse_postorder[i];
+            
+            u32 dominator = CFG_NO_BLOCK;
+            for (u32 p = cfg->predecessor_start[block_index]; p < cfg->predecessor_start[block_index + 1]; ++p) {
+                u32 predecessor = cfg->predecessors[p];
+                if (cfg->blocks[predecessor].dominator == CFG_NO_BLOCK) {
+                    // Not processed yet, or unreachable
+                    continue;
+                }
+                
+                if (dominator == CFG_NO_BLOCK) {
+                    dominator = predecessor;
+                } else {
+                    dominator = intersect_dominators(cfg, predecessor, dominator);
+                }
+            }
+            
+            if (cfg->blocks[block_index].dominator != dominator) {
+                cfg->blocks[block_index].dominator = dominator;
+                changed = true;
+            }
+        }
+    }
+    
+    cfg->blocks[0].dominator = CFG_NO_BLOCK;
+}
+
+void find_loops(Cfg *cfg, MemoryArena *arena)
+{
+    // At most one loop per header, all its back edges make one loop
+    u32 header_count = 0;
+    for (u32 i = 0; i < cfg->reachable_count; ++i) {
+        u32 header = cfg->reverse_postorder[i];
+        for (u32 p = cfg->predecessor_start[header]; p < cfg->predecessor_start[header + 1]; ++p) {
+            if (dominates(cfg, header, cfg->predecessors[p])) {
+                ++header_count;
+                break;
+            }
+        }
+    }
+    
+    cfg->loop_count = 0;
+    cfg->loops = push_array(arena, header_count, CfgLoop);
+    
+    u32 *body = push_array(arena, cfg->block_count, u32);
+    u32 *in_loop = push_array(arena, cfg->block_count, u32); // Loop + 1 the block was last added to
+    memset(in_loop, 0, cfg->block_count*sizeof(u32));
+    
+    // Headers of inner loops come after the headers of the loops holding them in reverse
+    // postorder, so going backwards every block is first claimed by its innermost loop.
+    for (u32 i = cfg->reachable_count; i-- > 0;) {
+        u32 header = cfg->reverse_postorder[i];
+        u32 loop_index = cfg->loop_count;
+        
+        // The body is found walking the edges backwards from the jumps closing the loop
+        u32 count = 0;
+        u32 back_edge_count = 0;
+        in_loop[header] = loop_index + 1;
+        body[count++] = header;
+        for (u32 p = cfg->predecessor_start[header]; p < cfg->predecessor_start[header + 1]; ++p) {
+            u32 latch = cfg->predecessors[p];
+            if (dominates(cfg, header, latch)) {
+                ++back_edge_count;
+                if (in_loop[latch] != loop_index + 1) {
+                    in_loop[latch] = loop_index + 1;
+                    body[count++] = latch;
+                }
+            }
+        }
+        
+        if (!back_edge_count) {
+            in_loop[header] = 0;
+            continue;
+        }
+        
+        for (u32 scan = 1; scan < count; ++scan) {
+            u32 block_index = body[scan];
+            for (u32 p = cfg->predecessor_start[block_index]; p < cfg->predecessor_start[block_index + 1]; ++p) {
+                u32 predecessor = cfg->predecessors[p];
+                if (in_loop[predecessor] != loop_index + 1 && cfg->blocks[predecessor].order != CFG_NO_BLOCK) {
+                    in_loop[predecessor] = loop_index + 1;
+                    body[count++] = predecessor;
+                }
+            }
+        }
+        
+        CfgLoop *loop = cfg->loops + cfg->loop_count++;
+        loop->header = header;
+        loop->parent = CFG_NO_BLOCK;
+        loop->back_edge_count = back_edge_count;
+        loop->block_count = count;
+        loop->blocks = push_array(arena, count, u32);
+        memcpy(loop->blocks, body, count*sizeof(u32));
+        
+        for (u32 scan = 0; scan < count; ++scan) {
+            CfgBlock *block = cfg->blocks + body[scan];
+            if (block->loop == CFG_NO_BLOCK) {
+                block->loop = loop_index;
+            } else {
+                // The outermost loop found so far around this block's loop is nested in this one
+                u32 inner = block->loop;
+                while (cfg->loops[inner].parent != CFG_NO_BLOCK) {
+                    inner = cfg->loops[inner].parent;
+                }
+                if (inner != loop_index) {
+                    cfg->loops[inner].parent = loop_index;
+                }
+            }
+        }
+    }
+    
+    // Parents are found after the loops nested in them
+    for (u32 loop_index = cfg->loop_count; loop_index-- > 0;) {
+        CfgLoop *loop = cfg->loops + loop_index;
+        loop->depth = (loop->parent == CFG_NO_BLOCK) ? 1 : cfg->loops[loop->parent].depth + 1;
+    }
+    
+    for (u32 block_index = 0; block_index < cfg->block_count; ++block_index) {
+        CfgBlock *block = cfg->blocks + block_index;
+        if (block->loop != CFG_NO_BLOCK) {
+            block->loop_depth = cfg->loops[block->loop].depth;
+        }
+    }
+}
+
+// Builds the graph of the decoded instructions in the store, allocating from the arena.
+// Returns false if there is nothing to build it from.
+bool build_cfg(Cfg *cfg, InstructionStore *store, u32 code_size, MemoryArena *arena)
+{
+    *cfg = {};
+    if (!store->count) {
+        return false;
+    }
+    
+    cfg->code_size = code_size;
+    cfg->instruction_offsets = push_array(arena, store->count, u32);
+    
+    // One past the end for the leader after a jump ending the code
+    u8 *marks = push_array(arena, code_size + 1, u8);
+    u32 *block_at = push_array(arena, code_size, u32);
+    memset(marks, 0, code_size + 1);
+    
+    split_cfg_blocks(cfg, store, arena, marks, block_at);
+    link_cfg_blocks(cfg, store, arena, marks, block_at);
+    order_cfg_blocks(cfg, arena);
+    find_dominators(cfg);
+    find_loops(cfg, arena);
+    
+    return true;
+}
+
+void print_cfg_block_ref(Cfg *cfg, u32 block_index)
+{
+    if (block_index == CFG_NO_BLOCK) {
+        printf("       -");
+    } else {
+        printf("  0x%04x", cfg->blocks[block_index].start);
+    }
+}
+
+void print_cfg(Cfg *cfg, double build_seconds)
+{
+    printf("Control flow graph: %u blocks, %u edges, %u loops, built in %.3f ms\n",
+           cfg->block_count, cfg->edge_count, cfg->loop_count, build_seconds*1000.0);
+    if (cfg->reachable_count < cfg->block_count) {
+        printf("    %u blocks unreachable from the entry\n", cfg->block_count - cfg->reachable_count);
+    }
+    if (cfg->outside_targets) {
+        printf("    %u jumps out of the code\n", cfg->outside_targets);
+    }
+    if (cfg->unaligned_targets) {
+        printf("    %u jumps into the middle of an instruction\n", cfg->unaligned_targets);
+    }
+    
+    printf("\nBlocks:\n");
+    printf("    ip             instructions  fall-through   taken  dominator  loop depth\n");
+    for (u32 block_index = 0; block_index < cfg->block_count; ++block_index) {
+        CfgBlock *block = cfg->blocks + block_index;
+        printf("    0x%04x-0x%04x  %12u      ", block->start, get_last_offset(cfg, block_index), block->instruction_count);
+        print_cfg_block_ref(cfg, block->fall_through);
+        print_cfg_block_ref(cfg, block->taken);
+        printf("   ");
+        print_cfg_block_ref(cfg, block->dominator);
+        printf("  %10u%s\n", block->loop_depth, (block->order == CFG_NO_BLOCK) ? "  unreachable" : "");
+    }
+    
+    printf("\nLoops:\n");
+    for (u32 loop_index = 0; loop_index < cfg->loop_count; ++loop_index) {
+        CfgLoop *loop = cfg->loops + loop_index;
+        printf("    header 0x%04x: %u blocks, depth %u, %u back edges", cfg->blocks[loop->header].start,
+               loop->block_count, loop->depth, loop->back_edge_count);
+        if (loop->parent != CFG_NO_BLOCK) {
+            printf(", inside the loop at 0x%04x", cfg->blocks[cfg->loops[loop->parent].header].start);
+        }
+        printf("\n");
+    }
+}
+
+// Graphviz DOT, one box per block with its disassembly. Taken jumps are green, jumps
+// closing a loop red, blocks in loops shaded deeper the more loops they are in.
+bool write_cfg_dot(Cfg *cfg, InstructionStore *store, char *path)
+{
+    FILE *file = fopen(path, "wb");
+    if (!file) {
+        return false;
+    }
+    
+    char text[KILOBYTES(16)];
+    TextBuffer buffer = {text, sizeof(text), 0};
+    
+    write_string(&buffer, "digraph cfg {\n");
+    write_string(&buffer, "    node [shape=box fontname=\"monospace\" style=filled fillcolor=white];\n");
+    for (u32 block_index = 0; block_index < cfg->block_count; ++block_index) {
+        CfgBlock *block = cfg->blocks + block_index;
+        
+        write_string(&buffer, "    b");
+        write_decimal(&buffer, block_index);
+        write_string(&buffer, " [");
+        if (block->order == CFG_NO_BLOCK) {
+            write_string(&buffer, "color=gray fontcolor=gray ");
+        } else if (block->loop_depth) {
+            char *shades[] = {"\"#fff0e0\"", "\"#ffe0c0\"", "\"#ffd0a0\""};
+            u32 shade = (block->loop_depth < 3) ? block->loop_depth - 1 : 2;
+            write_string(&buffer, "fillcolor=");
+            write_string(&buffer, shades[shade]);
+            write_char(&buffer, ' ');
+        }
+        write_string(&buffer, "label=\"");
+        write_hex(&buffer, block->start);
+        write_string(&buffer, ":\\l");
+        for (u32 i = 0; i < block->instruction_count; ++i) {
+            if (buffer.capacity - buffer.used < MAX_INSTRUCTION_TEXT + 64) {
+                flush_text(&buffer, file);
+            }
+            
+            // Instructions have no quotes or backslashes to escape
+            write_string(&buffer, "    ");
+            write_instruction(&buffer, *get_instruction(store, block->first_instruction + i));
+            write_string(&buffer, "\\l");
+        }
+        write_string(&buffer, "\"];\n");
+        
+        if (block->fall_through != CFG_NO_BLOCK) {
+            write_string(&buffer, "    b");
+            write_decimal(&buffer, block_index);
+            write_string(&buffer, " -> b");
+            write_decimal(&buffer, block->fall_through);
+            write_string(&buffer, ";\n");
+        }
+        if (block->taken != CFG_NO_BLOCK) {
+            bool back_edge = (block->order != CFG_NO_BLOCK) && dominates(cfg, block->taken, block_index);
+            write_string(&buffer, "    b");
+            write_decimal(&buffer, block_index);
+            write_string(&buffer, " -> b");
+            write_decimal(&buffer, block->taken);
+            write_string(&buffer, back_edge ? " [color=red];\n" : " [color=darkgreen];\n");
+        }
+        
+        flush_text(&buffer, file);
+    }
+    write_string(&buffer, "}\n");
+    flush_text(&buffer, file);
+    
+    bool result = !ferror(file);
+    fclose(file);
+    
+    return result;
+}
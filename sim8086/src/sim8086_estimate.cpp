@@ -0,0 +1,519 @@
+//
+// Static cost estimate, from the clocks the decoder worked out for every instruction
+// and the control flow graph, without running anything.
+//
+// A block costs its instructions with the jump ending it not taken, plus the extra of
+// the jump when it is taken. A loop iteration costs the most expensive way from the
+// header around to the jump back, with the loops nested in it counted whole. Where the
+// number of iterations can be told from the code, the loop costs that many iterations,
+// less the jump back not taken at the end: either cx is set to a constant before a
+// loop instruction, or one register set to a constant before the loop is stepped by an
+// immediate and compared right before the jump back, by the step itself or by a cmp
+// with an immediate or with a register the loop leaves alone. Constants are followed
+// through movs between registers. The step, compare and jump are then run on a scratch State to
+// count the iterations, so the flags and wrap around are exactly the simulator's.
+//
+// Memory operands are taken at even addresses: the 8086 only pays for word transfers
+// at odd ones, which the code does not say. The 8088 pays for every word transfer.
+//
+
+// Most iterations counted before giving up on a loop that would never end
+#define ESTIMATE_MAX_ITERATIONS 0x10000
+
+// Region of get_region_member() holding the whole program
+#define ESTIMATE_PROGRAM CFG_NO_BLOCK
+#define ESTIMATE_OUTSIDE (CFG_NO_BLOCK - 1)
+
+struct LoopEstimate {
+    u64 iteration_clocks; // Most expensive way around the loop once
+    u64 iterations; // 0 if they could not be told
+    bool at_most; // The loop can be left before the iterations run out
+    bool partial; // Some loop in it, or itself, has an unknown count and was taken as one iteration
+    u64 total_clocks; // Per entry into the loop
+    
+    u32 counter_register; // Register operand the iterations were told from
+    u32 counter_offset; // Offset of the instruction setting it
+    u32 limit_register; // Register operand it is compared with, 0 for an immediate
+    u32 limit_offset;
+};
+
+struct CostEstimate {
+    CpuModel cpu;
+    u32 *block_clocks; // Jump not taken
+    u32 *block_taken_clocks; // Extra when the jump ending the block is taken
+    LoopEstimate *loops;
+    u64 program_clocks; // Most expensive way through the program
+    bool program_partial;
+};
+
+// Word transfers of the memory operand, the ones charge_memory_transfers() pays for.
+u32 get_word_transfers(Instruction *instruction)
+{
+    if (!instruction->w || instruction->handler < HANDLER_OPERAND_FIRST || instruction->handler >= HANDLER_JUMP_FIRST) {
+        return 0;
+    }
+    
+    u32 index = (instruction->handler - HANDLER_OPERAND_FIRST) >> 1;
+    OperandForm form = (OperandForm)(index % OPERAND_FORM_COUNT);
+    bool reads_only = (instruction->operation_type == Op_mov || instruction->operation_type == Op_cmp);
+    
+    u32 result = 0;
+    switch (form)
+    {
+        case Operands_reg_mem: { result = 1; } break;
+        case Operands_mem_reg:
+        case Operands_mem_imm: { result = reads_only ? 1 : 2; } break;
+        default: break;
+    }
+    
+    return result;
+}
+
+inline u32 get_estimated_clocks(Instruction *instruction, CpuModel cpu)
+{
+    u32 transfer_clocks = (cpu == Cpu_8088) ? 4 : 0;
+    
+    u32 result = instruction->clocks + instruction->ea_clocks + get_word_transfers(instruction)*transfer_clocks;
+    
+    return result;
+}
+
+inline RegisterType get_operand_register_type(u8 operand)
+{
+    RegisterType result = register_operands[operand].type;
+    
+    return result;
+}
+
+// Stores to a register, whole or half.
+inline bool writes_register(Instruction *instruction, RegisterType type)
+{
+    bool result = (instruction->operation_type != Op_jmp && instruction->operation_type != Op_cmp &&
+                   instruction->dest_register && get_operand_register_type(instruction->dest_register) == type);
+    
+    return result;
+}
+
+// add, sub, cmp or mov of an immediate to a register.
+inline bool is_register_immediate(Instruction *instruction, OperationType operation_type)
+{
+    bool result = (instruction->operation_type == operation_type && instruction->dest_register &&
+                   (instruction->flags & HAS_DATA));
+    
+    return result;
+}
+
+// The loop directly inside region that holds the block, region itself if no deeper loop
+// does, or ESTIMATE_OUTSIDE if the block is not in region.
+u32 get_region_member(Cfg *cfg, u32 block_index, u32 region)
+{
+    if (cfg->blocks[block_index].order == CFG_NO_BLOCK) {
+        return ESTIMATE_OUTSIDE;
+    }
+    
+    u32 child = region;
+    u32 loop = cfg->blocks[block_index].loop;
+    while (loop != region) {
+        if (loop == CFG_NO_BLOCK) {
+            return ESTIMATE_OUTSIDE;
+        }
+        
+        child = loop;
+        loop = cfg->loops[loop].parent;
+    }
+    
+    return child;
+}
+
+// Writes to the register anywhere in the loop other than by the instruction allowed to.
+bool is_written_in_loop(Cfg *cfg, InstructionStore *store, CfgLoop *loop, u8 operand, Instruction *allowed)
+{
+    RegisterType type = get_operand_register_type(operand);
+    for (u32 i = 0; i < loop->block_count; ++i) {
+        CfgBlock *block = cfg->blocks + loop->blocks[i];
+        for (u32 j = 0; j < block->instruction_count; ++j) {
+            Instruction *instruction = get_instruction(store, block->first_instruction + j);
+            if (instruction != allowed && writes_register(instruction, type)) {
+                return true;
+            }
+        }
+    }
+    
+    return false;
+}
+
+// The one block outside the loop that jumps or falls into its header, CFG_NO_BLOCK if there
+// are more.
+u32 get_loop_entry(Cfg *cfg, u32 loop_index)
+{
+    u32 header = cfg->loops[loop_index].header;
+    
+    u32 result = CFG_NO_BLOCK;
+    for (u32 p = cfg->predecessor_start[header]; p < cfg->predecessor_start[header + 1]; ++p) {
+        u32 predecessor = cfg->predecessors[p];
+        if (cfg->blocks[predecessor].order != CFG_NO_BLOCK && get_region_member(cfg, predecessor, loop_index) == ESTIMATE_OUTSIDE) {
+            if (result != CFG_NO_BLOCK) {
+                return CFG_NO_BLOCK;
+            }
+            result = predecessor;
+        }
+    }
+    
+    return result;
+}
+
+// Value the register operand holds once the instructions before count in the block have
+// run, if the code sets it to a constant: directly, or by a mov from a register holding
+// one. Follows the blocks back as long as there is only one way they are reached, or
+// they are the header of a loop that leaves the register alone.
+bool find_register_constant(Cfg *cfg, InstructionStore *store, u32 block_index, u32 count, u8 operand,
+                            u16 *value, u32 *offset)
+{
+    RegisterType type = get_operand_register_type(operand);
+    for (u32 steps = 0; block_index != CFG_NO_BLOCK && steps < cfg->block_count; ++steps) {
+        CfgBlock *block = cfg->blocks + block_index;
+        for (u32 i = count; i-- > 0;) {
+            Instruction *instruction = get_instruction(store, block->first_instruction + i);
+            if (!writes_register(instruction, type)) {
+                continue;
+            }
+            
+            if (instruction->operation_type != Op_mov || instruction->dest_register != operand) {
+                return false;
+            }
+            
+            if (instruction->flags & HAS_DATA) {
+                *value = instruction->value;
+                *offset = cfg->instruction_offsets[block->first_instruction + i];
+                return true;
+            }
+            
+            if (!instruction->source_register) {
+                // Loaded from memory
+                return false;
+            }
+            
+            operand = instruction->source_register;
+            type = get_operand_register_type(operand);
+            count = i + 1;
+        }
+        
+        u32 first = cfg->predecessor_start[block_index];
+        u32 loop_index = block->loop;
+        if (cfg->predecessor_start[block_index + 1] - first == 1) {
+            block_index = cfg->predecessors[first];
+        } else if (loop_index != CFG_NO_BLOCK && cfg->loops[loop_index].header == block_index &&
+                   !is_written_in_loop(cfg, store, cfg->loops + loop_index, operand, 0)) {
+            block_index = get_loop_entry(cfg, loop_index);
+        } else {
+            block_index = CFG_NO_BLOCK;
+        }
+        
+        if (block_index != CFG_NO_BLOCK) {
+            count = cfg->blocks[block_index].instruction_count;
+        }
+    }
+    
+    return false;
+}
+
+// Works out how many times the jump at the end of latch goes back to the header.
+void count_iterations(Cfg *cfg, InstructionStore *store, u32 loop_index, u32 latch, LoopEstimate *estimate)
+{
+    CfgLoop *loop = cfg->loops + loop_index;
+    CfgBlock *latch_block = cfg->blocks + latch;
+    Instruction *jump = get_last_instruction(cfg, store, latch);
+    
+    // Whatever the count, other ways out of the loop can cut it short
+    for (u32 i = 0; i < loop->block_count; ++i) {
+        u32 block_index = loop->blocks[i];
+        CfgBlock *block = cfg->blocks + block_index;
+        bool ends_in_jump = (get_last_instruction(cfg, store, block_index)->operation_type == Op_jmp);
+        u32 successors[2] = {block->fall_through, block->taken};
+        for (u32 s = 0; s < 2 && block_index != latch; ++s) {
+            if (successors[s] == CFG_NO_BLOCK ? (s == 0 || ends_in_jump) :
+                get_region_member(cfg, successors[s], loop_index) == ESTIMATE_OUTSIDE) {
+                estimate->at_most = true;
+            }
+        }
+    }
+    
+    // The loop is entered from one block, where the registers deciding the count get set
+    u32 entry = get_loop_entry(cfg, loop_index);
+    if (entry == CFG_NO_BLOCK) {
+        return;
+    }
+    u32 entry_count = cfg->blocks[entry].instruction_count;
+    
+    if (jump->binary == OPCODE_LOOP || jump->binary == OPCODE_LOOPZ || jump->binary == OPCODE_LOOPNZ) {
+        // The loop instruction steps cx and compares it, loopz and loopnz also look at the flags
+        u8 cx = get_register_operand(1, 0b001);
+        u16 value;
+        if (!is_written_in_loop(cfg, store, loop, cx, 0) &&
+            find_register_constant(cfg, store, entry, entry_count, cx, &value, &estimate->counter_offset)) {
+            estimate->counter_register = cx;
+            estimate->iterations = value ? value : 0x10000;
+            estimate->at_most |= (jump->binary != OPCODE_LOOP);
+        }
+        return;
+    }
+    
+    if (jump->binary == OPCODE_JCXZ) {
+        return;
+    }
+    
+    // The flags for the jump come from the last instruction before it that sets them
+    Instruction *compare = 0;
+    for (u32 i = latch_block->instruction_count - 1; i-- > 0;) {
+        Instruction *instruction = get_instruction(store, latch_block->first_instruction + i);
+        if (instruction->operation_type != Op_mov) {
+            compare = instruction;
+            break;
+        }
+    }
+    if (!compare || !compare->dest_register) {
+        return;
+    }
+    
+    // add or sub of an immediate steps the counter, or cmp compares it with an immediate
+    // or a register the loop does not change
+    u8 counter = compare->dest_register;
+    u8 limit = 0;
+    Instruction *step = 0;
+    if (is_register_immediate(compare, Op_add) || is_register_immediate(compare, Op_sub)) {
+        step = compare;
+    } else if (compare->operation_type == Op_cmp) {
+        limit = compare->source_register;
+        if (!(compare->flags & HAS_DATA) && !limit) {
+            return;
+        }
+        
+        // The one step has to run every iteration, and only once
+        for (u32 i = 0; i < loop->block_count && !step; ++i) {
+            u32 block_index = loop->blocks[i];
+            CfgBlock *block = cfg->blocks + block_index;
+            if (block->loop != loop_index || !dominates(cfg, block_index, latch)) {
+                continue;
+            }
+            
+            for (u32 j = 0; j < block->instruction_count; ++j) {
+                Instruction *instruction = get_instruction(store, block->first_instruction + j);
+                if (instruction->dest_register == counter &&
+                    (is_register_immediate(instruction, Op_add) || is_register_immediate(instruction, Op_sub))) {
+                    step = instruction;
+                    break;
+                }
+            }
+        }
+    }
+    if (!step || is_written_in_loop(cfg, store, loop, counter, step) || (limit && is_written_in_loop(cfg, store, loop, limit, 0))) {
+        return;
+    }
+    
+    u16 start;
+    u16 limit_value = 0;
+    if (!find_register_constant(cfg, store, entry, entry_count, counter, &start, &estimate->counter_offset) ||
+        (limit && !find_register_constant(cfg, store, entry, entry_count, limit, &limit_value, &estimate->limit_offset))) {
+        return;
+    }
+    estimate->counter_register = counter;
+    estimate->limit_register = limit;
+    
+    State scratch = {};
+    if (compare->w) {
+        *get_register16(&scratch, counter) = start;
+    } else {
+        *get_register8(&scratch, counter) = (u8)start;
+    }
+    if (limit) {
+        // Set after the counter, they can be halves of the same register
+        if (compare->w) {
+            *get_register16(&scratch, limit) = limit_value;
+        } else {
+            *get_register8(&scratch, limit) = (u8)limit_value;
+        }
+    }
+    
+    for (u64 iterations = 1; iterations <= ESTIMATE_MAX_ITERATIONS; ++iterations) {
+        if (step != compare) {
+            execute_handlers[step->handler](&scratch, step);
+        }
+        execute_handlers[compare->handler](&scratch, compare);
+        
+        scratch.ip_register.value = 0;
+        execute_handlers[jump->handler](&scratch, jump);
+        bool taken = (scratch.ip_register.value != 0);
+        if (!taken) {
+            estimate->iterations = iterations;
+            return;
+        }
+    }
+}
+
+// Most expensive way through the blocks of the region: from the header of a loop around
+// to the jump back, or from the entry of the program to its end. Loops nested in the
+// region count whole, as their total per entry.
+void estimate_region(Cfg *cfg, CostEstimate *estimate, u32 region, s64 *distance, u64 *way_out, bool *partial)
+{
+    u32 region_header = (region == ESTIMATE_PROGRAM) ? 0 : cfg->loops[region].header;
+    
+    u64 best_around = 0;
+    u64 best_out = 0;
+    *partial = false;
+    
+    // Blocks come after all the blocks that lead to them in reverse postorder, but for the
+    // jumps back of loops
+    for (u32 i = 0; i < cfg->reachable_count; ++i) {
+        distance[cfg->reverse_postorder[i]] = -1;
+    }
+    distance[region_header] = 0;
+    
+    for (u32 i = cfg->blocks[region_header].order; i < cfg->reachable_count; ++i) {
+        u32 block_index = cfg->reverse_postorder[i];
+        u32 member = get_region_member(cfg, block_index, region);
+        if (member == ESTIMATE_OUTSIDE || distance[block_index] < 0) {
+            continue;
+        }
+        
+        // Edges out of the block or of the nested loop, with what it took to take them
+        u32 from_count = 1;
+        u32 *from = &block_index;
+        u64 cost = estimate->block_clocks[block_index];
+        if (member != region) {
+            CfgLoop *inner = cfg->loops + member;
+            if (inner->header != block_index) {
+                continue;
+            }
+            
+            from_count = inner->block_count;
+            from = inner->blocks;
+            cost = estimate->loops[member].total_clocks;
+            *partial |= estimate->loops[member].partial;
+        }
+        
+        for (u32 f = 0; f < from_count; ++f) {
+            CfgBlock *block = cfg->blocks + from[f];
+            u32 successors[2] = {block->fall_through, block->taken};
+            u64 costs[2] = {cost, cost + estimate->block_taken_clocks[from[f]]};
+            bool is_jump = (estimate->block_taken_clocks[from[f]] != 0);
+            for (u32 s = 0; s < 2; ++s) {
+                u32 successor = successors[s];
+                u64 reached = distance[block_index] + costs[s];
+                if (successor != CFG_NO_BLOCK && member != region && get_region_member(cfg, successor, member) != ESTIMATE_OUTSIDE) {
+                    // Inside the nested loop, already counted
+                    continue;
+                }
+                
+                if (successor == CFG_NO_BLOCK) {
+                    // Off the end of the code, or a jump out of it
+                    if (s == 0 || is_jump) {
+                        if (reached > best_out) { best_out = reached; }
+                    }
+                } else if (region != ESTIMATE_PROGRAM && successor == region_header) {
+                    if (reached > best_around) { best_around = reached; }
+                } else if (get_region_member(cfg, successor, region) == ESTIMATE_OUTSIDE) {
+                    if (reached > best_out) { best_out = reached; }
+                } else if ((s64)reached > distance[successor]) {
+                    distance[successor] = reached;
+                }
+            }
+        }
+    }
+    
+    *way_out = (region == ESTIMATE_PROGRAM) ? best_out : best_around;
+}
+
+// Allocates the estimate from the arena. Loops are estimated inner first, the order
+// build_cfg() lists them in.
+void estimate_costs(Cfg *cfg, InstructionStore *store, CpuModel cpu, CostEstimate *estimate, MemoryArena *arena)
+{
+    *estimate = {};
+    estimate->cpu = cpu;
+    estimate->block_clocks = push_array(arena, cfg->block_count, u32);
+    estimate->block_taken_clocks = push_array(arena, cfg->block_count, u32);
+    estimate->loops = push_array(arena, cfg->loop_count, LoopEstimate);
+    s64 *distance = push_array(arena, cfg->block_count, s64);
+    
+    for (u32 block_index = 0; block_index < cfg->block_count; ++block_index) {
+        CfgBlock *block = cfg->blocks + block_index;
+        u32 clocks = 0;
+        for (u32 i = 0; i < block->instruction_count; ++i) {
+            clocks += get_estimated_clocks(get_instruction(store, block->first_instruction + i), cpu);
+        }
+        
+        Instruction *last = get_last_instruction(cfg, store, block_index);
+        estimate->block_clocks[block_index] = clocks;
+        estimate->block_taken_clocks[block_index] = (last->operation_type == Op_jmp) ? get_jump_taken_clocks(last->binary) : 0;
+    }
+    
+    for (u32 loop_index = 0; loop_index < cfg->loop_count; ++loop_index) {
+        CfgLoop *loop = cfg->loops + loop_index;
+        LoopEstimate *loop_estimate = estimate->loops + loop_index;
+        *loop_estimate = {};
+        
+        estimate_region(cfg, estimate, loop_index, distance, &loop_estimate->iteration_clocks, &loop_estimate->partial);
+        
+        // Counted from the jump back of a loop with only one
+        u32 latch = CFG_NO_BLOCK;
+        if (loop->back_edge_count == 1) {
+            for (u32 p = cfg->predecessor_start[loop->header]; p < cfg->predecessor_start[loop->header + 1]; ++p) {
+                u32 predecessor = cfg->predecessors[p];
+                if (cfg->blocks[predecessor].taken == loop->header && dominates(cfg, loop->header, predecessor)) {
+                    latch = predecessor;
+                }
+            }
+        }
+        if (latch != CFG_NO_BLOCK) {
+            count_iterations(cfg, store, loop_index, latch, loop_estimate);
+        }
+        
+        if (loop_estimate->iterations) {
+            loop_estimate->total_clocks = loop_estimate->iterations*loop_estimate->iteration_clocks - estimate->block_taken_clocks[latch];
+        } else {
+            loop_estimate->total_clocks = loop_estimate->iteration_clocks;
+            loop_estimate->partial = true;
+        }
+    }
+    
+    estimate_region(cfg, estimate, ESTIMATE_PROGRAM, distance, &estimate->program_clocks, &estimate->program_partial);
+}
+
+void print_cost_estimate(Cfg *cfg, CostEstimate *estimate)
+{
+    printf("Static estimate for the %s%s:\n", (estimate->cpu == Cpu_8088) ? "8088" : "8086",
+           (estimate->cpu == Cpu_8088) ? "" : ", word transfers at even addresses");
+    
+    printf("\nBlocks:\n");
+    printf("    ip             clocks   taken\n");
+    for (u32 block_index = 0; block_index < cfg->block_count; ++block_index) {
+        CfgBlock *block = cfg->blocks + block_index;
+        printf("    0x%04x-0x%04x  %6u", block->start, get_last_offset(cfg, block_index), estimate->block_clocks[block_index]);
+        if (estimate->block_taken_clocks[block_index]) {
+            printf("  %6u", estimate->block_clocks[block_index] + estimate->block_taken_clocks[block_index]);
+        }
+        printf("\n");
+    }
+    
+    // A ? marks estimates taking a loop whose count is unknown as one iteration
+    printf("\nLoops:\n");
+    for (u32 loop_index = 0; loop_index < cfg->loop_count; ++loop_index) {
+        CfgLoop *loop = cfg->loops + loop_index;
+        LoopEstimate *loop_estimate = estimate->loops + loop_index;
+        printf("    header 0x%04x: %llu%s clocks per iteration", cfg->blocks[loop->header].start, loop_estimate->iteration_clocks,
+               (loop_estimate->partial && loop_estimate->iterations) ? "?" : "");
+        if (loop_estimate->iterations) {
+            printf(", %s%llu iterations (%s set at 0x%04x", loop_estimate->at_most ? "at most " : "", loop_estimate->iterations,
+                   register_operands[loop_estimate->counter_register].name, loop_estimate->counter_offset);
+            if (loop_estimate->limit_register) {
+                printf(", %s at 0x%04x", register_operands[loop_estimate->limit_register].name, loop_estimate->limit_offset);
+            }
+            printf("), %llu%s clocks per entry", loop_estimate->total_clocks, loop_estimate->partial ? "?" : "");
+        } else {
+            printf(", iterations unknown");
+        }
+        printf("\n");
+    }
+    
+    printf("\nProgram: %llu%s clocks on the most expensive way through\n", estimate->program_clocks,
+           estimate->program_partial ? "?" : "");
+}
@@ -0,0 +1,443 @@
+//
+// Execution engine. At decode time every instruction gets a handler specialized for
+// its concrete form (operation, operand kinds and width), so running an instruction
+// is one indirect call with no tests on the operand encoding.
+//
+// MSVC has neither computed goto nor guaranteed tail calls, so dispatch is call
+// threaded: the run loop looks the handler up by the index stored in the instruction
+// and calls it.
+//
+
+enum OperandForm {
+    Operands_none,
+    
+    Operands_reg_reg,
+    Operands_reg_mem,
+    Operands_mem_reg,
+    Operands_reg_imm,
+    Operands_mem_imm,
+};
+
+inline u16 * get_register16(State *state, u8 operand)
+{
+    u16 *result = (u16 *)(state->register_bytes + register_operand_offsets[operand]);
+    
+    return result;
+}
+
+inline u8 * get_register8(State *state, u8 operand)
+{
+    u8 *result = state->register_bytes + register_operand_offsets[operand];
+    
+    return result;
+}
+
+template<typename T> inline T * get_register(State *state, u8 operand);
+template<> inline u16 * get_register<u16>(State *state, u8 operand) { return get_register16(state, operand); }
+template<> inline u8 * get_register<u8>(State *state, u8 operand) { return get_register8(state, operand); }
+
+inline u16 get_effective_offset(State *state, Instruction *instruction)
+{
+    u8 first_register = instruction->address_registers & 0xF;
+    u8 second_register = instruction->address_registers >> 4;
+    
+    // Offsets wrap around at 64KB like on the hardware
+    u16 result = (u16)instruction->displacement;
+    if (first_register) {
+        result += state->registers[first_register - 1].value;
+    }
+    if (second_register) {
+        result += state->registers[second_register - 1].value;
+    }
+    
+    return result;
+}
+
+inline u32 get_segment_base(State *state, Instruction *instruction)
+{
+    u32 result = (u32)state->registers[Register_es - 1 + instruction->segment].value << 4;
+    
+    return result;
+}
+
+// segment*16 + offset, wrapped around at the end of the megabyte. The segment was
+// picked at decode time, so this is one add and a mask.
+inline u32 get_linear_address(State *state, Instruction *instruction, u16 offset)
+{
+    u32 result = (get_segment_base(state, instruction) + offset) & MEMORY_ADDRESS_MASK;
+    
+    return result;
+}
+
+// A word at offset 0xFFFF has its high byte at offset 0 of the segment, and a word at
+// the last byte of the megabyte has it at address 0: it is not the next byte in memory.
+template<typename T> inline bool is_split_word(u16 offset, u32 linear)
+{
+    bool result = (sizeof(T) == 2 && (offset == 0xFFFF || linear == MEMORY_ADDRESS_MASK));
+    
+    return result;
+}
+
+inline void get_split_word_bytes(State *state, Instruction *instruction, u16 offset, u8 **low, u8 **high)
+{
+    u32 segment_base = get_segment_base(state, instruction);
+    *low = state->memory + ((segment_base + offset) & MEMORY_ADDRESS_MASK);
+    *high = state->memory + ((segment_base + (u16)(offset + 1)) & MEMORY_ADDRESS_MASK);
+}
+
+// Notes stores into memory lines that hold decoded code, see sim8086_blocks.cpp.
+template<typename T> inline void check_code_write(State *state, T *address)
+{
+    u32 linear = (u32)((u8 *)address - state->memory);
+    if (state->code_map[linear >> CODE_LINE_SHIFT] | state->code_map[(linear + sizeof(T) - 1) >> CODE_LINE_SHIFT]) {
+        note_code_write(state, linear, linear + sizeof(T));
+    }
+}
+
+// Marks the pages a store wrote, see sim8086_memory.cpp.
+template<typename T> inline void mark_store(State *state, T *address)
+{
+    u32 linear = (u32)((u8 *)address - state->memory);
+    u32 first_page = linear >> MEMORY_PAGE_SHIFT;
+    u32 last_page = (linear + sizeof(T) - 1) >> MEMORY_PAGE_SHIFT;
+    mark_page_written(state, first_page);
+    if (last_page != first_page) {
+        mark_page_written(state, last_page);
+    }
+}
+
+// Word transfers cost extra bus cycles on odd addresses, or always on the 8088 (see
+// set_cpu_model). Arithmetic on a memory operand reads and writes it: two transfers.
+template<OperationType Op, typename T> inline void charge_memory_transfers(State *state, u8 *address, bool is_dest)
+{
+    if (sizeof(T) == 2) {
+        u32 transfers = (is_dest && Op != Op_mov && Op != Op_cmp) ? 2 : 1;
+        u32 linear = (u32)(address - state->memory);
+        state->clocks += transfers*state->word_transfer_clocks[linear & 1];
+    }
+}
+
+template<typename T> inline void record_flags(State *state, FlagsOperation operation, u32 a, u32 b, u32 result)
+{
+    state->flags_a = a;
+    state->flags_b = b;
+    state->flags_result = result;
+    state->flags_operation = (u8)operation;
+    state->flags_bits = sizeof(T)*8;
+}
+
+template<OperationType Op, typename T> inline void execute_operation(State *state, T *dest, T source)
+{
+    switch (Op)
+    {
+        case Op_mov: {
+            *dest = source;
+        } break;
+        
+        case Op_add: {
+            u32 a = *dest;
+            u32 result = a + source;
+            record_flags<T>(state, Flags_add, a, source, result);
+            *dest = (T)result;
+        } break;
+        
+        case Op_sub:
+        case Op_cmp: {
+            u32 a = *dest;
+            u32 result = a - source;
+            record_flags<T>(state, Flags_sub, a, source, result);
+            if (Op == Op_sub) {
+                *dest = (T)result;
+            }
+        } break;
+    }
+}
+
+template<OperationType Op, typename T> void execute_reg_reg(State *state, Instruction *instruction)
+{
+    T *dest = get_register<T>(state, instruction->dest_register);
+    T source = *get_register<T>(state, instruction->source_register);
+    execute_operation<Op, T>(state, dest, source);
+}
+
+// Word operation with a split word in memory as the destination, see is_split_word().
+template<OperationType Op> void execute_to_split_word(State *state, Instruction *instruction, u16 offset, u16 source)
+{
+    u8 *low;
+    u8 *high;
+    get_split_word_bytes(state, instruction, offset, &low, &high);
+    
+    u16 dest = (u16)(*low | (*high << 8));
+    execute_operation<Op, u16>(state, &dest, source);
+    charge_memory_transfers<Op, u16>(state, low, true);
+    if (Op != Op_cmp) {
+        *low = (u8)dest;
+        *high = (u8)(dest >> 8);
+        mark_store(state, low);
+        mark_store(state, high);
+        check_code_write(state, low);
+        check_code_write(state, high);
+    }
+}
+
+template<OperationType Op, typename T> inline void execute_to_memory(State *state, Instruction *instruction, T source)
+{
+    u16 offset = get_effective_offset(state, instruction);
+    u32 linear = get_linear_address(state, instruction, offset);
+    if (is_split_word<T>(offset, linear)) {
+        execute_to_split_word<Op>(state, instruction, offset, source);
+        return;
+    }
+    
+    T *dest = (T *)(state->memory + linear);
+    execute_operation<Op, T>(state, dest, source);
+    charge_memory_transfers<Op, T>(state, (u8 *)dest, true);
+    if (Op != Op_cmp) {
+        mark_store(state, dest);
+        check_code_write(state, dest);
+    }
+}
+
+template<OperationType Op, typename T> void execute_reg_mem(State *state, Instruction *instruction)
+{
+    T *dest = get_register<T>(state, instruction->dest_register);
+    u16 offset = get_effective_offset(state, instruction);
+    u32 linear = get_linear_address(state, instruction, offset);
+    u8 *address = state->memory + linear;
+    
+    T source;
+    if (is_split_word<T>(offset, linear)) {
+        u8 *low;
+        u8 *high;
+        get_split_word_bytes(state, instruction, offset, &low, &high);
+        source = (T)(*low | (*high << 8));
+    } else {
+        source = *(T *)address;
+    }
+    
+    execute_operation<Op, T>(state, dest, source);
+    charge_memory_transfers<Op, T>(state, address, false);
+}
+
+template<OperationType Op, typename T> void execute_mem_reg(State *state, Instruction *instruction)
+{
+    T source = *get_register<T>(state, instruction->source_register);
+    execute_to_memory<Op, T>(state, instruction, source);
+}
+
+template<OperationType Op, typename T> void execute_reg_imm(State *state, Instruction *instruction)
+{
+    T *dest = get_register<T>(state, instruction->dest_register);
+    execute_operation<Op, T>(state, dest, (T)instruction->value);
+}
+
+template<OperationType Op, typename T> void execute_mem_imm(State *state, Instruction *instruction)
+{
+    execute_to_memory<Op, T>(state, instruction, (T)instruction->value);
+}
+
+template<u8 Opcode> inline bool get_jump_condition(State *state)
+{
+    u16 *cx = &state->registers[2].value;
+    
+    bool result = false;
+    switch (Opcode)
+    {
+        case OPCODE_JE:     { result = get_zero_flag(state); } break;
+        case OPCODE_JL:     { result = (get_sign_flag(state) != get_overflow_flag(state)); } break;
+        case OPCODE_JLE:    { result = get_zero_flag(state) || (get_sign_flag(state) != get_overflow_flag(state)); } break;
+        case OPCODE_JB:     { result = get_carry_flag(state); } break;
+        case OPCODE_JBE:    { result = get_carry_flag(state) || get_zero_flag(state); } break;
+        case OPCODE_JP:     { result = get_parity_flag(state); } break;
+        case OPCODE_JO:     { result = get_overflow_flag(state); } break;
+        case OPCODE_JS:     { result = get_sign_flag(state); } break;
+        case OPCODE_JNE:    { result = !get_zero_flag(state); } break;
+        case OPCODE_JNL:    { result = (get_sign_flag(state) == get_overflow_flag(state)); } break;
+        case OPCODE_JNLE:   { result = !get_zero_flag(state) && (get_sign_flag(state) == get_overflow_flag(state)); } break;
+        case OPCODE_JNB:    { result = !get_carry_flag(state); } break;
+        case OPCODE_JNBE:   { result = !get_carry_flag(state) && !get_zero_flag(state); } break;
+        case OPCODE_JNP:    { result = !get_parity_flag(state); } break;
+        case OPCODE_JNO:    { result = !get_overflow_flag(state); } break;
+        case OPCODE_JNS:    { result = !get_sign_flag(state); } break;
+        case OPCODE_LOOP:   { result = (--*cx != 0); } break;
+        case OPCODE_LOOPZ:  { result = (--*cx != 0) && get_zero_flag(state); } break;
+        case OPCODE_LOOPNZ: { result = (--*cx != 0) && !get_zero_flag(state); } break;
+        case OPCODE_JCXZ:   { result = (*cx == 0); } break;
+    }
+    
+    return result;
+}
+
+// What a taken jump costs over the not taken cost already charged from the decode table.
+inline u32 get_jump_taken_clocks(u8 opcode)
+{
+    u32 result = 12; // 16 taken, 4 not taken
+    switch (opcode)
+    {
+        case OPCODE_LOOP:   { result = 17 - 5; } break;
+        case OPCODE_LOOPZ:  { result = 18 - 6; } break;
+        case OPCODE_LOOPNZ: { result = 19 - 5; } break;
+        case OPCODE_JCXZ:   { result = 18 - 6; } break;
+    }
+    
+    return result;
+}
+
+template<u8 Opcode> void execute_jump(State *state, Instruction *instruction)
+{
+    if (get_jump_condition<Opcode>(state)) {
+        state->ip_register.value += (s8)instruction->value;
+        state->clocks += get_jump_taken_clocks(Opcode);
+    }
+}
+
+void execute_not_implemented(State *, Instruction *)
+{
+    // Decodes but has no simulation yet: it only moves IP forward.
+}
+
+template<OperationType Op> ExecuteHandler * select_operand_handler(OperandForm form, u8 w)
+{
+    ExecuteHandler *result = execute_not_implemented;
+    switch (form)
+    {
+        case Operands_reg_reg: { result = w ? execute_reg_reg<Op, u16> : execute_reg_reg<Op, u8>; } break;
+        case Operands_reg_mem: { result = w ? execute_reg_mem<Op, u16> : execute_reg_mem<Op, u8>; } break;
+        case Operands_mem_reg: { result = w ? execute_mem_reg<Op, u16> : execute_mem_reg<Op, u8>; } break;
+        case Operands_reg_imm: { result = w ? execute_reg_imm<Op, u16> : execute_reg_imm<Op, u8>; } break;
+        case Operands_mem_imm: { result = w ? execute_mem_imm<Op, u16> : execute_mem_imm<Op, u8>; } break;
+        default: break;
+    }
+    
+    return result;
+}
+
+ExecuteHandler * select_jump_handler(u8 binary)
+{
+    ExecuteHandler *result = execute_not_implemented;
+    switch (binary)
+    {
+        case OPCODE_JE:     { result = execute_jump<OPCODE_JE>; } break;
+        case OPCODE_JL:     { result = execute_jump<OPCODE_JL>; } break;
+        case OPCODE_JLE:    { result = execute_jump<OPCODE_JLE>; } break;
+        case OPCODE_JB:     { result = execute_jump<OPCODE_JB>; } break;
+        case OPCODE_JBE:    { result = execute_jump<OPCODE_JBE>; } break;
+        case OPCODE_JP:     { result = execute_jump<OPCODE_JP>; } break;
+        case OPCODE_JO:     { result = execute_jump<OPCODE_JO>; } break;
+        case OPCODE_JS:     { result = execute_jump<OPCODE_JS>; } break;
+        case OPCODE_JNE:    { result = execute_jump<OPCODE_JNE>; } break;
+        case OPCODE_JNL:    { result = execute_jump<OPCODE_JNL>; } break;
+        case OPCODE_JNLE:   { result = execute_jump<OPCODE_JNLE>; } break;
+        case OPCODE_JNB:    { result = execute_jump<OPCODE_JNB>; } break;
+        case OPCODE_JNBE:   { result = execute_jump<OPCODE_JNBE>; } break;
+        case OPCODE_JNP:    { result = execute_jump<OPCODE_JNP>; } break;
+        case OPCODE_JNO:    { result = execute_jump<OPCODE_JNO>; } break;
+        case OPCODE_JNS:    { result = execute_jump<OPCODE_JNS>; } break;
+        case OPCODE_LOOP:   { result = execute_jump<OPCODE_LOOP>; } break;
+        case OPCODE_LOOPZ:  { result = execute_jump<OPCODE_LOOPZ>; } break;
+        case OPCODE_LOOPNZ: { result = execute_jump<OPCODE_LOOPNZ>; } break;
+        case OPCODE_JCXZ:   { result = execute_jump<OPCODE_JCXZ>; } break;
+    }
+    
+    return result;
+}
+
+ExecuteHandler * get_operation_handler(OperationType operation_type, OperandForm form, u8 w)
+{
+    ExecuteHandler *result = execute_not_implemented;
+    switch (operation_type)
+    {
+        case Op_mov: { result = select_operand_handler<Op_mov>(form, w); } break;
+        case Op_add: { result = select_operand_handler<Op_add>(form, w); } break;
+        case Op_sub: { result = select_operand_handler<Op_sub>(form, w); } break;
+        case Op_cmp: { result = select_operand_handler<Op_cmp>(form, w); } break;
+        default: break;
+    }
+    
+    return result;
+}
+
+// Instructions refer to their handler by a byte index into execute_handlers. Slot 0
+// does nothing, then come the operand handlers by (operation, operand form, width)
+// and the jump handlers by opcode.
+#define OPERAND_FORM_COUNT 6
+#define HANDLER_OPERAND_FIRST 1
+#define HANDLER_JUMP_FIRST (HANDLER_OPERAND_FIRST + (Op_cmp - Op_mov + 1)*OPERAND_FORM_COUNT*2)
+#define HANDLER_COUNT (HANDLER_JUMP_FIRST + 20)
+
+ExecuteHandler *execute_handlers[HANDLER_COUNT];
+
+inline u8 get_operand_handler_index(OperationType operation_type, OperandForm form, u8 w)
+{
+    u8 result = 0;
+    if (operation_type >= Op_mov && operation_type <= Op_cmp) {
+        result = HANDLER_OPERAND_FIRST + (((operation_type - Op_mov)*OPERAND_FORM_COUNT + form) << 1) + w;
+    }
+    
+    return result;
+}
+
+// Conditional jumps are 0x70-0x7F and the loops 0xE0-0xE3.
+inline u8 get_jump_handler_index(u8 binary)
+{
+    u8 result = HANDLER_JUMP_FIRST + ((binary >= OPCODE_LOOPNZ) ? (16 + (binary & 0b11)) : (binary & 0xF));
+    
+    return result;
+}
+
+void init_execute_handlers()
+{
+    execute_handlers[0] = execute_not_implemented;
+    
+    for (u32 operation_type = Op_mov; operation_type <= Op_cmp; ++operation_type) {
+        for (u32 form = Operands_none; form < OPERAND_FORM_COUNT; ++form) {
+            for (u8 w = 0; w < 2; ++w) {
+                u8 index = get_operand_handler_index((OperationType)operation_type, (OperandForm)form, w);
+                execute_handlers[index] = get_operation_handler((OperationType)operation_type, (OperandForm)form, w);
+            }
+        }
+    }
+    
+    for (u32 binary = 0x70; binary <= 0x7F; ++binary) {
+        execute_handlers[get_jump_handler_index((u8)binary)] = select_jump_handler((u8)binary);
+    }
+    for (u32 binary = OPCODE_LOOPNZ; binary <= OPCODE_JCXZ; ++binary) {
+        execute_handlers[get_jump_handler_index((u8)binary)] = select_jump_handler((u8)binary);
+    }
+}
+
+// Called once the operands of the instruction are decoded.
+void select_handler(Instruction *instruction)
+{
+    if (instruction->operation_type == Op_jmp) {
+        instruction->handler = get_jump_handler_index(instruction->binary);
+        return;
+    }
+    
+    if (instruction->flags & ACCUMULATOR_ADDRESS) {
+        // [addr] is a memory operand with only a displacement
+        instruction->displacement = (s16)instruction->value;
+    }
+    
+    bool has_dest = (instruction->dest_register != 0);
+    bool has_source = (instruction->source_register != 0);
+    bool has_memory = (((instruction->flags & DISPLACEMENT) && instruction->mod != MOD_REGISTER_MODE) ||
+                       (instruction->flags & ACCUMULATOR_ADDRESS));
+    
+    OperandForm form = Operands_none;
+    if (instruction->flags & HAS_DATA) {
+        if (has_dest) {
+            form = Operands_reg_imm;
+        } else if (has_memory) {
+            form = Operands_mem_imm;
+        }
+    } else if (has_dest && has_source) {
+        form = Operands_reg_reg;
+    } else if (has_dest && has_memory) {
+        form = Operands_reg_mem;
+    } else if (has_source && has_memory) {
+        form = Operands_mem_reg;
+    }
+    
+    instruction->handler = get_operand_handler_index((OperationType)instruction->operation_type, form, instruction->w);
+}
@@ -0,0 +1,453 @@
+//
+// The original decoder, which finds the instruction form with a chain of masked
+// compares against the Opcode enum. It is only kept so --bench-decode can compare
+// it against the table driven decode_asm_8086(). It decodes into the old, wide
+// instruction layout with the register definitions copied in.
+//
+
+struct LegacyDisplacementAddress {
+    RegisterDefinition first_displacement;
+    RegisterDefinition second_displacement;
+    s16 offset;
+    u8 clocks;
+};
+
+// The instruction layout from before it was packed.
+struct LegacyInstruction {
+    OperationType operation_type;
+    RegisterDefinition source_register;
+    RegisterDefinition dest_register;
+    u8 bytes_used;
+    u8 binary;
+    u8 d;
+    u8 s;
+    u8 w;
+    u8 mod;
+    u8 reg;
+    u8 rm;
+    u8 sr;
+    u8 flags;
+    u16 value;
+    LegacyDisplacementAddress displacement_address;
+    u8 clocks;
+};
+
+void legacy_set_source_and_dest_registers(LegacyInstruction *instruction, FileContent *file_content)
+{
+    RegisterDefinition reg_register = get_register_definition(instruction->w, instruction->reg);
+    RegisterDefinition rm_register  = get_register_definition(instruction->w, instruction->rm);
+    
+    if (instruction->flags & HAS_DATA) {
+        u16 number;
+        if (instruction->w == 1) {
+            if (instruction->s == 0)  {
+                number = get_next_word(file_content);
+                instruction->bytes_used += 2;
+            } else {
+                // Sign-extended
+                number = (u16)(s16)(s8)get_next_byte(file_content);
+                
+                instruction->bytes_used += 1;
+            }
+        } else {
+            number = (u16)get_next_byte(file_content);
+            instruction->bytes_used += 1;
+        }
+        
+        instruction->value = number;
+    }
+    
+    if (instruction->flags & REG_SOURCE_DEST) {
+        if (instruction->d) {
+            instruction->dest_register = reg_register;
+        } else {
+            instruction->source_register = reg_register;
+        }
+    } else if (instruction->flags & IMMEDIATE ||
+               instruction->flags & IMMEDIATE_ACCUMULATOR) {
+        instruction->dest_register = reg_register;
+    } else if (instruction->flags & ACCUMULATOR_ADDRESS) {
+        u16 number = get_next_word(file_content);
+        instruction->bytes_used += 2;
+        instruction->value = number;
+        if (instruction->d) {
+            instruction->dest_register = reg_register;
+        } else {
+            instruction->source_register = reg_register;
+        }
+    }
+    
+    if (instruction->mod == MOD_REGISTER_MODE) {
+        if (instruction->flags & SEGMENT) {
+            RegisterDefinition segment_register = get_segment_register_definition(instruction->sr);
+            if (instruction->d) {
+                instruction->dest_register = rm_register;
+                instruction->source_register = segment_register;
+            } else {
+                instruction->dest_register = segment_register;
+                instruction->source_register = rm_register;
+            }
+        } else {
+            instruction->dest_register = rm_register;
+        }
+    }
+}
+
+void legacy_calculate_displacement(LegacyInstruction *instruction, FileContent *file_content)
+{
+    if (!(instruction->flags & DISPLACEMENT)) {
+        return;
+    }
+    
+    LegacyDisplacementAddress displacement = {};
+    
+    if (instruction->mod != MOD_REGISTER_MODE)
+    {
+        switch (instruction->rm)
+        {
+            case 0b000: {
+                displacement.first_displacement = registers_definitions[3][1];
+                displacement.second_displacement = registers_definitions[6][1];
+                displacement.clocks += 7;
+            } break;
+            
+            case 0b001: {
+                displacement.first_displacement = registers_definitions[3][1];
+                displacement.second_displacement = registers_definitions[7][1];
+                displacement.clocks += 8;
+            } break;
+            
+            case 0b010: {
+                displacement.first_displacement = registers_definitions[5][1];
+                displacement.second_displacement = registers_definitions[6][1];
+                displacement.clocks += 8;
+            } break;
+            
+            case 0b011: {
+                displacement.first_displacement = registers_definitions[5][1];
+                displacement.second_displacement = registers_definitions[7][1];
+                displacement.clocks += 7;
+            } break;
+            
+            case 0b100: {
+                displacement.first_displacement = registers_definitions[6][1];
+                displacement.clocks += 5;
+            } break;
+            
+            case 0b101: {
+                displacement.first_displacement = registers_definitions[7][1];
+                displacement.clocks += 5;
+            } break;
+            
+            case 0b110: {
+                if (instruction->mod != MOD_MEMORY_MODE) {
+                    displacement.first_displacement = registers_definitions[5][1];
+                    displacement.clocks += 5;
+                }
+            } break;
+            
+            case 0b111: {
+                displacement.first_displacement = registers_definitions[3][1];
+                displacement.clocks += 5;
+            } break;
+        }
+    }
+    
+    switch (instruction->mod)
+    {
+        case MOD_MEMORY_MODE: {
+            if (instruction->rm == 0b110) {
+                displacement.offset = (s16)get_next_word(file_content);
+                instruction->bytes_used += 2;
+                displacement.clocks += 6;
+            }
+        } break;
+        
+        case MOD_MEMORY_MODE_8_BIT_DISPLACEMENT: {
+            displacement.offset = (s8)get_next_byte(file_content);
+            instruction->bytes_used += 1;
+            displacement.clocks += 4;
+        } break;
+        
+        case MOD_MEMORY_MODE_16_BIT_DISPLACEMENT: {
+            displacement.offset = (s16)get_next_word(file_content);
+            instruction->bytes_used += 2;
+            displacement.clocks += 4;
+        } break;
+        
+        case MOD_REGISTER_MODE: {
+            // No displacement
+        } break;
+    }
+    
+    instruction->displacement_address = displacement;
+}
+
+bool legacy_is_opcode_jump(u8 opcode)
+{
+    bool is_jump = ((opcode == OPCODE_JE) ||
+                    (opcode == OPCODE_JL) ||
+                    (opcode == OPCODE_JLE) ||
+                    (opcode == OPCODE_JB) ||
+                    (opcode == OPCODE_JBE) ||
+                    (opcode == OPCODE_JP) ||
+                    (opcode == OPCODE_JO) ||
+                    (opcode == OPCODE_JS) ||
+                    (opcode == OPCODE_JNE) ||
+                    (opcode == OPCODE_JNL) ||
+                    (opcode == OPCODE_JNLE) ||
+                    (opcode == OPCODE_JNB) ||
+                    (opcode == OPCODE_JNBE) ||
+                    (opcode == OPCODE_JNP) ||
+                    (opcode == OPCODE_JNO) ||
+                    (opcode == OPCODE_JNS) ||
+                    (opcode == OPCODE_LOOP) ||
+                    (opcode == OPCODE_LOOPZ) ||
+                    (opcode == OPCODE_LOOPNZ) ||
+                    (opcode == OPCODE_JCXZ));
+    
+    return is_jump;
+}
+
+void legacy_calculate_instruction_clocks(LegacyInstruction *instruction)
+{
+    if (((instruction->binary >> 2) & 0b111111) == OPCODE_MOV_REGISTER_MEMORY_TO_OR_FROM_REGISTER)
+    {
+        if (instruction->dest_register.type != Register_none &&
+            instruction->source_register.type != Register_none) {
+            instruction->clocks += 2;
+        } else if (instruction->dest_register.type != Register_none &&
+                   instruction->source_register.type == Register_none) {
+            instruction->clocks += 8;
+        } else if (instruction->dest_register.type == Register_none &&
+                   instruction->source_register.type != Register_none) {
+            instruction->clocks += 9;
+        }
+    }
+    else if (((instruction->binary >> 1) & 0b1111111) == OPCODE_MOV_IMMEDIATE_TO_REGISTER_OR_MEMORY)
+    {
+        if (instruction->dest_register.type == Register_none) {
+            instruction->clocks += 10;
+        } else {
+            instruction->clocks += 4;
+        }
+    }
+    else if (((instruction->binary >> 4) & 0b1111) == OPCODE_MOV_IMMEDIATE_TO_REGISTER)
+    {
+        instruction->clocks += 4;
+    }
+    else if (((instruction->binary >> 1) & 0b1111111) == OPCODE_MOV_MEMORY_TO_ACCUMULATOR ||
+             ((instruction->binary >> 1) & 0b1111111) == OPCODE_MOV_ACCUMULATOR_TO_MEMORY)
+    {
+        instruction->clocks += 10;
+    }
+    else if ((instruction->binary == OPCODE_MOV_REGISTER_OR_MEMORY_TO_SEGMENT_REGISTER) ||
+             (instruction->binary == OPCODE_MOV_SEGMENT_REGISTER_TO_REGISTER_OR_MEMORY))
+    {
+        if (instruction->dest_register.type != Register_none &&
+            instruction->source_register.type != Register_none) {
+            instruction->clocks += 2;
+        } else if (instruction->dest_register.type != Register_none &&
+                   instruction->source_register.type == Register_none) {
+            instruction->clocks += 8;
+        } else if (instruction->dest_register.type == Register_none &&
+                   instruction->source_register.type != Register_none) {
+            instruction->clocks += 9;
+        }
+    }
+    else if (((instruction->binary >> 2) & 0b111111) == OPCODE_ARITHMETIC_IMMEDIATE_TO_REGISTER_OR_MEMORY)
+    {
+        if (instruction->dest_register.type != Register_none) {
+            instruction->clocks += 4;
+        } else {
+            if (instruction->operation_type == Op_add ||
+                instruction->operation_type == Op_sub) {
+                instruction->clocks += 17;
+            } else if (instruction->operation_type == Op_cmp) {
+                instruction->clocks += 10;
+            }
+        }
+    }
+    else if ((((instruction->binary >> 2) & 0b111111) == OPCODE_ADD_REGISTER_OR_MEMORY) ||
+             (((instruction->binary >> 2) & 0b111111) == OPCODE_SUB_REGISTER_OR_MEMORY) ||
+             (((instruction->binary >> 2) & 0b111111) == OPCODE_CMP_REGISTER_OR_MEMORY))
+    {
+        if (instruction->dest_register.type != Register_none &&
+            instruction->source_register.type != Register_none) {
+            instruction->clocks += 3;
+        } else if (instruction->dest_register.type != Register_none &&
+                   instruction->source_register.type == Register_none) {
+            instruction->clocks += 9;
+        } else if (instruction->dest_register.type == Register_none &&
+                   instruction->source_register.type != Register_none) {
+            if (instruction->operation_type == Op_cmp) {
+                instruction->clocks += 9;
+            } else {
+                instruction->clocks += 16;
+            }
+        }
+    }
+    else if ((((instruction->binary >> 1) & 0b1111111) == OPCODE_ADD_IMMEDIATE_TO_ACCUMULATOR) ||
+             (((instruction->binary >> 1) & 0b1111111) == OPCODE_SUB_IMMEDIATE_FROM_ACCUMULATOR) ||
+             (((instruction->binary >> 1) & 0b1111111) == OPCODE_CMP_IMMEDIATE_WITH_ACCUMULATOR))
+    {
+        instruction->clocks += 4;
+    }
+    else if (legacy_is_opcode_jump(instruction->binary))
+    {
+        switch (instruction->binary)
+        {
+            case OPCODE_JE:     { instruction->clocks += 16; } break;
+            case OPCODE_JL:     {  } break;
+            case OPCODE_JLE:    {  } break;
+            case OPCODE_JB:     { instruction->clocks += 16; } break;
+            case OPCODE_JBE:    {  } break;
+            case OPCODE_JP:     { instruction->clocks += 16; } break;
+            case OPCODE_JO:     {  } break;
+            case OPCODE_JS:     {  } break;
+            case OPCODE_JNE:    { instruction->clocks += 16; } break;
+            case OPCODE_JNL:    {  } break;
+            case OPCODE_JNLE:   {  } break;
+            case OPCODE_JNB:    {  } break;
+            case OPCODE_JNBE:   {  } break;
+            case OPCODE_JNP:    {  } break;
+            case OPCODE_JNO:    {  } break;
+            case OPCODE_JNS:    {  } break;
+            case OPCODE_LOOP:   { instruction->clocks += 17; } break;
+            case OPCODE_LOOPZ:  {  } break;
+            case OPCODE_LOOPNZ: { instruction->clocks += 19; } break;
+            case OPCODE_JCXZ:   {  } break;
+        }
+    }
+}
+
+u32 legacy_decode_asm_8086(FileContent *file_content, LegacyInstruction *instructions)
+{
+    u32 instruction_count = 0;
+    while (file_content->size_remaining)
+    {
+        LegacyInstruction instruction = {};
+        
+        u8 first_byte = get_next_byte(file_content);
+        instruction.bytes_used += 1;
+        
+        instruction.binary = first_byte;
+        
+        if (((instruction.binary >> 2) & 0b111111) == OPCODE_MOV_REGISTER_MEMORY_TO_OR_FROM_REGISTER)
+        {
+            u8 second_byte = get_next_byte(file_content);
+            instruction.bytes_used += 1;
+            
+            instruction.operation_type = Op_mov;
+            instruction.w = instruction.binary & 1;
+            instruction.d = instruction.binary & 2;
+            instruction.mod = ((second_byte >> 6) & 0b11);
+            instruction.rm = second_byte & 0b111;
+            instruction.reg = ((second_byte >> 3) & 0b111);
+            instruction.flags = REG_SOURCE_DEST;
+            if (instruction.mod != MOD_REGISTER_MODE) {
+                instruction.flags |= DISPLACEMENT;
+            }
+        }
+        else if (((instruction.binary >> 1) & 0b1111111) == OPCODE_MOV_IMMEDIATE_TO_REGISTER_OR_MEMORY)
+        {
+            u8 second_byte = get_next_byte(file_content);
+            instruction.bytes_used += 1;
+            
+            instruction.operation_type = Op_mov;
+            instruction.w = instruction.binary & 1;
+            instruction.mod = (second_byte >> 6) & 0b11;
+            instruction.rm = second_byte & 0b111;
+            instruction.flags = WORD_BYTE_TEXT_REQUIRED | DISPLACEMENT | HAS_DATA;
+        }
+        else if (((instruction.binary >> 4) & 0b1111) == OPCODE_MOV_IMMEDIATE_TO_REGISTER)
+        {
+            instruction.operation_type = Op_mov;
+            instruction.w = (instruction.binary >> 3) & 1;
+            instruction.reg = instruction.binary & 0b111;
+            instruction.flags = IMMEDIATE | HAS_DATA;
+        }
+        else if (((instruction.binary >> 1) & 0b1111111) == OPCODE_MOV_MEMORY_TO_ACCUMULATOR ||
+                 ((instruction.binary >> 1) & 0b1111111) == OPCODE_MOV_ACCUMULATOR_TO_MEMORY)
+        {
+            instruction.operation_type = Op_mov;
+            instruction.w = instruction.binary & 1;
+            instruction.reg = 0b000;
+            instruction.d = ((instruction.binary >> 1) & 1) ^ 1;
+            instruction.flags = ACCUMULATOR_ADDRESS;
+        }
+        else if ((instruction.binary == OPCODE_MOV_REGISTER_OR_MEMORY_TO_SEGMENT_REGISTER) ||
+                 (instruction.binary == OPCODE_MOV_SEGMENT_REGISTER_TO_REGISTER_OR_MEMORY))
+        {
+            u8 second_byte = get_next_byte(file_content);
+            instruction.bytes_used += 1;
+            
+            instruction.operation_type = Op_mov;
+            instruction.w = 1;
+            instruction.mod = (second_byte >> 6) & 0b11;
+            instruction.sr = (second_byte >> 3) & 0b111;
+            instruction.rm = second_byte & 0b111;
+            instruction.d = ((instruction.binary >> 1) & 1) ^ 1;
+            instruction.flags = SEGMENT;
+        }
+        else if (((instruction.binary >> 2) & 0b111111) == OPCODE_ARITHMETIC_IMMEDIATE_TO_REGISTER_OR_MEMORY)
+        {
+            u8 second_byte = get_next_byte(file_content);
+            instruction.bytes_used += 1;
+            
+            instruction.s = (instruction.binary >> 1) & 1;
+            instruction.w = instruction.binary & 1;
+            instruction.mod = (second_byte >> 6) & 0b11;
+            instruction.rm = second_byte & 0b111;
+            instruction.operation_type = arithmetic_operations[(second_byte >> 3) & 0b111];
+            instruction.flags = WORD_BYTE_TEXT_REQUIRED | DISPLACEMENT | HAS_DATA;
+        }
+        else if ((((instruction.binary >> 2) & 0b111111) == OPCODE_ADD_REGISTER_OR_MEMORY) ||
+                 (((instruction.binary >> 2) & 0b111111) == OPCODE_SUB_REGISTER_OR_MEMORY) ||
+                 (((instruction.binary >> 2) & 0b111111) == OPCODE_CMP_REGISTER_OR_MEMORY))
+        {
+            u8 second_byte = get_next_byte(file_content);
+            instruction.bytes_used += 1;
+            
+            instruction.d = (instruction.binary >> 1) & 1;
+            instruction.w = instruction.binary & 1;
+            instruction.mod = (second_byte >> 6) & 0b11;
+            instruction.reg = (second_byte >> 3) & 0b111;
+            instruction.rm = second_byte & 0b111;
+            instruction.operation_type = arithmetic_operations[(instruction.binary >> 3) & 0b111];
+            instruction.flags = REG_SOURCE_DEST | DISPLACEMENT;
+        }
+        else if ((((instruction.binary >> 1) & 0b1111111) == OPCODE_ADD_IMMEDIATE_TO_ACCUMULATOR) ||
+                 (((instruction.binary >> 1) & 0b1111111) == OPCODE_SUB_IMMEDIATE_FROM_ACCUMULATOR) ||
+                 (((instruction.binary >> 1) & 0b1111111) == OPCODE_CMP_IMMEDIATE_WITH_ACCUMULATOR))
+        {
+            instruction.w = instruction.binary & 1;
+            instruction.reg = 0b000; // ax || al register
+            instruction.operation_type = arithmetic_operations[(instruction.binary >> 3) & 0b111];
+            instruction.flags = IMMEDIATE_ACCUMULATOR | HAS_DATA;
+        }
+        else if (legacy_is_opcode_jump(instruction.binary))
+        {
+            u8 second_byte = get_next_byte(file_content);
+            instruction.bytes_used += 1;
+            
+            instruction.operation_type = Op_jmp;
+            instruction.value = second_byte;
+        }
+        else
+        {
+            printf("ERROR: opcode given by first byte [%c%c%c%c%c%c%c%c] not implemented\n", BYTE_TO_BINARY(instruction.binary));
+            
+            instruction_count = 0;
+            break;
+        }
+        
+        legacy_calculate_displacement(&instruction, file_content);
+        legacy_set_source_and_dest_registers(&instruction, file_content);
+        legacy_calculate_instruction_clocks(&instruction);
+        
+        instructions[instruction_count++] = instruction;
+    }
+    
+    return instruction_count;
+}
@@ -0,0 +1,141 @@
+//
+// Simulated memory. It is allocated as zeroed pages the OS only backs when they are
+// first touched, and every store marks the MEMORY_PAGE_SIZE page it hits, so clearing
+// memory between runs and dumping it cost what the program wrote, not the megabyte.
+//
+
+// Sparse dump: a MemoryDumpHeader, then page_count records of the u32 page index and
+// the MEMORY_PAGE_SIZE bytes of the page, by increasing page index. Incremental dumps
+// of one run are appended to the same file.
+struct MemoryDumpHeader {
+    char magic[4]; // "S86M"
+    u32 page_size;
+    u32 page_count;
+    u32 changed_only; // Only the pages changed since the previous dump
+    u64 instructions; // Executed when the dump was taken
+    u64 clocks;
+};
+
+bool init_memory(State *state, u32 size)
+{
+    u32 page_count = (size + MEMORY_PAGE_SIZE - 1) >> MEMORY_PAGE_SHIFT;
+    
+    state->memory_size = size;
+    state->memory = (u8 *)allocate_zeroed_pages(size);
+    state->page_flags = (u8 *)calloc(page_count, sizeof(u8));
+    state->written_pages = (u32 *)calloc(page_count, sizeof(u32));
+    state->written_page_count = 0;
+    state->modified_pages = (u32 *)calloc(page_count, sizeof(u32));
+    state->modified_page_count = 0;
+    state->snapshot_id = 0;
+    
+    bool result = state->memory && state->page_flags && state->written_pages && state->modified_pages;
+    
+    return result;
+}
+
+void free_memory(State *state)
+{
+    if (state->memory) {
+        free_pages(state->memory, state->memory_size);
+    }
+    free(state->page_flags);
+    free(state->written_pages);
+    free(state->modified_pages);
+    
+    state->memory = 0;
+    state->page_flags = 0;
+    state->written_pages = 0;
+    state->written_page_count = 0;
+    state->modified_pages = 0;
+    state->modified_page_count = 0;
+}
+
+inline void mark_page_written(State *state, u32 page)
+{
+    // Stores mostly hit pages that are already marked
+    u8 flags = state->page_flags[page];
+    if (flags != PAGE_ALL_FLAGS) {
+        if (!(flags & Page_written)) {
+            state->written_pages[state->written_page_count++] = page;
+        }
+        if (!(flags & Page_modified)) {
+            state->modified_pages[state->modified_page_count++] = page;
+        }
+        state->page_flags[page] = PAGE_ALL_FLAGS;
+    }
+}
+
+// [start, end) in linear addresses
+void mark_memory_written(State *state, u32 start, u32 end)
+{
+    if (start < end) {
+        u32 last_page = (end - 1) >> MEMORY_PAGE_SHIFT;
+        for (u32 page = start >> MEMORY_PAGE_SHIFT; page <= last_page; ++page) {
+            mark_page_written(state, page);
+        }
+    }
+}
+
+// Zeroes what was written since the last clear, memory is back to how it was allocated.
+void clear_written_memory(State *state)
+{
+    for (u32 i = 0; i < state->written_page_count; ++i) {
+        u32 page = state->written_pages[i];
+        memset(state->memory + ((size_t)page << MEMORY_PAGE_SHIFT), 0, MEMORY_PAGE_SIZE);
+        state->page_flags[page] = 0;
+    }
+    state->written_page_count = 0;
+    
+    // Memory no longer matches any snapshot
+    state->modified_page_count = 0;
+    state->snapshot_id = 0;
+}
+
+int compare_pages(const void *a, const void *b)
+{
+    u32 page_a = *(u32 *)a;
+    u32 page_b = *(u32 *)b;
+    
+    int result = (page_a > page_b) - (page_a < page_b);
+    
+    return result;
+}
+
+// Writes the pages written since the last clear, or only the ones changed since the
+// last dump, and marks them unchanged. Returns the number of pages written.
+u32 write_memory_dump(State *state, FILE *file, bool changed_only, u64 instructions)
+{
+    // Sorted in place, the order of first writes is only needed to find the pages
+    qsort(state->written_pages, state->written_page_count, sizeof(u32), compare_pages);
+    
+    MemoryDumpHeader header = {};
+    memcpy(header.magic, "S86M", 4);
+    header.page_size = MEMORY_PAGE_SIZE;
+    header.changed_only = changed_only;
+    header.instructions = instructions;
+    header.clocks = state->clocks;
+    for (u32 i = 0; i < state->written_page_count; ++i) {
+        if (!changed_only || (state->page_flags[state->written_pages[i]] & Page_changed)) {
+            ++header.page_count;
+        }
+    }
+    
+    fwrite(&header, sizeof(header), 1, file);
+    for (u32 i = 0; i < state->written_page_count; ++i) {
+        u32 page = state->written_pages[i];
+        if (!changed_only || (state->page_flags[page] & Page_changed)) {
+            fwrite(&page, sizeof(page), 1, file);
+            fwrite(state->memory + ((size_t)page << MEMORY_PAGE_SHIFT), 1, MEMORY_PAGE_SIZE, file);
+            state->page_flags[page] &= ~Page_changed;
+        }
+    }
+    
+    return header.page_count;
+}
+
+// The whole memory as a raw image, to look at it in an image viewer.
+void write_full_memory_dump(State *state, FILE *file)
+{
+    fwrite(state->memory, 1, state->memory_size, file);
+}
@@ -0,0 +1,297 @@
+//
+// Parallel decoding of big images. The image is cut in chunks decoded by a pool of
+// threads, but where an instruction of a chunk starts depends on every instruction
+// before it: the last instruction of the previous chunk can run up to 6 bytes into it.
+// So every chunk is decoded from its first byte, and then speculatively from each of
+// the next 6. Decoding x86 resynchronizes quickly, so those usually land on an
+// instruction of the first decoding after a few instructions and only those few are
+// kept. Once the chunks are done they are stitched in order: where the previous chunk
+// really ended picks the start, the rest of the chunk follows the first decoding.
+//
+// Speculative decoding stops quietly at bytes the decoder would complain about. The
+// stitching decodes those the normal way, so errors are reported as decode_asm_8086()
+// reports them, and only for the instructions it would really decode.
+//
+
+#define PARALLEL_MIN_CHUNK_SIZE KILOBYTES(64)
+#define PARALLEL_CHUNKS_PER_THREAD 4
+
+// Instructions decoded from a later start before giving up on it meeting the first decoding
+#define PARALLEL_MAX_CANDIDATE_INSTRUCTIONS 64
+
+struct DecodeCandidate {
+    bool resolved; // Decoded until it joined the first decoding or went past the chunk
+    bool joined;
+    u32 next; // Offset it joined at, or of the first instruction past the chunk
+    u32 count;
+    Instruction instructions[PARALLEL_MAX_CANDIDATE_INSTRUCTIONS];
+};
+
+struct DecodeChunk {
+    u32 start;
+    u32 end;
+    
+    // From the first byte
+    Instruction *instructions;
+    u32 *offsets;
+    u32 count;
+    u32 stop; // Offset of the first instruction past the chunk, or where decoding had to stop
+    u8 *starts; // Per byte of the chunk, 1 if an instruction starts there
+    
+    // From the next bytes, by distance to the first one
+    DecodeCandidate candidates[MAX_INSTRUCTION_SIZE];
+};
+
+struct ParallelDecode {
+    u8 *code;
+    u32 size;
+    DecodeChunk *chunks;
+    u32 chunk_count;
+    s64 volatile next_chunk;
+};
+
+// Decodable without the decoder printing anything: a known opcode with room for the
+// longest instruction before the end of the image.
+inline bool can_decode_quietly(u8 *code, u32 size, u32 offset)
+{
+    bool result = (size - offset >= MAX_INSTRUCTION_SIZE && has_known_opcode(code + offset));
+    
+    return result;
+}
+
+inline void decode_at(u8 *code, u32 size, u32 offset, Instruction *instruction)
+{
+    FileContent content = {};
+    content.memory = code + offset;
+    content.total_size = size;
+    content.size_remaining = size - offset;
+    
+    decode_instruction(&content, instruction);
+}
+
+void decode_chunk(ParallelDecode *decode, DecodeChunk *chunk)
+{
+    u8 *code = decode->code;
+    u32 size = decode->size;
+    
+    u32 offset = chunk->start;
+    while (offset < chunk->end && can_decode_quietly(code, size, offset)) {
+        Instruction *instruction = chunk->instructions + chunk->count;
+        decode_at(code, size, offset, instruction);
+        chunk->offsets[chunk->count++] = offset;
+        chunk->starts[offset - chunk->start] = 1;
+        offset += instruction->bytes_used;
+    }
+    chunk->stop = offset;
+    
+    for (u32 skip = 1; skip < MAX_INSTRUCTION_SIZE; ++skip) {
+        DecodeCandidate *candidate = chunk->candidates + skip;
+        candidate->count = 0;
+        
+        offset = chunk->start + skip;
+        while (offset < chunk->end && !chunk->starts[offset - chunk->start] &&
+               candidate->count < PARALLEL_MAX_CANDIDATE_INSTRUCTIONS && can_decode_quietly(code, size, offset)) {
+            Instruction *instruction = candidate->instructions + candidate->count++;
+            decode_at(code, size, offset, instruction);
+            offset += instruction->bytes_used;
+        }
+        
+        candidate->joined = (offset < chunk->end && chunk->starts[offset - chunk->start]);
+        candidate->resolved = candidate->joined || offset >= chunk->end;
+        candidate->next = offset;
+    }
+}
+
+THREAD_PROC(decode_worker_proc)
+{
+    ParallelDecode *decode = (ParallelDecode *)parameter;
+    
+    for (;;) {
+        s64 chunk_index = atomic_fetch_add_s64(&decode->next_chunk, 1);
+        if (chunk_index >= decode->chunk_count) {
+            break;
+        }
+        
+        decode_chunk(decode, decode->chunks + chunk_index);
+    }
+    
+    return 0;
+}
+
+// Copies the instructions in at the end of the store.
+bool append_instructions(InstructionStore *store, Instruction *instructions, u32 count)
+{
+    while (count) {
+        u32 chunk_index = store->count >> INSTRUCTION_CHUNK_SHIFT;
+        u32 used = store->count & INSTRUCTION_CHUNK_MASK;
+        if (used == 0) {
+            // Makes room for the next chunk
+            if (!push_instruction(store)) {
+                return false;
+            }
+            --store->count;
+        }
+        
+        u32 room = INSTRUCTION_CHUNK_SIZE - used;
+        u32 copy = (count < room) ? count : room;
+        memcpy(store->chunks[chunk_index] + used, instructions, copy*sizeof(Instruction));
+        
+        store->count += copy;
+        instructions += copy;
+        count -= copy;
+    }
+    
+    return true;
+}
+
+// Decodes from offset to the end of the chunk the way decode_asm_8086() does. Returns
+// the offset of the first instruction past the chunk, 0 on errors.
+u32 decode_chunk_rest(u8 *code, u32 size, u32 offset, u32 end, InstructionStore *store)
+{
+    FileContent content = {};
+    content.memory = code + offset;
+    content.total_size = size;
+    content.size_remaining = size - offset;
+    
+    while (offset < end) {
+        Instruction *instruction = push_instruction(store);
+        if (!instruction) {
+            printf("ERROR: out of memory for decoded instructions\n");
+            return 0;
+        }
+        
+        if (!decode_instruction(&content, instruction)) {
+            return 0;
+        }
+        offset += instruction->bytes_used;
+    }
+    
+    return offset;
+}
+
+// The decoding of the chunk that starts where the previous chunk really ended.
+bool stitch_chunk(ParallelDecode *decode, DecodeChunk *chunk, u32 *offset, InstructionStore *store)
+{
+    u32 first = 0; // Of the decoding from the first byte that follows
+    u32 skip = *offset - chunk->start;
+    if (skip) {
+        DecodeCandidate *candidate = chunk->candidates + skip;
+        if (!candidate->resolved) {
+            *offset = decode_chunk_rest(decode->code, decode->size, *offset, chunk->end, store);
+            return *offset != 0;
+        }
+        
+        if (!append_instructions(store, candidate->instructions, candidate->count)) {
+            printf("ERROR: out of memory for decoded instructions\n");
+            return false;
+        }
+        
+        *offset = candidate->next;
+        if (!candidate->joined) {
+            return true;
+        }
+        
+        // Offsets are sorted, find the instruction it joined at
+        u32 low = 0;
+        u32 high = chunk->count;
+        while (low < high) {
+            u32 middle = (low + high) / 2;
+            if (chunk->offsets[middle] < *offset) {
+                low = middle + 1;
+            } else {
+                high = middle;
+            }
+        }
+        first = low;
+    }
+    
+    if (!append_instructions(store, chunk->instructions + first, chunk->count - first)) {
+        printf("ERROR: out of memory for decoded instructions\n");
+        return false;
+    }
+    *offset = chunk->stop;
+    
+    if (*offset < chunk->end) {
+        *offset = decode_chunk_rest(decode->code, decode->size, *offset, chunk->end, store);
+    }
+    
+    return *offset != 0;
+}
+
+// Same result as decode_asm_8086() on the whole image, decoded on thread_count threads
+// (0 for one per core). Small images are decoded on this thread.
+u32 parallel_decode_asm_8086(u8 *code, u32 size, InstructionStore *store, u32 thread_count)
+{
+    if (!thread_count) {
+        thread_count = get_processor_count();
+    }
+    
+    u32 chunk_count = thread_count*PARALLEL_CHUNKS_PER_THREAD;
+    u32 chunk_size = (size + chunk_count - 1) / chunk_count;
+    if (chunk_size < PARALLEL_MIN_CHUNK_SIZE) {
+        chunk_size = PARALLEL_MIN_CHUNK_SIZE;
+    }
+    chunk_count = (size + chunk_size - 1) / chunk_size;
+    
+    if (thread_count == 1 || chunk_count < 2) {
+        FileContent content = {};
+        content.memory = code;
+        content.total_size = size;
+        content.size_remaining = size;
+        
+        u32 result = decode_asm_8086(&content, store);
+        
+        return result;
+    }
+    
+    ParallelDecode decode = {};
+    decode.code = code;
+    decode.size = size;
+    decode.chunk_count = chunk_count;
+    decode.chunks = (DecodeChunk *)calloc(chunk_count, sizeof(DecodeChunk));
+    
+    // Room for an instruction per byte, only what gets used is backed by memory
+    for (u32 i = 0; i < chunk_count; ++i) {
+        DecodeChunk *chunk = decode.chunks + i;
+        chunk->start = i*chunk_size;
+        chunk->end = (i + 1 == chunk_count) ? size : chunk->start + chunk_size;
+        
+        u32 chunk_bytes = chunk->end - chunk->start;
+        chunk->instructions = (Instruction *)allocate_zeroed_pages((size_t)chunk_bytes*sizeof(Instruction));
+        chunk->offsets = (u32 *)allocate_zeroed_pages((size_t)chunk_bytes*sizeof(u32));
+        chunk->starts = (u8 *)allocate_zeroed_pages(chunk_bytes);
+    }
+    
+    u32 worker_count = (thread_count < chunk_count) ? thread_count : chunk_count;
+    ThreadHandle *threads = (ThreadHandle *)calloc(worker_count, sizeof(ThreadHandle));
+    
+    // Worker 0 is this thread
+    for (u32 i = 1; i < worker_count; ++i) {
+        threads[i] = create_thread(decode_worker_proc, &decode);
+    }
+    decode_worker_proc(&decode);
+    for (u32 i = 1; i < worker_count; ++i) {
+        join_thread(threads[i]);
+    }
+    
+    store->count = 0;
+    u32 offset = 0;
+    for (u32 i = 0; i < chunk_count; ++i) {
+        if (!stitch_chunk(&decode, decode.chunks + i, &offset, store)) {
+            store->count = 0;
+            break;
+        }
+    }
+    
+    for (u32 i = 0; i < chunk_count; ++i) {
+        DecodeChunk *chunk = decode.chunks + i;
+        u32 chunk_bytes = chunk->end - chunk->start;
+        free_pages(chunk->instructions, (size_t)chunk_bytes*sizeof(Instruction));
+        free_pages(chunk->offsets, (size_t)chunk_bytes*sizeof(u32));
+        free_pages(chunk->starts, chunk_bytes);
+    }
+    free(threads);
+    free(decode.chunks);
+    
+    return store->count;
+}
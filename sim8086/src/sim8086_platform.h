@@ -0,0 +1,152 @@
+#ifndef SIM8086_PLATFORM_H
+#define SIM8086_PLATFORM_H
+
+//
+// Timing, threads and other OS helpers. Windows is the main target, the POSIX side
+// is there so the simulator also builds on the Linux machines.
+//
+
+#if _WIN32
+
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#include <io.h>
+#include <fcntl.h>
+
+typedef HANDLE ThreadHandle;
+#define THREAD_PROC(name) DWORD WINAPI name(void *parameter)
+typedef THREAD_PROC(ThreadProc);
+
+inline ThreadHandle create_thread(ThreadProc *proc, void *parameter)
+{
+    ThreadHandle result = CreateThread(0, 0, proc, parameter, 0, 0);
+    
+    return result;
+}
+
+inline void join_thread(ThreadHandle thread)
+{
+    WaitForSingleObject(thread, INFINITE);
+    CloseHandle(thread);
+}
+
+inline u32 get_processor_count()
+{
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    
+    return (u32)info.dwNumberOfProcessors;
+}
+
+// Returns the value before the add
+inline s64 atomic_fetch_add_s64(s64 volatile *value, s64 addend)
+{
+    s64 result = InterlockedExchangeAdd64((LONG64 volatile *)value, addend);
+    
+    return result;
+}
+
+// Zeroed memory, pages only get physical memory when they are first touched.
+inline void * allocate_zeroed_pages(size_t size)
+{
+    void *result = VirtualAlloc(0, size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+    
+    return result;
+}
+
+inline void free_pages(void *memory, size_t size)
+{
+    VirtualFree(memory, 0, MEM_RELEASE);
+}
+
+inline double get_seconds()
+{
+    LARGE_INTEGER frequency;
+    LARGE_INTEGER counter;
+    QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&counter);
+    
+    double result = (double)counter.QuadPart / (double)frequency.QuadPart;
+    
+    return result;
+}
+
+// So stdin and stdout pass machine code through untouched.
+inline void set_binary_mode(FILE *file)
+{
+    _setmode(_fileno(file), _O_BINARY);
+}
+
+#else
+
+#include <pthread.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <time.h>
+
+typedef pthread_t ThreadHandle;
+#define THREAD_PROC(name) void * name(void *parameter)
+typedef THREAD_PROC(ThreadProc);
+
+inline ThreadHandle create_thread(ThreadProc *proc, void *parameter)
+{
+    ThreadHandle result;
+    pthread_create(&result, 0, proc, parameter);
+    
+    return result;
+}
+
+inline void join_thread(ThreadHandle thread)
+{
+    pthread_join(thread, 0);
+}
+
+inline u32 get_processor_count()
+{
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
+    u32 result = (count > 0) ? (u32)count : 1;
+    
+    return result;
+}
+
+// Returns the value before the add
+inline s64 atomic_fetch_add_s64(s64 volatile *value, s64 addend)
+{
+    s64 result = __atomic_fetch_add(value, addend, __ATOMIC_SEQ_CST);
+    
+    return result;
+}
+
+// Zeroed memory, pages only get physical memory when they are first touched.
+inline void * allocate_zeroed_pages(size_t size)
+{
+    void *result = mmap(0, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (result == MAP_FAILED) {
+        result = 0;
+    }
+    
+    return result;
+}
+
+inline void free_pages(void *memory, size_t size)
+{
+    munmap(memory, size);
+}
+
+inline double get_seconds()
+{
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    
+    double result = (double)now.tv_sec + (double)now.tv_nsec*1.0e-9;
+    
+    return result;
+}
+
+inline void set_binary_mode(FILE *)
+{
+}
+
+#endif
+
+#endif //SIM8086_PLATFORM_H
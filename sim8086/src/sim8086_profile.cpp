@@ -0,0 +1,178 @@
+//
+// Profiler. The profiling run loop counts executions and clocks per IP of the code
+// segment, and per basic block how often it ran and how often the jump ending it was
+// taken. The report ranks instructions and blocks by clocks, joined with their
+// disassembly, and lists the loops (blocks ending in a backward jump) with their
+// iteration counts.
+//
+
+#define PROFILE_HOT_SPOT_COUNT 20
+#define PROFILE_BLOCK_COUNT 10
+
+struct Profile {
+    u64 instructions;
+    u64 clocks;
+    
+    // By IP
+    u64 hits[SEGMENT_SIZE];
+    u64 instruction_clocks[SEGMENT_SIZE];
+    
+    // By entry IP of the block
+    u64 block_hits[SEGMENT_SIZE];
+    u64 block_taken[SEGMENT_SIZE]; // Times the jump ending the block was taken
+    u64 block_clocks[SEGMENT_SIZE];
+    u16 block_last[SEGMENT_SIZE]; // IP of the last instruction of the block
+};
+
+// Decodes the instruction at ip of the code segment as it is now in memory.
+bool decode_profiled_instruction(State *state, u16 ip, Instruction *instruction)
+{
+    // Same window as decode_at_ip, wrapped at the end of the segment and of memory
+    u8 bytes[MAX_INSTRUCTION_SIZE];
+    FileContent code = {};
+    code.memory = get_code_bytes(state, ip, bytes);
+    code.total_size = (u32)ip + MAX_INSTRUCTION_SIZE;
+    code.size_remaining = MAX_INSTRUCTION_SIZE;
+    
+    bool result = decode_instruction(&code, instruction);
+    
+    return result;
+}
+
+void print_profiled_instruction(State *state, u16 ip)
+{
+    char text[MAX_INSTRUCTION_TEXT];
+    TextBuffer buffer = {};
+    buffer.data = text;
+    buffer.capacity = sizeof(text);
+    
+    Instruction instruction;
+    if (decode_profiled_instruction(state, ip, &instruction)) {
+        write_instruction(&buffer, instruction);
+    } else {
+        write_string(&buffer, "(no longer decodes)");
+    }
+    write_char(&buffer, 0);
+    
+    printf("%s", text);
+}
+
+// Sort keys of the report, highest clocks first.
+struct ProfileEntry {
+    u16 ip;
+    u64 clocks;
+};
+
+int compare_profile_entries(const void *a, const void *b)
+{
+    u64 clocks_a = ((ProfileEntry *)a)->clocks;
+    u64 clocks_b = ((ProfileEntry *)b)->clocks;
+    
+    int result = (clocks_a < clocks_b) - (clocks_a > clocks_b);
+    
+    return result;
+}
+
+inline double get_percent(u64 part, u64 total)
+{
+    double result = total ? 100.0*(double)part / (double)total : 0.0;
+    
+    return result;
+}
+
+void print_profile(State *state, Profile *profile)
+{
+    ProfileEntry *entries = (ProfileEntry *)malloc(SEGMENT_SIZE*sizeof(ProfileEntry));
+    
+    printf("Profile: %llu instructions, %llu clocks\n", profile->instructions, profile->clocks);
+    
+    u32 count = 0;
+    for (u32 ip = 0; ip < SEGMENT_SIZE; ++ip) {
+        if (profile->hits[ip]) {
+            entries[count].ip = (u16)ip;
+            entries[count].clocks = profile->instruction_clocks[ip];
+            ++count;
+        }
+    }
+    qsort(entries, count, sizeof(ProfileEntry), compare_profile_entries);
+    
+    printf("\nHot spots:\n");
+    printf("      clocks       %%     executed       %%  ip      instruction\n");
+    for (u32 i = 0; i < count && i < PROFILE_HOT_SPOT_COUNT; ++i) {
+        u16 ip = entries[i].ip;
+        printf("%12llu  %5.1f%%  %11llu  %5.1f%%  0x%04x  ", profile->instruction_clocks[ip], get_percent(profile->instruction_clocks[ip], profile->clocks),
+               profile->hits[ip], get_percent(profile->hits[ip], profile->instructions), ip);
+        print_profiled_instruction(state, ip);
+        printf("\n");
+    }
+    
+    count = 0;
+    for (u32 ip = 0; ip < SEGMENT_SIZE; ++ip) {
+        if (profile->block_hits[ip]) {
+            entries[count].ip = (u16)ip;
+            entries[count].clocks = profile->block_clocks[ip];
+            ++count;
+        }
+    }
+    qsort(entries, count, sizeof(ProfileEntry), compare_profile_entries);
+    
+    printf("\nBlocks:\n");
+    printf("      clocks       %%     executed  ip\n");
+    for (u32 i = 0; i < count && i < PROFILE_BLOCK_COUNT; ++i) {
+        u16 ip = entries[i].ip;
+        printf("%12llu  %5.1f%%  %11llu  0x%04x-0x%04x\n", profile->block_clocks[ip], get_percent(profile->block_clocks[ip], profile->clocks),
+               profile->block_hits[ip], ip, profile->block_last[ip]);
+    }
+    
+    // A jump back to or before itself closes a loop: every time it runs is an iteration,
+    // and every time it is not taken the loop was left. The blocks ending in it are
+    // added up, the first iteration usually runs in the block that enters the loop.
+    u64 *iterations = (u64 *)calloc(SEGMENT_SIZE, sizeof(u64));
+    u64 *taken = (u64 *)calloc(SEGMENT_SIZE, sizeof(u64));
+    for (u32 i = 0; i < count; ++i) {
+        u16 entry_ip = entries[i].ip;
+        u16 last_ip = profile->block_last[entry_ip];
+        iterations[last_ip] += profile->block_hits[entry_ip];
+        taken[last_ip] += profile->block_taken[entry_ip];
+    }
+    
+    count = 0;
+    for (u32 ip = 0; ip < SEGMENT_SIZE; ++ip) {
+        Instruction jump;
+        if (!iterations[ip] || !decode_profiled_instruction(state, (u16)ip, &jump) || jump.operation_type != Op_jmp) {
+            continue;
+        }
+        
+        u16 target = (u16)(ip + jump.bytes_used + (s8)jump.value);
+        if (target > ip) {
+            continue;
+        }
+        
+        entries[count].ip = (u16)ip;
+        entries[count].clocks = 0;
+        for (u32 body_ip = target; body_ip <= ip; ++body_ip) {
+            entries[count].clocks += profile->instruction_clocks[body_ip];
+        }
+        ++count;
+    }
+    qsort(entries, count, sizeof(ProfileEntry), compare_profile_entries);
+    
+    printf("\nLoops:\n");
+    for (u32 i = 0; i < count; ++i) {
+        u16 ip = entries[i].ip;
+        Instruction jump;
+        decode_profiled_instruction(state, ip, &jump);
+        u16 target = (u16)(ip + jump.bytes_used + (s8)jump.value);
+        
+        u64 entered = iterations[ip] - taken[ip];
+        printf("    0x%04x-0x%04x: %llu iterations", target, ip, iterations[ip]);
+        if (entered) {
+            printf(", entered %llu times, %.1f iterations per entry", entered, (double)iterations[ip] / (double)entered);
+        }
+        printf(", %.1f%% of the clocks\n", get_percent(entries[i].clocks, profile->clocks));
+    }
+    
+    free(iterations);
+    free(taken);
+    free(entries);
+}
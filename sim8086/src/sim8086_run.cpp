@@ -0,0 +1,240 @@
+//
+// The run loop. Tracing, profiling and breakpoints each need work per instruction, so
+// the loop is a template over which of them are on, and every combination is compiled
+// separately: the plain loop has none of their checks, and adds the clocks of a whole
+// block at once. select_run_program() picks the instantiation at runtime.
+//
+
+// Breakpoints that can be given on the command line
+#define MAX_BREAKPOINTS 16
+
+enum WatchStop {
+    Watch_running,
+    Watch_breakpoint, // IP reached a breakpoint, the instruction there did not run
+    Watch_changed,    // The watched word changed
+};
+
+struct Watchpoints {
+    u8 *breakpoints; // Per IP of the code segment, set to stop before the instruction there
+    
+    bool watching;
+    u32 watch_address; // Linear address of the word watched for changes
+    u16 watch_value;
+    
+    WatchStop stop;
+    u16 stop_ip; // IP of the instruction that hit the breakpoint or changed the word
+    u16 old_value;
+};
+
+// What the enabled features of the loop work with.
+struct RunHooks {
+    TraceWriter *trace;
+    Profile *profile;
+    Watchpoints *watch;
+};
+
+#define RUN_TRACE   0x1
+#define RUN_PROFILE 0x2
+#define RUN_WATCH   0x4
+#define RUN_VARIANT_COUNT 8
+
+char *run_variant_names[RUN_VARIANT_COUNT] = {
+    "plain", "trace", "profile", "trace+profile", "watch", "trace+watch", "profile+watch", "trace+profile+watch",
+};
+
+void init_watchpoints(Watchpoints *watch)
+{
+    *watch = {};
+    watch->breakpoints = (u8 *)calloc(SEGMENT_SIZE, sizeof(u8));
+}
+
+void free_watchpoints(Watchpoints *watch)
+{
+    free(watch->breakpoints);
+    *watch = {};
+}
+
+void set_watch_address(Watchpoints *watch, State *state, u32 address)
+{
+    watch->watching = true;
+    watch->watch_address = address;
+    memcpy(&watch->watch_value, state->memory + address, sizeof(u16));
+}
+
+// Runs until IP leaves the code, decoding fails, or when Watching a breakpoint or the
+// watched word stops it. Returns the number of instructions executed. max_instructions
+// is checked between blocks, so a run can go past it by at most one block.
+template<bool Trace, bool Profiling, bool Watching> u64 run_program_with(State *state, DecodeCache *cache, u32 code_end,
+                                                                          u64 max_instructions, RunHooks *hooks)
+{
+    // The clocks of every instruction on its own are only needed to report them, or to
+    // stop in the middle of a block
+    const bool per_instruction_clocks = Trace || Profiling || Watching;
+    
+    state->code_map = cache->code_map;
+    
+    // A snapshot restored over decoded code
+    if (state->code_written) {
+        invalidate_written_code(cache, state);
+    }
+    
+    TraceWriter *writer = Trace ? hooks->trace : 0;
+    Profile *profile = Profiling ? hooks->profile : 0;
+    Watchpoints *watch = Watching ? hooks->watch : 0;
+    
+    TraceRegisters before;
+    if (Trace) {
+        get_trace_registers(state, &before);
+    }
+    
+    u64 executed = 0;
+    while (state->ip_register.value < code_end && executed < max_instructions) {
+        BasicBlock *block = get_block(cache, state, code_end);
+        if (!block) {
+            break;
+        }
+        
+        u16 entry_ip = state->ip_register.value;
+        u64 block_start_clocks = state->clocks;
+        u16 ip = entry_ip;
+        
+        u32 block_executed = 0;
+        Instruction *instruction = block->instructions;
+        for (; block_executed < block->instruction_count; ++instruction) {
+            ip = state->ip_register.value;
+            
+            if (Watching && watch->breakpoints[ip]) {
+                watch->stop = Watch_breakpoint;
+                watch->stop_ip = ip;
+                break;
+            }
+            
+            if (Trace && writer->binary) {
+                // The bytes before running, the instruction can overwrite itself
+                u8 bytes[MAX_INSTRUCTION_SIZE];
+                write_char(&writer->buffer, (char)instruction->bytes_used);
+                write_bytes(&writer->buffer, get_code_bytes(state, ip, bytes), instruction->bytes_used);
+            }
+            
+            u64 clocks_before = state->clocks;
+            if (per_instruction_clocks) {
+                state->clocks += instruction->clocks + instruction->ea_clocks;
+            }
+            state->ip_register.value += instruction->bytes_used;
+            execute_handlers[instruction->handler](state, instruction);
+            ++block_executed;
+            
+            if (Profiling) {
+                ++profile->hits[ip];
+                profile->instruction_clocks[ip] += state->clocks - clocks_before;
+            }
+            
+            if (Trace) {
+                TraceRegisters after;
+                get_trace_registers(state, &after);
+                
+                u32 clocks = (u32)(state->clocks - clocks_before);
+                if (writer->binary) {
+                    write_trace_record_end(&writer->buffer, &before, &after, clocks);
+                } else {
+                    write_trace_line(&writer->buffer, *instruction, &before, &after, clocks, state->clocks);
+                }
+                
+                before = after;
+            }
+            
+            if (Watching && watch->watching) {
+                u16 value;
+                memcpy(&value, state->memory + watch->watch_address, sizeof(u16));
+                if (value != watch->watch_value) {
+                    watch->stop = Watch_changed;
+                    watch->stop_ip = ip;
+                    watch->old_value = watch->watch_value;
+                    watch->watch_value = value;
+                    break;
+                }
+            }
+            
+            // A store into decoded code can have changed the rest of the block, which
+            // has to be decoded again before it runs
+            if (state->code_written) {
+                break;
+            }
+        }
+        
+        if (!per_instruction_clocks) {
+            if (block_executed == block->instruction_count) {
+                state->clocks += block->clocks;
+            } else {
+                for (u32 i = 0; i < block_executed; ++i) {
+                    state->clocks += block->instructions[i].clocks + block->instructions[i].ea_clocks;
+                }
+            }
+        }
+        executed += block_executed;
+        
+        // Left early after rewriting its own code, what ran of it still counts as a run
+        if (Profiling && (block_executed == block->instruction_count || state->code_written)) {
+            Instruction *last = instruction - 1;
+            ++profile->block_hits[entry_ip];
+            profile->block_clocks[entry_ip] += state->clocks - block_start_clocks;
+            profile->block_last[entry_ip] = ip;
+            if (last->operation_type == Op_jmp && state->ip_register.value != (u16)(ip + last->bytes_used)) {
+                ++profile->block_taken[entry_ip];
+            }
+        }
+        
+        if (state->code_written) {
+            invalidate_written_code(cache, state);
+        }
+        
+        if (Trace && writer->buffer.used >= TRACE_FLUSH_SIZE) {
+            flush_text(&writer->buffer, writer->file);
+        }
+        
+        if (Watching && watch->stop != Watch_running) {
+            break;
+        }
+    }
+    
+    if (Profiling) {
+        profile->instructions += executed;
+        profile->clocks = state->clocks;
+    }
+    
+    return executed;
+}
+
+typedef u64 RunProgramProc(State *state, DecodeCache *cache, u32 code_end, u64 max_instructions, RunHooks *hooks);
+
+// Indexed by RUN_* flags
+RunProgramProc *run_program_variants[RUN_VARIANT_COUNT] = {
+    run_program_with<false, false, false>,
+    run_program_with<true,  false, false>,
+    run_program_with<false, true,  false>,
+    run_program_with<true,  true,  false>,
+    run_program_with<false, false, true>,
+    run_program_with<true,  false, true>,
+    run_program_with<false, true,  true>,
+    run_program_with<true,  true,  true>,
+};
+
+// The loop with just the features that have hooks.
+RunProgramProc * select_run_program(RunHooks *hooks)
+{
+    u32 variant = 0;
+    if (hooks->trace)   { variant |= RUN_TRACE; }
+    if (hooks->profile) { variant |= RUN_PROFILE; }
+    if (hooks->watch)   { variant |= RUN_WATCH; }
+    
+    RunProgramProc *result = run_program_variants[variant];
+    
+    return result;
+}
+
+inline u64 run_program(State *state, DecodeCache *cache, u32 code_end, u64 max_instructions = ~0ull)
+{
+    u64 result = run_program_with<false, false, false>(state, cache, code_end, max_instructions, 0);
+    
+    return result;
+}
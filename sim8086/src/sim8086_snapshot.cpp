@@ -0,0 +1,260 @@
+//
+// Snapshots of the whole simulator state: registers, IP, flags, clocks and memory.
+//
+// Only the pages written since the memory was cleared are copied, the rest is zero.
+// Taking a snapshot or restoring one leaves the State synced to it, and from then on
+// the stores note the pages they modify (Page_modified), so restoring the same
+// snapshot again only copies those back. Forking many runs from one warmed-up state
+// costs the pages each run touched, not the megabyte.
+//
+
+#define SNAPSHOT_VERSION 1
+
+// A snapshot file is this header followed by page_count records of the u32 page index
+// and the MEMORY_PAGE_SIZE bytes of the page, like the sparse memory dump.
+struct SnapshotHeader {
+    char magic[4]; // "S86S"
+    u32 version;
+    u16 registers[13]; // State order, then IP
+    u8 word_transfer_clocks[2];
+    u32 flags_a;
+    u32 flags_b;
+    u32 flags_result;
+    u8 flags_operation;
+    u8 flags_bits;
+    u16 reserved;
+    u64 clocks;
+    u32 code_end; // Where the program loaded in the snapshot ends
+    u32 memory_size;
+    u32 page_size;
+    u32 page_count;
+};
+
+struct Snapshot {
+    s64 id;
+    SnapshotHeader header;
+    u32 *pages; // Sorted
+    u8 *page_data; // MEMORY_PAGE_SIZE bytes per page, in the order of pages
+    u32 *page_slots; // Per memory page: index in pages + 1, 0 if the page is zero
+};
+
+// Snapshots loaded or taken in this process, to know which one a State is synced to.
+s64 volatile snapshot_id_counter;
+
+void free_snapshot(Snapshot *snapshot)
+{
+    free(snapshot->pages);
+    free(snapshot->page_data);
+    free(snapshot->page_slots);
+    *snapshot = {};
+}
+
+bool allocate_snapshot_pages(Snapshot *snapshot, u32 memory_size, u32 page_count)
+{
+    u32 memory_page_count = (memory_size + MEMORY_PAGE_SIZE - 1) >> MEMORY_PAGE_SHIFT;
+    
+    snapshot->id = atomic_fetch_add_s64(&snapshot_id_counter, 1) + 1;
+    snapshot->header.memory_size = memory_size;
+    snapshot->header.page_size = MEMORY_PAGE_SIZE;
+    snapshot->header.page_count = page_count;
+    snapshot->pages = (u32 *)malloc((page_count ? page_count : 1)*sizeof(u32));
+    snapshot->page_data = (u8 *)malloc(((size_t)page_count ? page_count : 1)*MEMORY_PAGE_SIZE);
+    snapshot->page_slots = (u32 *)calloc(memory_page_count, sizeof(u32));
+    
+    bool result = snapshot->pages && snapshot->page_data && snapshot->page_slots;
+    
+    return result;
+}
+
+// Stores hitting decoded code are noted in State::code_written, restores do the same
+// for the pages they copy so the decode cache drops what they replaced.
+void note_restored_page(State *state, u32 page)
+{
+    if (!state->code_map) {
+        return;
+    }
+    
+    u32 low = page << MEMORY_PAGE_SHIFT;
+    u32 high = low + MEMORY_PAGE_SIZE;
+    u32 first_line = low >> CODE_LINE_SHIFT;
+    u32 end_line = high >> CODE_LINE_SHIFT;
+    
+    bool has_code = false;
+    for (u32 line = first_line; line < end_line; ++line) {
+        if (state->code_map[line]) {
+            has_code = true;
+            break;
+        }
+    }
+    
+    if (has_code) {
+        note_code_write(state, low, high);
+    }
+}
+
+// Copies what was written of the memory and leaves the state synced to the snapshot.
+bool take_snapshot(State *state, Snapshot *snapshot, u32 code_end)
+{
+    free_snapshot(snapshot);
+    
+    // Sorted in place, the order of first writes is only needed to find the pages
+    qsort(state->written_pages, state->written_page_count, sizeof(u32), compare_pages);
+    
+    if (!allocate_snapshot_pages(snapshot, state->memory_size, state->written_page_count)) {
+        free_snapshot(snapshot);
+        return false;
+    }
+    
+    SnapshotHeader *header = &snapshot->header;
+    memcpy(header->magic, "S86S", 4);
+    header->version = SNAPSHOT_VERSION;
+    for (u32 i = 0; i < 12; ++i) {
+        header->registers[i] = state->registers[i].value;
+    }
+    header->registers[12] = state->ip_register.value;
+    header->word_transfer_clocks[0] = state->word_transfer_clocks[0];
+    header->word_transfer_clocks[1] = state->word_transfer_clocks[1];
+    header->flags_a = state->flags_a;
+    header->flags_b = state->flags_b;
+    header->flags_result = state->flags_result;
+    header->flags_operation = state->flags_operation;
+    header->flags_bits = state->flags_bits;
+    header->clocks = state->clocks;
+    header->code_end = code_end;
+    
+    for (u32 i = 0; i < state->written_page_count; ++i) {
+        u32 page = state->written_pages[i];
+        snapshot->pages[i] = page;
+        snapshot->page_slots[page] = i + 1;
+        memcpy(snapshot->page_data + (size_t)i*MEMORY_PAGE_SIZE, state->memory + ((size_t)page << MEMORY_PAGE_SHIFT), MEMORY_PAGE_SIZE);
+        state->page_flags[page] &= ~Page_modified;
+    }
+    
+    state->modified_page_count = 0;
+    state->snapshot_id = snapshot->id;
+    
+    return true;
+}
+
+inline void restore_snapshot_page(State *state, Snapshot *snapshot, u32 page)
+{
+    u8 *memory_page = state->memory + ((size_t)page << MEMORY_PAGE_SHIFT);
+    u32 slot = snapshot->page_slots[page];
+    if (slot) {
+        memcpy(memory_page, snapshot->page_data + (size_t)(slot - 1)*MEMORY_PAGE_SIZE, MEMORY_PAGE_SIZE);
+        state->page_flags[page] = Page_written | Page_changed;
+    } else {
+        memset(memory_page, 0, MEMORY_PAGE_SIZE);
+        state->page_flags[page] = 0;
+    }
+    
+    note_restored_page(state, page);
+}
+
+// Puts the state back as it was when the snapshot was taken. Fails if the memory is not
+// the size of the one the snapshot was taken from.
+bool restore_snapshot(State *state, Snapshot *snapshot)
+{
+    SnapshotHeader *header = &snapshot->header;
+    if (header->memory_size != state->memory_size) {
+        return false;
+    }
+    
+    if (state->snapshot_id == snapshot->id) {
+        for (u32 i = 0; i < state->modified_page_count; ++i) {
+            restore_snapshot_page(state, snapshot, state->modified_pages[i]);
+        }
+    } else {
+        for (u32 i = 0; i < state->written_page_count; ++i) {
+            note_restored_page(state, state->written_pages[i]);
+        }
+        clear_written_memory(state);
+        
+        for (u32 i = 0; i < header->page_count; ++i) {
+            restore_snapshot_page(state, snapshot, snapshot->pages[i]);
+        }
+    }
+    
+    memcpy(state->written_pages, snapshot->pages, header->page_count*sizeof(u32));
+    state->written_page_count = header->page_count;
+    state->modified_page_count = 0;
+    state->snapshot_id = snapshot->id;
+    
+    for (u32 i = 0; i < 12; ++i) {
+        state->registers[i].value = header->registers[i];
+    }
+    state->ip_register.value = header->registers[12];
+    state->word_transfer_clocks[0] = header->word_transfer_clocks[0];
+    state->word_transfer_clocks[1] = header->word_transfer_clocks[1];
+    state->flags_a = header->flags_a;
+    state->flags_b = header->flags_b;
+    state->flags_result = header->flags_result;
+    state->flags_operation = header->flags_operation;
+    state->flags_bits = header->flags_bits;
+    state->clocks = header->clocks;
+    
+    return true;
+}
+
+bool save_snapshot(Snapshot *snapshot, char *path)
+{
+    FILE *file = fopen(path, "wb");
+    if (!file) {
+        return false;
+    }
+    
+    fwrite(&snapshot->header, sizeof(snapshot->header), 1, file);
+    for (u32 i = 0; i < snapshot->header.page_count; ++i) {
+        fwrite(snapshot->pages + i, sizeof(u32), 1, file);
+        fwrite(snapshot->page_data + (size_t)i*MEMORY_PAGE_SIZE, 1, MEMORY_PAGE_SIZE, file);
+    }
+    
+    bool result = !ferror(file);
+    fclose(file);
+    
+    return result;
+}
+
+bool load_snapshot(Snapshot *snapshot, char *path)
+{
+    *snapshot = {};
+    
+    FILE *file = fopen(path, "rb");
+    if (!file) {
+        return false;
+    }
+    
+    SnapshotHeader header;
+    bool result = fread(&header, sizeof(header), 1, file) == 1 &&
+        memcmp(header.magic, "S86S", 4) == 0 &&
+        header.version == SNAPSHOT_VERSION &&
+        header.page_size == MEMORY_PAGE_SIZE &&
+        header.page_count <= (header.memory_size >> MEMORY_PAGE_SHIFT);
+    
+    if (result) {
+        result = allocate_snapshot_pages(snapshot, header.memory_size, header.page_count);
+        s64 id = snapshot->id;
+        snapshot->header = header;
+        snapshot->id = id;
+    }
+    
+    for (u32 i = 0; result && i < header.page_count; ++i) {
+        u32 page;
+        result = fread(&page, sizeof(page), 1, file) == 1 &&
+            page < (header.memory_size >> MEMORY_PAGE_SHIFT) &&
+            (i == 0 || page > snapshot->pages[i - 1]) &&
+            fread(snapshot->page_data + (size_t)i*MEMORY_PAGE_SIZE, 1, MEMORY_PAGE_SIZE, file) == MEMORY_PAGE_SIZE;
+        if (result) {
+            snapshot->pages[i] = page;
+            snapshot->page_slots[page] = i + 1;
+        }
+    }
+    
+    fclose(file);
+    
+    if (!result) {
+        free_snapshot(snapshot);
+    }
+    
+    return result;
+}
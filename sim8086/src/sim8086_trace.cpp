@@ -0,0 +1,264 @@
+//
+// Execution traces. Every executed instruction is written with what it changed in the
+// registers, IP and flags: as text in the format of the reference traces in data/, or
+// as compact binary records that --trace-to-text turns into the same text later.
+//
+// Records are formatted by hand into a big buffer, which is written with one fwrite at
+// the end of a block once it is half full, so long traces do not go through stdio for
+// every line.
+//
+
+#define TRACE_BUFFER_SIZE MEGABYTES(1)
+#define TRACE_FLUSH_SIZE (TRACE_BUFFER_SIZE / 2)
+
+// The instruction with its clocks, then every register, IP and the flags changing.
+#define MAX_TRACE_RECORD_SIZE (MAX_INSTRUCTION_TEXT + 14*32)
+
+static_assert(TRACE_BUFFER_SIZE - TRACE_FLUSH_SIZE >= MAX_BLOCK_INSTRUCTIONS*MAX_TRACE_RECORD_SIZE,
+              "the buffer is only flushed between blocks, so a whole block has to fit in what is left");
+
+#define TRACE_REGISTER_COUNT 13
+#define TRACE_FLAGS_BIT (1 << TRACE_REGISTER_COUNT)
+
+// The 12 registers in State order, then IP.
+char *trace_register_names[TRACE_REGISTER_COUNT] = {
+    "ax", "bx", "cx", "dx", "sp", "bp", "si", "di", "es", "cs", "ss", "ds", "ip",
+};
+
+struct TraceRegisters {
+    u16 values[TRACE_REGISTER_COUNT];
+    u16 flags;
+};
+
+// A binary trace starts with this header, followed by one record per instruction:
+//     u8 size and the bytes of the instruction, as they were when it ran
+//     u16 mask: bit i set if values[i] of TraceRegisters changed, TRACE_FLAGS_BIT for the flags
+//     u16 new value of everything in the mask, in bit order
+//     u16 clocks taken by the instruction
+#define TRACE_VERSION 1
+
+struct TraceHeader {
+    char magic[4]; // "S86T"
+    u8 version;
+    u8 cpu;
+    u16 reserved;
+    TraceRegisters initial;
+};
+
+struct TraceWriter {
+    FILE *file;
+    bool binary;
+    TextBuffer buffer;
+};
+
+inline void get_trace_registers(State *state, TraceRegisters *registers)
+{
+    for (u32 i = 0; i < 12; ++i) {
+        registers->values[i] = state->registers[i].value;
+    }
+    registers->values[12] = state->ip_register.value;
+    registers->flags = get_flags(state);
+}
+
+void write_flag_letters(TextBuffer *buffer, u16 flags)
+{
+    if (flags & FLAG_CARRY)           { write_char(buffer, 'C'); }
+    if (flags & FLAG_PARITY)          { write_char(buffer, 'P'); }
+    if (flags & FLAG_AUXILIARY_CARRY) { write_char(buffer, 'A'); }
+    if (flags & FLAG_ZERO)            { write_char(buffer, 'Z'); }
+    if (flags & FLAG_SIGN)            { write_char(buffer, 'S'); }
+    if (flags & FLAG_OVERFLOW)        { write_char(buffer, 'O'); }
+}
+
+// mov bx, 1000 ; Clocks: +4 = 4 | bx:0x0->0x3e8 ip:0x0->0x3
+void write_trace_line(TextBuffer *buffer, Instruction instruction, TraceRegisters *before, TraceRegisters *after,
+                      u32 clocks, u64 total_clocks)
+{
+    write_instruction(buffer, instruction);
+    write_instruction_clocks(buffer, instruction, clocks, total_clocks);
+    write_string(buffer, " | ");
+    
+    for (u32 i = 0; i < TRACE_REGISTER_COUNT; ++i) {
+        if (before->values[i] != after->values[i]) {
+            write_string(buffer, trace_register_names[i]);
+            write_char(buffer, ':');
+            write_hex(buffer, before->values[i]);
+            write_string(buffer, "->");
+            write_hex(buffer, after->values[i]);
+            write_char(buffer, ' ');
+        }
+    }
+    
+    if (before->flags != after->flags) {
+        write_string(buffer, "flags:");
+        write_flag_letters(buffer, before->flags);
+        write_string(buffer, "->");
+        write_flag_letters(buffer, after->flags);
+        write_char(buffer, ' ');
+    }
+    
+    write_char(buffer, '\n');
+}
+
+inline void write_u16(TextBuffer *buffer, u16 value)
+{
+    write_bytes(buffer, &value, sizeof(value));
+}
+
+void write_trace_record_end(TextBuffer *buffer, TraceRegisters *before, TraceRegisters *after, u32 clocks)
+{
+    u16 mask = 0;
+    for (u32 i = 0; i < TRACE_REGISTER_COUNT; ++i) {
+        if (before->values[i] != after->values[i]) {
+            mask |= (1 << i);
+        }
+    }
+    if (before->flags != after->flags) {
+        mask |= TRACE_FLAGS_BIT;
+    }
+    
+    write_u16(buffer, mask);
+    for (u32 i = 0; i < TRACE_REGISTER_COUNT; ++i) {
+        if (mask & (1 << i)) {
+            write_u16(buffer, after->values[i]);
+        }
+    }
+    if (mask & TRACE_FLAGS_BIT) {
+        write_u16(buffer, after->flags);
+    }
+    write_u16(buffer, (u16)clocks);
+}
+
+void begin_trace(TraceWriter *writer, FILE *file, bool binary, State *state, CpuModel cpu)
+{
+    *writer = {};
+    writer->file = file;
+    writer->binary = binary;
+    writer->buffer.data = (char *)malloc(TRACE_BUFFER_SIZE);
+    writer->buffer.capacity = TRACE_BUFFER_SIZE;
+    
+    if (binary) {
+        TraceHeader header = {};
+        memcpy(header.magic, "S86T", 4);
+        header.version = TRACE_VERSION;
+        header.cpu = (u8)cpu;
+        get_trace_registers(state, &header.initial);
+        write_bytes(&writer->buffer, &header, sizeof(header));
+    }
+}
+
+void end_trace(TraceWriter *writer)
+{
+    flush_text(&writer->buffer, writer->file);
+    if (writer->file) {
+        fflush(writer->file);
+    }
+    free(writer->buffer.data);
+    writer->buffer = {};
+}
+
+// Writes a binary trace as text to stdout, the same lines a text trace of the run has.
+int convert_trace(char *filename)
+{
+    FILE *file = fopen(filename, "rb");
+    if (!file) {
+        printf("ERROR: could not read file %s\n", filename);
+        return 1;
+    }
+    
+    fseek(file, 0, SEEK_END);
+    u32 size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    
+    u8 *trace = (u8 *)malloc(size ? size : 1);
+    fread(trace, size, 1, file);
+    fclose(file);
+    
+    TraceHeader header;
+    if (size < sizeof(header) || memcmp(trace, "S86T", 4) != 0 || trace[4] != TRACE_VERSION) {
+        printf("ERROR: %s is not a binary trace\n", filename);
+        free(trace);
+        return 1;
+    }
+    memcpy(&header, trace, sizeof(header));
+    
+    TextBuffer buffer = {};
+    buffer.data = (char *)malloc(TRACE_BUFFER_SIZE);
+    buffer.capacity = TRACE_BUFFER_SIZE;
+    
+    TraceRegisters before = header.initial;
+    u64 total_clocks = 0;
+    
+    int result = 0;
+    u8 *at = trace + sizeof(header);
+    u8 *end = trace + size;
+    while (at < end) {
+        // The size byte, the instruction and the mask, the values are checked once the mask is known
+        u32 remaining = (u32)(end - at);
+        u8 bytes_used = at[0];
+        if (remaining < 1u + bytes_used + 2) {
+            result = 1;
+            break;
+        }
+        
+        FileContent code = {};
+        code.memory = at + 1;
+        code.total_size = bytes_used;
+        code.size_remaining = bytes_used;
+        
+        Instruction instruction;
+        if (!decode_instruction(&code, &instruction)) {
+            result = 1;
+            break;
+        }
+        at += 1 + bytes_used;
+        
+        u16 mask;
+        memcpy(&mask, at, 2);
+        at += 2;
+        
+        u32 value_count = 1; // The clocks
+        for (u32 bit = 0; bit <= TRACE_REGISTER_COUNT; ++bit) {
+            value_count += (mask >> bit) & 1;
+        }
+        if ((u32)(end - at) < value_count*2) {
+            result = 1;
+            break;
+        }
+        
+        TraceRegisters after = before;
+        for (u32 i = 0; i < TRACE_REGISTER_COUNT; ++i) {
+            if (mask & (1 << i)) {
+                memcpy(&after.values[i], at, 2);
+                at += 2;
+            }
+        }
+        if (mask & TRACE_FLAGS_BIT) {
+            memcpy(&after.flags, at, 2);
+            at += 2;
+        }
+        
+        u16 clocks;
+        memcpy(&clocks, at, 2);
+        at += 2;
+        
+        total_clocks += clocks;
+        write_trace_line(&buffer, instruction, &before, &after, clocks, total_clocks);
+        before = after;
+        
+        if (buffer.used >= TRACE_FLUSH_SIZE) {
+            flush_text(&buffer, stdout);
+        }
+    }
+    
+    flush_text(&buffer, stdout);
+    
+    if (result) {
+        printf("ERROR: %s is cut short or corrupt at byte %u\n", filename, (u32)(at - trace));
+    }
+    
+    free(buffer.data);
+    free(trace);
+    
+    return result;
+}